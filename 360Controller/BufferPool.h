@@ -0,0 +1,83 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    BufferPool.h - lock-free allocation of slots in a fixed set of buffers
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __BUFFERPOOL_H__
+#define __BUFFERPOOL_H__
+
+#ifdef __APPLE__
+#include <libkern/OSTypes.h>
+#else
+#include <stdint.h>
+typedef uint32_t UInt32;
+#endif
+
+// One bit of the mask per slot
+#define XBOX360_POOL_MAX        32
+
+// The driver owns the buffers themselves, the pool only tracks which are busy.
+// Slots can be claimed and released from any thread.
+typedef struct XBOX360_BUFFER_POOL {
+    UInt32 available;           // One bit set per free slot
+    UInt32 count;
+    UInt32 rejected;            // Claims turned away because every slot was busy
+    UInt32 peak;                // Most slots busy at once, only approximate under contention
+} XBOX360_BUFFER_POOL;
+
+static inline void Xbox360_PoolInit(XBOX360_BUFFER_POOL *pool, UInt32 count)
+{
+    if (count > XBOX360_POOL_MAX)
+        count = XBOX360_POOL_MAX;
+    pool->count = count;
+    pool->available = (count == XBOX360_POOL_MAX) ? 0xFFFFFFFF : ((1U << count) - 1);
+    pool->rejected = 0;
+    pool->peak = 0;
+}
+
+// Claims the lowest free slot, returning its index or -1 if every slot is busy.
+// Reusing the lowest slots first keeps the busy buffers warm in the cache.
+static inline int Xbox360_PoolAlloc(XBOX360_BUFFER_POOL *pool)
+{
+    UInt32 available = __atomic_load_n(&pool->available, __ATOMIC_RELAXED);
+    UInt32 busy;
+    int slot;
+
+    do {
+        if (available == 0) {
+            __atomic_fetch_add(&pool->rejected, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        slot = __builtin_ctz(available);
+    } while (!__atomic_compare_exchange_n(&pool->available, &available, available & ~(1U << slot),
+                                          true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    busy = pool->count - __builtin_popcount(available) + 1;
+    if (busy > __atomic_load_n(&pool->peak, __ATOMIC_RELAXED))
+        __atomic_store_n(&pool->peak, busy, __ATOMIC_RELAXED);
+    return slot;
+}
+
+// Returns a slot claimed by Xbox360_PoolAlloc
+static inline void Xbox360_PoolFree(XBOX360_BUFFER_POOL *pool, int slot)
+{
+    __atomic_fetch_or(&pool->available, 1U << slot, __ATOMIC_RELEASE);
+}
+
+#endif // __BUFFERPOOL_H__
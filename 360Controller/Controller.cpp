@@ -98,7 +98,7 @@ IOReturn Xbox360ControllerClass::setReport(IOMemoryDescriptor *report,IOHIDRepor
 			report->readBytes(2,data,2);
 			rumble.big=data[0];
 			rumble.little=data[1];
-			GetOwner(this)->QueueWrite(&rumble,sizeof(rumble));
+			GetOwner(this)->QueueRumble(&rumble,sizeof(rumble));
 			// IOLog("Set rumble: big(%d) little(%d)\n", rumble.big, rumble.little);
 		}
             return kIOReturnSuccess;
@@ -132,19 +132,29 @@ IOReturn Xbox360ControllerClass::handleReport(IOMemoryDescriptor * descriptor, I
         IOBufferMemoryDescriptor *desc = OSDynamicCast(IOBufferMemoryDescriptor, descriptor);
         if (desc != NULL) {
             XBOX360_IN_REPORT *report=(XBOX360_IN_REPORT*)desc->getBytesNoCopy();
-            if ((report->header.command==inReport) && (report->header.size==sizeof(XBOX360_IN_REPORT))) {
-                GetOwner(this)->fiddleReport(report->left, report->right);
-                if (!(GetOwner(this)->noMapping))
-                    remapButtons(report);
-                if (GetOwner(this)->swapSticks)
-                    remapAxes(report);
-            }
+            if ((report->header.command==inReport) && (report->header.size==sizeof(XBOX360_IN_REPORT)))
+                GetOwner(this)->TransformReport(report);
         }
     }
-    IOReturn ret = IOHIDDevice::handleReport(descriptor, reportType, options);
+    IOReturn ret = dispatchReport(descriptor, reportType, options);
     return ret;
 }
 
+// Passes a finished report on to the HID stack, unless the owner filters it out as a repeat
+IOReturn Xbox360ControllerClass::dispatchReport(IOMemoryDescriptor *descriptor, IOHIDReportType reportType, IOOptionBits options)
+{
+    if ((reportType == kIOHIDReportTypeInput) && (descriptor->getLength() >= sizeof(XBOX360_IN_REPORT))) {
+        IOBufferMemoryDescriptor *desc = OSDynamicCast(IOBufferMemoryDescriptor, descriptor);
+        if (desc != NULL) {
+            const XBOX360_IN_REPORT *report=(const XBOX360_IN_REPORT*)desc->getBytesNoCopy();
+            if ((report->header.command==inReport) && (report->header.size==sizeof(XBOX360_IN_REPORT))
+                && !GetOwner(this)->FilterReport(report))
+                return kIOReturnSuccess;
+        }
+    }
+    return IOHIDDevice::handleReport(descriptor, reportType, options);
+}
+
 
 // Returns the string for the specified index from the USB device's string list, with an optional default
 OSString* Xbox360ControllerClass::getDeviceString(UInt8 index,const char *def) const
@@ -229,41 +239,6 @@ OSNumber* Xbox360ControllerClass::newLocationIDNumber() const
     return (location != 0) ? OSNumber::withNumber(location, 32) : 0;
 }
 
-void Xbox360ControllerClass::remapButtons(void *buffer)
-{
-    XBOX360_IN_REPORT *report360 = (XBOX360_IN_REPORT*)buffer;
-    UInt16 new_buttons = 0;
-
-    new_buttons |= ((report360->buttons & 1) == 1) << GetOwner(this)->mapping[0];
-    new_buttons |= ((report360->buttons & 2) == 2) << GetOwner(this)->mapping[1];
-    new_buttons |= ((report360->buttons & 4) == 4) << GetOwner(this)->mapping[2];
-    new_buttons |= ((report360->buttons & 8) == 8) << GetOwner(this)->mapping[3];
-    new_buttons |= ((report360->buttons & 16) == 16) << GetOwner(this)->mapping[4];
-    new_buttons |= ((report360->buttons & 32) == 32) << GetOwner(this)->mapping[5];
-    new_buttons |= ((report360->buttons & 64) == 64) << GetOwner(this)->mapping[6];
-    new_buttons |= ((report360->buttons & 128) == 128) << GetOwner(this)->mapping[7];
-    new_buttons |= ((report360->buttons & 256) == 256) << GetOwner(this)->mapping[8];
-    new_buttons |= ((report360->buttons & 512) == 512) << GetOwner(this)->mapping[9];
-    new_buttons |= ((report360->buttons & 1024) == 1024) << GetOwner(this)->mapping[10];
-    new_buttons |= ((report360->buttons & 4096) == 4096) << GetOwner(this)->mapping[11];
-    new_buttons |= ((report360->buttons & 8192) == 8192) << GetOwner(this)->mapping[12];
-    new_buttons |= ((report360->buttons & 16384) == 16384) << GetOwner(this)->mapping[13];
-    new_buttons |= ((report360->buttons & 32768) == 32768) << GetOwner(this)->mapping[14];
-
-//    IOLog("BUTTON PACKET - %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d\n", GetOwner(this)->mapping[0], GetOwner(this)->mapping[1], GetOwner(this)->mapping[2], GetOwner(this)->mapping[3], GetOwner(this)->mapping[4], GetOwner(this)->mapping[5], GetOwner(this)->mapping[6], GetOwner(this)->mapping[7], GetOwner(this)->mapping[8], GetOwner(this)->mapping[9], GetOwner(this)->mapping[10], GetOwner(this)->mapping[11], GetOwner(this)->mapping[12], GetOwner(this)->mapping[13], GetOwner(this)->mapping[14]);
-
-    report360->buttons = new_buttons;
-}
-
-void Xbox360ControllerClass::remapAxes(void *buffer)
-{
-    XBOX360_IN_REPORT *report360 = (XBOX360_IN_REPORT*)buffer;
-
-    XBOX360_HAT temp = report360->left;
-    report360->left = report360->right;
-    report360->right = temp;
-}
-
 
 #pragma mark - XboxOnePretend360Class
 
@@ -428,7 +403,7 @@ IOReturn XboxOriginalControllerClass::setReport(IOMemoryDescriptor *report,IOHID
             report->readBytes(2,data,2);
             rumble.left=data[0]; // CHECKME != big, little
             rumble.right=data[1];
-            GetOwner(this)->QueueWrite(&rumble,sizeof(rumble));
+            GetOwner(this)->QueueRumble(&rumble,sizeof(rumble));
             // IOLog("Set rumble: big(%d) little(%d)\n", rumble.big, rumble.little);
         }
             return kIOReturnSuccess;
@@ -692,18 +667,12 @@ IOReturn XboxOneControllerClass::handleReport(IOMemoryDescriptor * descriptor, I
             {
                 convertFromXboxOne(report, report->header.size);
                 XBOX360_IN_REPORT *report360=(XBOX360_IN_REPORT*)report;
-                if (!(GetOwner(this)->noMapping))
-                    remapButtons(report360);
-                GetOwner(this)->fiddleReport(report360->left, report360->right);
-
-                if (GetOwner(this)->swapSticks)
-                    remapAxes(report360);
-
+                GetOwner(this)->TransformReport(report360);
                 memcpy(lastData, report360, sizeof(XBOX360_IN_REPORT));
             }
         }
     }
-    IOReturn ret = IOHIDDevice::handleReport(descriptor, reportType, options);
+    IOReturn ret = dispatchReport(descriptor, reportType, options);
     return ret;
 }
 
@@ -756,7 +725,7 @@ IOReturn XboxOneControllerClass::setReport(IOMemoryDescriptor *report,IOHIDRepor
                 rumble.big = data[3];
             }
 
-            GetOwner(this)->QueueWrite(&rumble,13);
+            GetOwner(this)->QueueRumble(&rumble,13);
             return kIOReturnSuccess;
         case 0x01: // Unsupported LED
             return kIOReturnSuccess;
@@ -33,6 +33,9 @@ private:
 private:
     OSString* getDeviceString(UInt8 index,const char *def=NULL) const;
 
+protected:
+    IOReturn dispatchReport(IOMemoryDescriptor *report, IOHIDReportType reportType, IOOptionBits options);
+
 public:
     virtual bool start(IOService *provider);
 
@@ -57,9 +60,6 @@ public:
     virtual OSNumber* newVendorIDNumber() const;
 
     virtual OSNumber* newLocationIDNumber() const;
-
-    virtual void remapButtons(void *buffer);
-    virtual void remapAxes(void *buffer);
 };
 
 
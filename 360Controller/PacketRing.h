@@ -0,0 +1,98 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    PacketRing.h - lock-free queue of packets between one producer and one consumer
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __PACKETRING_H__
+#define __PACKETRING_H__
+
+#include <string.h>
+#ifdef __APPLE__
+#include <libkern/OSTypes.h>
+#else
+#include <stdint.h>
+typedef uint8_t UInt8;
+typedef uint32_t UInt32;
+#endif
+
+// Must be a power of two
+#define XBOX360_RING_SLOTS      16
+// Large enough for any interrupt packet from a full speed pad
+#define XBOX360_RING_SLOT_SIZE  64
+
+typedef struct XBOX360_RING_SLOT {
+    UInt32 length;
+    UInt8 data[XBOX360_RING_SLOT_SIZE];
+} XBOX360_RING_SLOT;
+
+// The producer only writes head and the consumer only writes tail, so neither
+// side needs a lock. Each count runs freely and wraps, with the slot being
+// the count modulo XBOX360_RING_SLOTS.
+typedef struct XBOX360_PACKET_RING {
+    UInt32 head;                // Next slot to fill
+    UInt32 tail;                // Next slot to empty
+    UInt32 dropped;             // Packets lost because the ring was full, written by the producer
+    XBOX360_RING_SLOT slots[XBOX360_RING_SLOTS];
+} XBOX360_PACKET_RING;
+
+static inline void Xbox360_RingReset(XBOX360_PACKET_RING *ring)
+{
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+}
+
+// Producer: copies a packet into the ring, returning false if it was full
+static inline bool Xbox360_RingPut(XBOX360_PACKET_RING *ring, const void *data, UInt32 length)
+{
+    const UInt32 head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    XBOX360_RING_SLOT *slot;
+
+    if ((head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) >= XBOX360_RING_SLOTS) {
+        ring->dropped++;
+        return false;
+    }
+    if (length > XBOX360_RING_SLOT_SIZE)
+        length = XBOX360_RING_SLOT_SIZE;
+    slot = &ring->slots[head & (XBOX360_RING_SLOTS - 1)];
+    memcpy(slot->data, data, length);
+    slot->length = length;
+    // Publish the slot only once its contents are written
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Consumer: returns the oldest packet without removing it, or NULL if the ring is empty
+static inline const XBOX360_RING_SLOT* Xbox360_RingPeek(XBOX360_PACKET_RING *ring)
+{
+    const UInt32 tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->slots[tail & (XBOX360_RING_SLOTS - 1)];
+}
+
+// Consumer: hands the oldest slot back to the producer
+static inline void Xbox360_RingPop(XBOX360_PACKET_RING *ring)
+{
+    __atomic_store_n(&ring->tail, __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
+
+#endif // __PACKETRING_H__
@@ -0,0 +1,148 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    ReadRecovery.h - backoff for restarting reads on a pipe that has failed
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __READRECOVERY_H__
+#define __READRECOVERY_H__
+
+#ifdef __APPLE__
+#include <libkern/OSTypes.h>
+#else
+#include <stdint.h>
+typedef uint32_t UInt32;
+#endif
+
+// Wait before the first attempt to restart the reads, in ms, doubling each time
+#define XBOX360_RECOVERY_FIRST      10
+// Attempts without a good read in between before the device is reset
+#define XBOX360_RECOVERY_ATTEMPTS   6
+
+// A failed read leaves its buffer idle, and the driver restarts the idle reads
+// after a delay from a timer rather than from the completion. The counters are
+// only written from there and from the completions of the pipe.
+typedef struct XBOX360_READ_RECOVERY {
+    UInt32 attempts;            // Restarts since the last good read
+    UInt32 idle;                // One bit set per read buffer waiting to be restarted
+    bool pending;               // The timer is armed
+    bool resetting;             // The device is being reset, with the idle reads kept for after it
+    UInt32 restarts;            // Reads aborted by clearing the stall, to be queued again
+    UInt32 errors;              // Reads that failed
+    UInt32 recoveries;          // Times the reads were restarted
+    UInt32 resets;              // Times the device was reset after running out of attempts
+} XBOX360_READ_RECOVERY;
+
+static inline void Xbox360_RecoveryInit(XBOX360_READ_RECOVERY *recovery)
+{
+    recovery->attempts = 0;
+    recovery->idle = 0;
+    recovery->pending = false;
+    recovery->resetting = false;
+    recovery->restarts = 0;
+    recovery->errors = 0;
+    recovery->recoveries = 0;
+    recovery->resets = 0;
+}
+
+// Completion: a read came back with data, so the pipe is healthy again
+static inline void Xbox360_RecoveryGood(XBOX360_READ_RECOVERY *recovery)
+{
+    if (recovery->attempts != 0)
+        __atomic_store_n(&recovery->attempts, 0, __ATOMIC_RELAXED);
+}
+
+// Completion: marks a read buffer as waiting to be restarted. Returns true if
+// the caller should arm the timer, false if it already is.
+static inline bool Xbox360_RecoveryPark(XBOX360_READ_RECOVERY *recovery, int buffer)
+{
+    __atomic_fetch_or(&recovery->idle, 1U << buffer, __ATOMIC_RELEASE);
+    return !__atomic_exchange_n(&recovery->pending, true, __ATOMIC_ACQ_REL);
+}
+
+// Returns the delay before the next restart, in ms, doubling with every attempt
+static inline UInt32 Xbox360_RecoveryDelay(XBOX360_READ_RECOVERY *recovery)
+{
+    UInt32 attempts = __atomic_fetch_add(&recovery->attempts, 1, __ATOMIC_RELAXED);
+
+    if (attempts > XBOX360_RECOVERY_ATTEMPTS)
+        attempts = XBOX360_RECOVERY_ATTEMPTS;
+    return XBOX360_RECOVERY_FIRST << attempts;
+}
+
+// Timer: the reads still queued are about to be aborted by clearing the stall,
+// and this many of them should be queued again as they come back
+static inline void Xbox360_RecoverySetRestarts(XBOX360_READ_RECOVERY *recovery, UInt32 count)
+{
+    __atomic_store_n(&recovery->restarts, count, __ATOMIC_RELEASE);
+}
+
+// Completion: a read came back aborted. Returns true if it should be queued
+// again, using up one of the restarts.
+static inline bool Xbox360_RecoveryTakeRestart(XBOX360_READ_RECOVERY *recovery)
+{
+    UInt32 restarts = __atomic_load_n(&recovery->restarts, __ATOMIC_ACQUIRE);
+
+    while (restarts != 0) {
+        if (__atomic_compare_exchange_n(&recovery->restarts, &restarts, restarts - 1, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return true;
+    }
+    return false;
+}
+
+// Timer: true once restarting the reads has failed too many times in a row
+static inline bool Xbox360_RecoveryExhausted(XBOX360_READ_RECOVERY *recovery)
+{
+    return __atomic_load_n(&recovery->attempts, __ATOMIC_RELAXED) > XBOX360_RECOVERY_ATTEMPTS;
+}
+
+// Timer: takes the set of read buffers to restart. Anything failing after this
+// arms the timer again.
+static inline UInt32 Xbox360_RecoveryTake(XBOX360_READ_RECOVERY *recovery)
+{
+    __atomic_store_n(&recovery->pending, false, __ATOMIC_RELEASE);
+    return __atomic_exchange_n(&recovery->idle, 0, __ATOMIC_ACQ_REL);
+}
+
+// Timer: claims the device reset once the attempts have run out, returning
+// false if one is already under way. The idle reads and the pending flag are
+// left alone, so reads failing during the reset only add to the idle set.
+static inline bool Xbox360_RecoveryBeginReset(XBOX360_READ_RECOVERY *recovery)
+{
+    if (__atomic_exchange_n(&recovery->resetting, true, __ATOMIC_ACQ_REL))
+        return false;
+    __atomic_store_n(&recovery->attempts, 0, __ATOMIC_RELAXED);
+    recovery->resets++;
+    return true;
+}
+
+// Timer: true while the reads are held back for a reset
+static inline bool Xbox360_RecoveryResetting(XBOX360_READ_RECOVERY *recovery)
+{
+    return __atomic_load_n(&recovery->resetting, __ATOMIC_ACQUIRE);
+}
+
+// The reset is over. The caller then runs the timer to restart the idle reads.
+static inline void Xbox360_RecoveryEndReset(XBOX360_READ_RECOVERY *recovery)
+{
+    __atomic_store_n(&recovery->resetting, false, __ATOMIC_RELEASE);
+}
+
+#endif // __READRECOVERY_H__
@@ -0,0 +1,456 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    ReportTransform.h - processing applied to input reports by all the controller drivers
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __REPORTTRANSFORM_H__
+#define __REPORTTRANSFORM_H__
+
+// This file only depends on the basic integer types, so it can also be built
+// outside the kernel to test and measure the report processing
+#include <string.h>
+#ifdef __APPLE__
+#include <libkern/OSTypes.h>
+#else
+#include <stdint.h>
+typedef uint8_t UInt8;
+typedef uint16_t UInt16;
+typedef int16_t SInt16;
+typedef uint32_t UInt32;
+typedef int32_t SInt32;
+typedef uint64_t UInt64;
+typedef int64_t SInt64;
+#if !defined(__LITTLE_ENDIAN__) && !defined(__BIG_ENDIAN__)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define __LITTLE_ENDIAN__ 1
+#else
+#define __BIG_ENDIAN__ 1
+#endif
+#endif
+#endif
+
+#include "ControlStruct.h"
+
+// Number of distinct raw values a single axis can take
+#define XBOX360_AXIS_VALUES     65536
+
+// Largest magnitude an axis or stick can report
+#define XBOX360_AXIS_MAX        32767
+
+// The radial curve is sampled every 32 units of stick magnitude
+#define XBOX360_CURVE_SHIFT     5
+#define XBOX360_CURVE_POINTS    ((XBOX360_AXIS_MAX >> XBOX360_CURVE_SHIFT) + 1)
+
+// Exponent of the response curve in percent, 100 being linear
+#define XBOX360_CURVE_LINEAR    100
+#define XBOX360_CURVE_MAX       400
+
+// Everything needed to turn the raw value of one stick into its final value.
+// The map already contains the deadzone and normalisation, so the per-report
+// work is an XOR for the inversion and a table load per axis.
+// Radial sticks instead look up the magnitude of the whole stick in the
+// curve, which only costs an integer square root and a division.
+typedef struct XBOX360_STICK_TABLE {
+    UInt16 invertX, invertY;    // XOR masks, 0x0000 or 0xFFFF
+    SInt16 deadzone;
+    bool linked;                // Both axes must be inside the deadzone to zero the stick
+    bool radial;                // The deadzone and curve apply to the stick's distance from centre
+    SInt16 map[XBOX360_AXIS_VALUES];
+    SInt16 curve[XBOX360_CURVE_POINTS + 1];
+} XBOX360_STICK_TABLE;
+
+// How each stick is processed, picked once from the settings
+enum StickMode {
+    stickAxial      = 0x00,
+    stickLinked     = 0x01,
+    stickRadial     = 0x02
+};
+
+// This returns the abs() value of a short, swapping it if necessary
+static inline Xbox360_SShort Xbox360_GetAbsolute(Xbox360_SShort value)
+{
+    Xbox360_SShort reverse;
+
+#ifdef __LITTLE_ENDIAN__
+    reverse=value;
+#elif __BIG_ENDIAN__
+    reverse=((value&0xFF00)>>8)|((value&0x00FF)<<8);
+#else
+#error Unknown CPU byte order
+#endif
+    return (reverse<0)?~reverse:reverse;
+}
+
+// Rescales an axis so the range outside the deadzone covers the full output range.
+// Only used when building tables, never per report.
+static inline SInt16 Xbox360_NormalizeAxis(SInt16 axis, short deadzone)
+{
+    static const UInt16 max16=32767;
+    const float current=Xbox360_GetAbsolute(axis);
+    const float maxVal=max16-deadzone;
+
+    if (current>deadzone) {
+        if (axis<0) {
+            axis=max16*(current-deadzone)/maxVal;
+            axis=~axis;
+        } else {
+            axis=max16*(current-deadzone)/maxVal;
+        }
+    } else {
+        axis=0;
+    }
+    return axis;
+}
+
+// Returns floor(sqrt(value)), taking a fixed 16 steps whatever the input
+static inline UInt32 Xbox360_SquareRoot(UInt32 value)
+{
+    UInt32 root = 0;
+    UInt32 bit = 1U << 30;
+
+    // No branches on the value, so the cost doesn't depend on where the stick is
+    while (bit != 0)
+    {
+        const UInt32 trial = root + bit;
+        const UInt32 mask = 0U - (UInt32)(value >= trial);
+
+        value -= trial & mask;
+        root = (root >> 1) + (bit & mask);
+        bit >>= 2;
+    }
+    return root;
+}
+
+// Raises a value from 0 to XBOX360_AXIS_MAX to a power given in percent,
+// blending between the integer powers either side of it
+static inline SInt32 Xbox360_ApplyCurve(SInt32 value, short curve)
+{
+    SInt32 lower, upper;
+
+    if (curve < XBOX360_CURVE_LINEAR)
+        curve = XBOX360_CURVE_LINEAR;
+    else if (curve > XBOX360_CURVE_MAX)
+        curve = XBOX360_CURVE_MAX;
+    lower = value;
+    for (int i = XBOX360_CURVE_LINEAR; i <= curve - XBOX360_CURVE_LINEAR; i += XBOX360_CURVE_LINEAR)
+        lower = (lower * value) / XBOX360_AXIS_MAX;
+    upper = (lower * value) / XBOX360_AXIS_MAX;
+    return lower + ((upper - lower) * (curve % XBOX360_CURVE_LINEAR)) / XBOX360_CURVE_LINEAR;
+}
+
+// Shapes the magnitude of an axis or stick, from 0 to XBOX360_AXIS_MAX, with the
+// rescale, curve and anti-deadzone settings. Only used when building tables.
+static inline SInt16 Xbox360_ShapeMagnitude(SInt32 value, short deadzone, bool normalize,
+                                            short antiDeadzone, short curve)
+{
+    if (normalize && (deadzone > 0))
+    {
+        if ((value <= deadzone) || (deadzone >= XBOX360_AXIS_MAX))
+            return 0;
+        value = ((value - deadzone) * XBOX360_AXIS_MAX) / (XBOX360_AXIS_MAX - deadzone);
+    }
+    if (value <= 0)
+        return 0;
+    value = Xbox360_ApplyCurve(value, curve);
+    if (antiDeadzone > 0)
+        value = antiDeadzone + (value * (XBOX360_AXIS_MAX - antiDeadzone)) / XBOX360_AXIS_MAX;
+    return (SInt16)value;
+}
+
+// Fills in the table for one stick from the user's settings
+static inline void Xbox360_BuildStickTable(XBOX360_STICK_TABLE *table, bool invertX, bool invertY,
+                                           short deadzone, bool linked, bool normalize,
+                                           bool radial, short antiDeadzone, short curve)
+{
+    const bool shaped = (antiDeadzone > 0) || (curve > XBOX360_CURVE_LINEAR);
+
+    if (antiDeadzone >= XBOX360_AXIS_MAX)
+        antiDeadzone = XBOX360_AXIS_MAX - 1;
+    table->invertX = invertX ? 0xFFFF : 0x0000;
+    table->invertY = invertY ? 0xFFFF : 0x0000;
+    table->deadzone = deadzone;
+    table->radial = radial && ((deadzone > 0) || shaped);
+    table->linked = linked && (deadzone != 0) && !table->radial;
+
+    for (int i = 0; i < XBOX360_AXIS_VALUES; i++)
+    {
+        SInt16 axis = (SInt16)(UInt16)i;
+
+        if (table->radial)
+            ;   // The whole stick is shaped per report instead
+        else if ((deadzone != 0) && !linked && (Xbox360_GetAbsolute(axis) < deadzone))
+            axis = 0;
+        else if (shaped)
+        {
+            SInt16 magnitude = Xbox360_ShapeMagnitude(Xbox360_GetAbsolute(axis), deadzone, normalize,
+                                                      antiDeadzone, curve);
+            axis = (axis < 0) ? ~magnitude : magnitude;
+        }
+        else if ((deadzone != 0) && normalize)
+            axis = Xbox360_NormalizeAxis(axis, deadzone);
+        table->map[i] = axis;
+    }
+    for (int i = 0; i <= XBOX360_CURVE_POINTS; i++)
+    {
+        SInt32 magnitude = i << XBOX360_CURVE_SHIFT;
+
+        if (magnitude > XBOX360_AXIS_MAX)
+            magnitude = XBOX360_AXIS_MAX;
+        // Points inside the deadzone are only used to interpolate up to its edge
+        if ((deadzone > 0) && (magnitude <= deadzone))
+            magnitude = deadzone + 1;
+        table->curve[i] = table->radial
+            ? Xbox360_ShapeMagnitude(magnitude, deadzone, normalize, antiDeadzone, curve)
+            : magnitude;
+    }
+}
+
+// Applies a stick table to a stick from a report
+template <bool kLinked>
+static inline void Xbox360_ApplyStickTable(const XBOX360_STICK_TABLE *table, XBOX360_HAT& stick)
+{
+    const SInt16 x = stick.x ^ table->invertX;
+    const SInt16 y = stick.y ^ table->invertY;
+
+    if (kLinked && (Xbox360_GetAbsolute(x) < table->deadzone) && (Xbox360_GetAbsolute(y) < table->deadzone)) {
+        stick.x = 0;
+        stick.y = 0;
+    } else {
+        stick.x = table->map[(UInt16)x];
+        stick.y = table->map[(UInt16)y];
+    }
+}
+
+// Applies a radial stick table to a stick from a report, scaling both axes by
+// the shaped distance of the stick from centre
+static inline void Xbox360_ApplyRadialTable(const XBOX360_STICK_TABLE *table, XBOX360_HAT& stick)
+{
+    const SInt32 x = (SInt16)(stick.x ^ table->invertX);
+    const SInt32 y = (SInt16)(stick.y ^ table->invertY);
+    const UInt32 magnitude = Xbox360_SquareRoot((UInt32)(x * x) + (UInt32)(y * y));
+    UInt32 index, fraction, shaped, scale;
+
+    if ((magnitude == 0) || ((SInt32)magnitude < table->deadzone)) {
+        stick.x = 0;
+        stick.y = 0;
+        return;
+    }
+    // Interpolate between the two nearest points of the curve
+    index = (magnitude > XBOX360_AXIS_MAX) ? XBOX360_AXIS_MAX : magnitude;
+    fraction = index & ((1 << XBOX360_CURVE_SHIFT) - 1);
+    index >>= XBOX360_CURVE_SHIFT;
+    shaped = table->curve[index]
+           + (((table->curve[index + 1] - table->curve[index]) * (SInt32)fraction) >> XBOX360_CURVE_SHIFT);
+    // The magnitude is never less than either axis, so neither result can overflow
+    scale = (shaped << 16) / magnitude;
+    stick.x = (SInt16)(((SInt64)x * scale) >> 16);
+    stick.y = (SInt16)(((SInt64)y * scale) >> 16);
+}
+
+// Applies a stick table in the given mode
+template <unsigned kMode>
+static inline void Xbox360_ShapeStick(const XBOX360_STICK_TABLE *table, XBOX360_HAT& stick)
+{
+    if (kMode & stickRadial)
+        Xbox360_ApplyRadialTable(table, stick);
+    else
+        Xbox360_ApplyStickTable<(kMode & stickLinked) != 0>(table, stick);
+}
+
+// Applies a stick table to an array of sticks
+template <bool kLinked>
+static inline void Xbox360_ApplyStickTable(const XBOX360_STICK_TABLE *table, XBOX360_HAT *sticks, int count)
+{
+    for (int i = 0; i < count; i++)
+        Xbox360_ApplyStickTable<kLinked>(table, sticks[i]);
+}
+
+// Remapped value of each button, split by byte of the button field
+typedef struct XBOX360_BUTTON_TABLE {
+    UInt16 low[256];
+    UInt16 high[256];
+} XBOX360_BUTTON_TABLE;
+
+// Fills in the button table from the bindings, where mapping[i] is the bit
+// that the i-th button (bit 11 is unused) should be moved to
+static inline void Xbox360_BuildButtonTable(XBOX360_BUTTON_TABLE *table, const UInt8 *mapping)
+{
+    UInt16 bits[16];
+
+    for (int i = 0; i < 16; i++)
+    {
+        int target;
+
+        if (i < 11)
+            target = mapping[i];
+        else if (i > 11)
+            target = mapping[i - 1];
+        else
+            target = 16;
+        bits[i] = (target < 16) ? (UInt16)(1 << target) : 0;
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        table->low[i] = 0;
+        table->high[i] = 0;
+        for (int j = 0; j < 8; j++)
+        {
+            if (i & (1 << j))
+            {
+                table->low[i] |= bits[j];
+                table->high[i] |= bits[j + 8];
+            }
+        }
+    }
+}
+
+// Moves each button to the bit the user bound it to
+static inline void Xbox360_RemapButtons(XBOX360_IN_REPORT *report, const XBOX360_BUTTON_TABLE *table)
+{
+    report->buttons = table->low[report->buttons & 0xFF] | table->high[report->buttons >> 8];
+}
+
+// Remaps the buttons of several reports at once
+static inline void Xbox360_RemapButtons(XBOX360_IN_REPORT *reports, int count, const XBOX360_BUTTON_TABLE *table)
+{
+    for (int i = 0; i < count; i++)
+        Xbox360_RemapButtons(&reports[i], table);
+}
+
+// Exchanges the left and right sticks
+static inline void Xbox360_SwapSticks(XBOX360_IN_REPORT *report)
+{
+    XBOX360_HAT temp = report->left;
+    report->left = report->right;
+    report->right = temp;
+}
+
+// Everything the transform functions read, owned by the driver
+typedef struct XBOX360_TRANSFORM_STATE {
+    const XBOX360_STICK_TABLE *left, *right;
+    const XBOX360_BUTTON_TABLE *buttons;
+} XBOX360_TRANSFORM_STATE;
+
+// Settings that change which stages run
+enum TransformFlags {
+    transformLeftMode       = 0x03,     // StickMode of the left stick
+    transformRightMode      = 0x0C,     // StickMode of the right stick, shifted by transformRightShift
+    transformRemapButtons   = 0x10,
+    transformSwapSticks     = 0x20,
+    transformFlagCount      = 0x40,
+    transformRightShift     = 2
+};
+
+typedef void (*XBOX360_REPORT_TRANSFORM)(XBOX360_IN_REPORT *report, const XBOX360_TRANSFORM_STATE *state);
+
+// One instance of this is generated per combination of flags, so each report runs
+// a single function without testing any settings.
+template <unsigned kFlags>
+static void Xbox360_TransformReport(XBOX360_IN_REPORT *report, const XBOX360_TRANSFORM_STATE *state)
+{
+    Xbox360_ShapeStick<kFlags & transformLeftMode>(state->left, report->left);
+    Xbox360_ShapeStick<((kFlags & transformRightMode) >> transformRightShift)>(state->right, report->right);
+    if (kFlags & transformRemapButtons)
+        Xbox360_RemapButtons(report, state->buttons);
+    if (kFlags & transformSwapSticks)
+        Xbox360_SwapSticks(report);
+}
+
+// Works out the mode of a stick from its table
+static inline unsigned Xbox360_StickMode(const XBOX360_STICK_TABLE *table)
+{
+    return table->radial ? stickRadial : (table->linked ? stickLinked : stickAxial);
+}
+
+// Works out the flags for a set of settings
+static inline unsigned Xbox360_TransformFlags(const XBOX360_STICK_TABLE *left, const XBOX360_STICK_TABLE *right,
+                                              bool remapButtons, bool swapSticks)
+{
+    return Xbox360_StickMode(left)
+         | (Xbox360_StickMode(right) << transformRightShift)
+         | (remapButtons ? transformRemapButtons : 0)
+         | (swapSticks ? transformSwapSticks : 0);
+}
+
+// Returns the transform function for a set of flags
+static inline XBOX360_REPORT_TRANSFORM Xbox360_SelectTransform(unsigned flags)
+{
+#define TRANSFORM4(n) &Xbox360_TransformReport<(n)>, &Xbox360_TransformReport<(n) + 1>, \
+                      &Xbox360_TransformReport<(n) + 2>, &Xbox360_TransformReport<(n) + 3>
+#define TRANSFORM16(n) TRANSFORM4(n), TRANSFORM4((n) + 4), TRANSFORM4((n) + 8), TRANSFORM4((n) + 12)
+    static const XBOX360_REPORT_TRANSFORM transforms[transformFlagCount] = {
+        TRANSFORM16(0), TRANSFORM16(16), TRANSFORM16(32), TRANSFORM16(48)
+    };
+#undef TRANSFORM16
+#undef TRANSFORM4
+
+    return transforms[flags % transformFlagCount];
+}
+
+// Runs a transform over several reports in one go
+static inline void Xbox360_TransformReports(XBOX360_REPORT_TRANSFORM transform, XBOX360_IN_REPORT *reports, int count,
+                                            const XBOX360_TRANSFORM_STATE *state)
+{
+    for (int i = 0; i < count; i++)
+        transform(&reports[i], state);
+}
+
+// How reports identical to the last one passed on are handled
+enum FilterModes {
+    filterOff       = 0,    // Pass every report on
+    filterDrop      = 1,    // Drop every repeat
+    filterKeepalive = 2     // Drop repeats, except one every keepalive milliseconds
+};
+
+// Remembers the last report passed on, to spot repeats of it
+typedef struct XBOX360_REPORT_FILTER {
+    UInt8 mode;
+    UInt32 keepalive;           // Milliseconds
+    bool valid;                 // Set once last holds a report
+    UInt64 lastTime;            // When last was passed on, in milliseconds
+    XBOX360_IN_REPORT last;
+    UInt32 passed, suppressed;
+} XBOX360_REPORT_FILTER;
+
+// Changes the settings of a filter, keeping its counters
+static inline void Xbox360_SetFilter(XBOX360_REPORT_FILTER *filter, UInt8 mode, UInt32 keepalive)
+{
+    filter->mode = mode;
+    filter->keepalive = keepalive;
+    filter->valid = false;
+}
+
+// Returns true if the report should be passed on, given the time in milliseconds
+static inline bool Xbox360_FilterReport(XBOX360_REPORT_FILTER *filter, const XBOX360_IN_REPORT *report, UInt64 now)
+{
+    if ((filter->mode != filterOff) && filter->valid
+        && ((filter->mode == filterDrop) || ((now - filter->lastTime) < filter->keepalive))
+        && (memcmp(&filter->last, report, sizeof(XBOX360_IN_REPORT)) == 0)) {
+        filter->suppressed++;
+        return false;
+    }
+    filter->last = *report;
+    filter->valid = true;
+    filter->lastTime = now;
+    filter->passed++;
+    return true;
+}
+
+#endif // __REPORTTRANSFORM_H__
@@ -0,0 +1,124 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    RumbleMailbox.h - holds back rumble updates while one is being sent
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __RUMBLEMAILBOX_H__
+#define __RUMBLEMAILBOX_H__
+
+#include <string.h>
+#ifdef __APPLE__
+#include <libkern/OSTypes.h>
+#else
+#include <stdint.h>
+typedef uint8_t UInt8;
+typedef uint32_t UInt32;
+#endif
+
+// Large enough for the rumble packet of any controller
+#define XBOX360_MAILBOX_SIZE    32
+
+// Only one rumble packet is ever on its way to the device. Anything posted
+// meanwhile waits in the mailbox, replacing whatever was waiting before, and
+// goes out once the write in flight completes. The caller must serialise
+// access with its own lock, but should not hold it while writing to the pipe.
+typedef struct XBOX360_RUMBLE_MAILBOX {
+    bool busy;                  // A rumble write is in flight
+    UInt32 length;              // Size of the waiting packet, or 0 if there is none
+    UInt8 pending[XBOX360_MAILBOX_SIZE];
+    UInt32 sent;
+    UInt32 coalesced;           // Updates replaced by a newer one before they were sent
+} XBOX360_RUMBLE_MAILBOX;
+
+static inline void Xbox360_MailboxInit(XBOX360_RUMBLE_MAILBOX *mailbox)
+{
+    mailbox->busy = false;
+    mailbox->length = 0;
+    mailbox->sent = 0;
+    mailbox->coalesced = 0;
+}
+
+// Returns true if the caller should write the packet now, or false if it was
+// left in the mailbox behind the write in flight
+static inline bool Xbox360_MailboxPost(XBOX360_RUMBLE_MAILBOX *mailbox, const void *data, UInt32 length)
+{
+    if (length > XBOX360_MAILBOX_SIZE)
+        length = XBOX360_MAILBOX_SIZE;
+    if (mailbox->length != 0)
+        mailbox->coalesced++;
+    if (!mailbox->busy) {
+        mailbox->busy = true;
+        mailbox->length = 0;
+        mailbox->sent++;
+        return true;
+    }
+    memcpy(mailbox->pending, data, length);
+    mailbox->length = length;
+    return false;
+}
+
+// Call once the write in flight has completed, whether or not it succeeded.
+// Copies out the waiting packet, which the caller must then write, and
+// returns its size. Returns 0 when the mailbox was empty, leaving it idle.
+static inline UInt32 Xbox360_MailboxNext(XBOX360_RUMBLE_MAILBOX *mailbox, void *data)
+{
+    const UInt32 length = mailbox->length;
+
+    if (length == 0) {
+        mailbox->busy = false;
+        return 0;
+    }
+    memcpy(data, mailbox->pending, length);
+    mailbox->length = 0;
+    mailbox->sent++;
+    return length;
+}
+
+// Call when the write of a packet from Post or Next could not be started.
+// If a newer packet arrived meanwhile, copies it over data for the caller to
+// try instead and returns its size. Otherwise keeps the packet waiting in the
+// mailbox, left idle so the next post or completion sends it, and returns 0.
+static inline UInt32 Xbox360_MailboxRetry(XBOX360_RUMBLE_MAILBOX *mailbox, void *data, UInt32 length)
+{
+    if (mailbox->length != 0) {
+        mailbox->coalesced++;
+        return Xbox360_MailboxNext(mailbox, data);
+    }
+    if (length > XBOX360_MAILBOX_SIZE)
+        length = XBOX360_MAILBOX_SIZE;
+    memcpy(mailbox->pending, data, length);
+    mailbox->length = length;
+    mailbox->busy = false;
+    mailbox->sent--;
+    return 0;
+}
+
+// Call when some other write completes, freeing a buffer. If a packet was
+// kept by Retry, claims it as Post would, copies it out and returns its size
+// for the caller to write. Returns 0 otherwise.
+static inline UInt32 Xbox360_MailboxResume(XBOX360_RUMBLE_MAILBOX *mailbox, void *data)
+{
+    if (mailbox->busy || (mailbox->length == 0))
+        return 0;
+    mailbox->busy = true;
+    return Xbox360_MailboxNext(mailbox, data);
+}
+
+#endif // __RUMBLEMAILBOX_H__
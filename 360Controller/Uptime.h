@@ -0,0 +1,39 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    Uptime.h - millisecond clock shared by the drivers
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __UPTIME_H__
+#define __UPTIME_H__
+
+#include <libkern/OSTypes.h>
+#include <kern/clock.h>
+
+// Returns the time since boot in milliseconds
+static inline UInt64 Xbox360_GetUptimeMS(void)
+{
+    UInt64 now, ns;
+
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now, &ns);
+    return ns / 1000000;
+}
+
+#endif // __UPTIME_H__
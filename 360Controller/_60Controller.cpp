@@ -27,8 +27,17 @@
 #include "_60Controller.h"
 #include "ChatPad.h"
 #include "Controller.h"
+#include "Uptime.h"
 
 #define kDriverSettingKey       "DeviceData"
+#define kReadQueueDepthKey      "ReadQueueDepth"
+#define kReportStatisticsKey    "ReportStatistics"
+#define kWritesRejectedKey      "WritesRejected"
+#define kWritePeakKey           "WritePeak"
+#define kRumbleCoalescedKey     "RumbleCoalesced"
+#define kReadErrorsKey          "ReadErrors"
+#define kReadRecoveriesKey      "ReadRecoveries"
+#define kDeviceResetsKey        "DeviceResets"
 
 #define kIOSerialDeviceType   "Serial360Device"
 
@@ -250,8 +259,24 @@ void Xbox360Peripheral::readSettings(void)
     if (value != NULL) deadOffLeft = value->getValue();
     value = OSDynamicCast(OSBoolean, dataDictionary->getObject("DeadOffRight"));
     if (value != NULL) deadOffRight = value->getValue();
+    value = OSDynamicCast(OSBoolean, dataDictionary->getObject("RadialLeft"));
+    if (value != NULL) radialLeft = value->getValue();
+    value = OSDynamicCast(OSBoolean, dataDictionary->getObject("RadialRight"));
+    if (value != NULL) radialRight = value->getValue();
+    number = OSDynamicCast(OSNumber, dataDictionary->getObject("AntiDeadzoneLeft"));
+    if (number != NULL) antiDeadzoneLeft = number->unsigned32BitValue();
+    number = OSDynamicCast(OSNumber, dataDictionary->getObject("AntiDeadzoneRight"));
+    if (number != NULL) antiDeadzoneRight = number->unsigned32BitValue();
+    number = OSDynamicCast(OSNumber, dataDictionary->getObject("CurveLeft"));
+    if (number != NULL) curveLeft = number->unsigned32BitValue();
+    number = OSDynamicCast(OSNumber, dataDictionary->getObject("CurveRight"));
+    if (number != NULL) curveRight = number->unsigned32BitValue();
     number = OSDynamicCast(OSNumber, dataDictionary->getObject("RumbleType"));
     if (number != NULL) rumbleType = number->unsigned8BitValue();
+    number = OSDynamicCast(OSNumber, dataDictionary->getObject("DuplicateReports"));
+    if (number != NULL) duplicateMode = number->unsigned8BitValue();
+    number = OSDynamicCast(OSNumber, dataDictionary->getObject("DuplicateKeepalive"));
+    if (number != NULL) duplicateKeepalive = number->unsigned32BitValue();
     number = OSDynamicCast(OSNumber, dataDictionary->getObject("BindingUp"));
     if (number != NULL) mapping[0] = number->unsigned32BitValue();
     number = OSDynamicCast(OSNumber, dataDictionary->getObject("BindingDown"));
@@ -287,6 +312,8 @@ void Xbox360Peripheral::readSettings(void)
     value = OSDynamicCast(OSBoolean, dataDictionary->getObject("Pretend360"));
     if (value != NULL) pretend360 = value->getValue();
 
+    UpdateStickTables();
+
 #if 0
     IOLog("Xbox360Peripheral preferences loaded:\n  invertLeft X: %s, Y: %s\n   invertRight X: %s, Y:%s\n  deadzone Left: %d, Right: %d\n\n",
           invertLeftX?"True":"False",invertLeftY?"True":"False",
@@ -304,13 +331,32 @@ bool Xbox360Peripheral::init(OSDictionary *propTable)
     interface=NULL;
     inPipe=NULL;
     outPipe=NULL;
-    inBuffer=NULL;
+    for (int i = 0; i < kReadQueueMax; i++)
+        inBuffers[i] = NULL;
+    inBufferCount = 0;
+    reportBuffer = NULL;
+    inSource = NULL;
+    Xbox360_RecoveryInit(&inRecovery);
+    inRecoveryTimer = NULL;
+    inResetCall = NULL;
+    for (int i = 0; i < kWritePoolSize; i++)
+        outBuffers[i] = NULL;
+    Xbox360_PoolInit(&outPool, 0);
+    outStatsSource = NULL;
+    outPublishedRejected = outPublishedPeak = 0;
+    rumbleLock = IOLockAlloc();
+    Xbox360_MailboxInit(&rumbleMailbox);
     padHandler = NULL;
     serialIn = NULL;
     serialInPipe = NULL;
     serialInBuffer = NULL;
     serialTimer = NULL;
     serialHandler = NULL;
+    leftTable = (XBOX360_STICK_TABLE*)IOMalloc(sizeof(XBOX360_STICK_TABLE));
+    rightTable = (XBOX360_STICK_TABLE*)IOMalloc(sizeof(XBOX360_STICK_TABLE));
+    inRing = (XBOX360_PACKET_RING*)IOMalloc(sizeof(XBOX360_PACKET_RING));
+    if ((mainLock == NULL) || (rumbleLock == NULL) || (leftTable == NULL) || (rightTable == NULL) || (inRing == NULL))
+        return false;
     // Default settings
     invertLeftX=invertLeftY=false;
     invertRightX=invertRightY=false;
@@ -318,10 +364,15 @@ bool Xbox360Peripheral::init(OSDictionary *propTable)
     relativeLeft=relativeRight=false;
     deadOffLeft = false;
     deadOffRight = false;
+    radialLeft = radialRight = false;
+    antiDeadzoneLeft = antiDeadzoneRight = 0;
+    curveLeft = curveRight = XBOX360_CURVE_LINEAR;
     swapSticks = false;
     pretend360 = false;
     // Controller Specific
     rumbleType = 0;
+    duplicateMode = filterOff;
+    duplicateKeepalive = 100;
     // Bindings
     noMapping = true;
     for (int i = 0; i < 11; i++)
@@ -332,6 +383,29 @@ bool Xbox360Peripheral::init(OSDictionary *propTable)
     {
         mapping[i-1] = i;
     }
+    UpdateStickTables();
+    transformState.left = leftTable;
+    transformState.right = rightTable;
+    transformState.buttons = &buttonTable;
+    transform = Xbox360_SelectTransform(Xbox360_TransformFlags(leftTable, rightTable, false, false));
+    Xbox360_SetFilter(&filter, duplicateMode, duplicateKeepalive);
+    filterPassed = OSNumber::withNumber((unsigned long long)0, 32);
+    filterSuppressed = OSNumber::withNumber((unsigned long long)0, 32);
+    if ((filterPassed != NULL) && (filterSuppressed != NULL))
+    {
+        OSDictionary *statistics = OSDictionary::withCapacity(2);
+
+        if (statistics != NULL)
+        {
+            statistics->setObject("Passed", filterPassed);
+            statistics->setObject("Suppressed", filterSuppressed);
+            setProperty(kReportStatisticsKey, statistics);
+            statistics->release();
+        }
+    }
+    rumbleCoalesced = OSNumber::withNumber((unsigned long long)0, 32);
+    if (rumbleCoalesced != NULL)
+        setProperty(kRumbleCoalescedKey, rumbleCoalesced);
     // Done
     return res;
 }
@@ -339,7 +413,24 @@ bool Xbox360Peripheral::init(OSDictionary *propTable)
 // Free the extension
 void Xbox360Peripheral::free(void)
 {
-    IOLockFree(mainLock);
+    if (leftTable != NULL)
+        IOFree(leftTable, sizeof(XBOX360_STICK_TABLE));
+    if (rightTable != NULL)
+        IOFree(rightTable, sizeof(XBOX360_STICK_TABLE));
+    if (inRing != NULL)
+        IOFree(inRing, sizeof(XBOX360_PACKET_RING));
+    if (filterPassed != NULL)
+        filterPassed->release();
+    if (filterSuppressed != NULL)
+        filterSuppressed->release();
+    if (rumbleCoalesced != NULL)
+        rumbleCoalesced->release();
+    if (rumbleLock != NULL)
+        IOLockFree(rumbleLock);
+    if (inResetCall != NULL)
+        thread_call_free(inResetCall);
+    if (mainLock != NULL)
+        IOLockFree(mainLock);
     super::free();
 }
 
@@ -350,6 +441,7 @@ bool Xbox360Peripheral::start(IOService *provider)
     IOUSBFindEndpointRequest pipe;
     XBOX360_OUT_LED led;
     IOWorkLoop *workloop = NULL;
+    OSNumber *depth;
 
     if (!super::start(provider))
         return false;
@@ -456,10 +548,72 @@ interfacefound:
         goto fail;
     }
     outPipe->retain();
-    // Get a buffer
-    inBuffer=IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task,kIODirectionIn,GetMaxPacketSize(inPipe));
-    if(inBuffer==NULL) {
-        IOLog("start - failed to allocate input buffer\n");
+    // Get output buffers
+    Xbox360_PoolInit(&outPool, kWritePoolSize);
+    for (int i = 0; i < kWritePoolSize; i++) {
+        outBuffers[i]=IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task,kIODirectionOut,kWriteBufferSize);
+        if(outBuffers[i]==NULL) {
+            IOLog("start - failed to allocate output buffer\n");
+            goto fail;
+        }
+    }
+    // Get buffers
+    depth = OSDynamicCast(OSNumber, getProperty(kReadQueueDepthKey));
+    inBufferCount = (depth != NULL) ? depth->unsigned32BitValue() : kReadQueueDefault;
+    if (inBufferCount < 1)
+        inBufferCount = 1;
+    else if (inBufferCount > kReadQueueMax)
+        inBufferCount = kReadQueueMax;
+    for (int i = 0; i < inBufferCount; i++) {
+        inBuffers[i]=IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task,kIODirectionIn,GetMaxPacketSize(inPipe));
+        if(inBuffers[i]==NULL) {
+            IOLog("start - failed to allocate input buffer\n");
+            goto fail;
+        }
+    }
+    reportBuffer=IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task,kIODirectionIn,GetMaxPacketSize(inPipe));
+    if(reportBuffer==NULL) {
+        IOLog("start - failed to allocate input report\n");
+        goto fail;
+    }
+    // Reports are passed on from the workloop, not the completion
+    Xbox360_RingReset(inRing);
+    inSource = IOInterruptEventSource::interruptEventSource(this, ReportSourceActionWrapper);
+    if (inSource == NULL) {
+        IOLog("start - failed to create report source\n");
+        goto fail;
+    }
+    workloop = getWorkLoop();
+    if ((workloop == NULL) || (workloop->addEventSource(inSource) != kIOReturnSuccess)) {
+        IOLog("start - failed to connect report source\n");
+        inSource->release();
+        inSource = NULL;
+        goto fail;
+    }
+    Xbox360_RecoveryInit(&inRecovery);
+    inRecoveryTimer = IOTimerEventSource::timerEventSource(this, RecoveryTimerActionWrapper);
+    if ((inRecoveryTimer == NULL) || (workloop->addEventSource(inRecoveryTimer) != kIOReturnSuccess)) {
+        IOLog("start - failed to create read recovery timer\n");
+        if (inRecoveryTimer != NULL) {
+            inRecoveryTimer->release();
+            inRecoveryTimer = NULL;
+        }
+        goto fail;
+    }
+    if (inResetCall == NULL)
+        inResetCall = thread_call_allocate(ResetThreadCall, this);
+    if (inResetCall == NULL) {
+        IOLog("start - failed to allocate device reset call\n");
+        goto fail;
+    }
+    // Writes can be started from completions, so their counters are published from the workloop
+    outStatsSource = IOInterruptEventSource::interruptEventSource(this, WriteStatsActionWrapper);
+    if ((outStatsSource == NULL) || (workloop->addEventSource(outStatsSource) != kIOReturnSuccess)) {
+        IOLog("start - failed to create write statistics source\n");
+        if (outStatsSource != NULL) {
+            outStatsSource->release();
+            outStatsSource = NULL;
+        }
         goto fail;
     }
     // Find chatpad interface
@@ -562,18 +716,29 @@ fail:
     return false;
 }
 
-// Set up an asynchronous read
+// Set up an asynchronous read into every input buffer
 bool Xbox360Peripheral::QueueRead(void)
+{
+    for (int i = 0; i < inBufferCount; i++)
+    {
+        if (!QueueRead(inBuffers[i]))
+            return false;
+    }
+    return true;
+}
+
+// Set up an asynchronous read into one input buffer
+bool Xbox360Peripheral::QueueRead(IOBufferMemoryDescriptor *buffer)
 {
     IOUSBCompletion complete;
     IOReturn err;
 
-    if ((inPipe == NULL) || (inBuffer == NULL))
+    if ((inPipe == NULL) || (buffer == NULL))
         return false;
     complete.target=this;
     complete.action=ReadCompleteInternal;
-    complete.parameter=inBuffer;
-    err=inPipe->Read(inBuffer,0,0,inBuffer->getLength(),&complete);
+    complete.parameter=buffer;
+    err=inPipe->Read(buffer,0,0,buffer->getLength(),&complete);
     if(err==kIOReturnSuccess) return true;
     else {
         IOLog("read - failed to start (0x%.8x)\n",err);
@@ -605,24 +770,103 @@ bool Xbox360Peripheral::QueueSerialRead(void)
 
 // Set up an asynchronous write
 bool Xbox360Peripheral::QueueWrite(const void *bytes,UInt32 length)
+{
+    return StartWrite(bytes,length,0);
+}
+
+// Set up an asynchronous rumble write, or leave it in the mailbox if one is in flight
+bool Xbox360Peripheral::QueueRumble(const void *bytes,UInt32 length)
+{
+    UInt8 packet[XBOX360_MAILBOX_SIZE];
+    UInt32 coalesced;
+    bool send;
+
+    if(length>XBOX360_MAILBOX_SIZE) {
+        IOLog("send - rumble packet too large (%d bytes)\n",(int)length);
+        return false;
+    }
+    memcpy(packet,bytes,length);
+    IOLockLock(rumbleLock);
+    send=Xbox360_MailboxPost(&rumbleMailbox,packet,length);
+    coalesced=rumbleMailbox.coalesced;
+    IOLockUnlock(rumbleLock);
+    if(rumbleCoalesced!=NULL)
+        rumbleCoalesced->setValue(coalesced);
+    if(send)
+        SendRumble(packet,length);
+    return true;
+}
+
+// Writes a rumble packet claimed from the mailbox. If the write can't start, a
+// newer packet waiting is tried instead, or else this one stays in the mailbox.
+bool Xbox360Peripheral::SendRumble(UInt8 *packet,UInt32 length)
+{
+    while(!StartWrite(packet,length,kWriteRumble)) {
+        IOLockLock(rumbleLock);
+        length=Xbox360_MailboxRetry(&rumbleMailbox,packet,length);
+        IOLockUnlock(rumbleLock);
+        if(length==0) return false;
+    }
+    return true;
+}
+
+// Sends whatever rumble arrived while the last one was in flight, even if that one failed
+void Xbox360Peripheral::RumbleComplete(IOReturn status)
+{
+    UInt8 packet[XBOX360_MAILBOX_SIZE];
+    UInt32 length;
+
+    IOLockLock(rumbleLock);
+    length=Xbox360_MailboxNext(&rumbleMailbox,packet);
+    IOLockUnlock(rumbleLock);
+    if(length!=0)
+        SendRumble(packet,length);
+}
+
+// Another write freed a buffer, so send any rumble that couldn't get one
+void Xbox360Peripheral::RumbleResume(void)
+{
+    UInt8 packet[XBOX360_MAILBOX_SIZE];
+    UInt32 length;
+
+    IOLockLock(rumbleLock);
+    length=Xbox360_MailboxResume(&rumbleMailbox,packet);
+    IOLockUnlock(rumbleLock);
+    if(length!=0)
+        SendRumble(packet,length);
+}
+
+bool Xbox360Peripheral::StartWrite(const void *bytes,UInt32 length,UInt32 flags)
 {
     IOBufferMemoryDescriptor *outBuffer;
     IOUSBCompletion complete;
     IOReturn err;
+    UInt32 peak=outPool.peak;
+    int slot;
 
-    outBuffer=IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task,kIODirectionOut,length);
-    if(outBuffer==NULL) {
-        IOLog("send - unable to allocate buffer\n");
+    if(length>kWriteBufferSize) {
+        IOLog("send - packet too large (%d bytes)\n",(int)length);
         return false;
     }
+    // Rather than queue up, writes are turned away while every buffer is in flight
+    slot=Xbox360_PoolAlloc(&outPool);
+    if((slot<0)||(outPool.peak!=peak)) {
+        if(outStatsSource!=NULL)
+            outStatsSource->interruptOccurred(NULL,NULL,0);
+        if(slot<0)
+            return false;
+    }
+    outBuffer=outBuffers[slot];
+    outBuffer->setLength(length);
     outBuffer->writeBytes(0,bytes,length);
     complete.target=this;
     complete.action=WriteCompleteInternal;
-    complete.parameter=outBuffer;
+    complete.parameter=(void*)(uintptr_t)(slot|flags);
     err=outPipe->Write(outBuffer,0,0,length,&complete);
     if(err==kIOReturnSuccess) return true;
     else {
         IOLog("send - failed to start (0x%.8x)\n",err);
+        Xbox360_PoolFree(&outPool,slot);
         return false;
     }
 }
@@ -644,6 +888,39 @@ void Xbox360Peripheral::stop(IOService *provider)
 // Releases all the objects used
 void Xbox360Peripheral::ReleaseAll(void)
 {
+    // The report source takes mainLock from the workloop, so it has to be
+    // removed before the lock is taken. Stop the reads that signal it first.
+    if (inSource != NULL)
+    {
+        Xbox360_RecoverySetRestarts(&inRecovery, 0);
+        if (inPipe != NULL)
+            inPipe->Abort();
+        getWorkLoop()->removeEventSource(inSource);
+        inSource->release();
+        inSource = NULL;
+    }
+    if (inRecoveryTimer != NULL)
+    {
+        // Failing reads check for the timer before arming it
+        IOTimerEventSource *timer = inRecoveryTimer;
+
+        inRecoveryTimer = NULL;
+        timer->cancelTimeout();
+        getWorkLoop()->removeEventSource(timer);
+        timer->release();
+    }
+    // A reset still waiting to run holds a reference
+    if ((inResetCall != NULL) && thread_call_cancel(inResetCall))
+        release();
+    if (outStatsSource != NULL)
+    {
+        // Writes check for the source before signalling it
+        IOInterruptEventSource *source = outStatsSource;
+
+        outStatsSource = NULL;
+        getWorkLoop()->removeEventSource(source);
+        source->release();
+    }
     LockRequired locker(mainLock);
 
     SerialDisconnect();
@@ -676,14 +953,27 @@ void Xbox360Peripheral::ReleaseAll(void)
         outPipe->release();
         outPipe=NULL;
     }
+    for (int i = 0; i < kWritePoolSize; i++) {
+        if(outBuffers[i]!=NULL) {
+            outBuffers[i]->release();
+            outBuffers[i]=NULL;
+        }
+    }
     if(inPipe!=NULL) {
         inPipe->Abort();
         inPipe->release();
         inPipe=NULL;
     }
-    if(inBuffer!=NULL) {
-        inBuffer->release();
-        inBuffer=NULL;
+    for (int i = 0; i < kReadQueueMax; i++) {
+        if(inBuffers[i]!=NULL) {
+            inBuffers[i]->release();
+            inBuffers[i]=NULL;
+        }
+    }
+    inBufferCount = 0;
+    if(reportBuffer!=NULL) {
+        reportBuffer->release();
+        reportBuffer=NULL;
     }
     if(interface!=NULL) {
         interface->close(this);
@@ -708,6 +998,10 @@ bool Xbox360Peripheral::didTerminate(IOService *provider, IOOptionBits options,
 IOReturn Xbox360Peripheral::message(UInt32 type,IOService *provider,void *argument)
 {
     switch(type) {
+        case kIOUSBMessagePortHasBeenReset:
+            // Whoever reset it, the reads that stopped have to be started again
+            ResumeReads();
+            return kIOReturnSuccess;
         case kIOMessageServiceIsTerminated:
         case kIOMessageServiceIsRequestingClose:
         default:
@@ -715,92 +1009,16 @@ IOReturn Xbox360Peripheral::message(UInt32 type,IOService *provider,void *argume
     }
 }
 
-// This returns the abs() value of a short, swapping it if necessary
-static inline Xbox360_SShort getAbsolute(Xbox360_SShort value)
+// Rebuilds the stick tables from the current settings
+void Xbox360Peripheral::UpdateStickTables(void)
 {
-    Xbox360_SShort reverse;
-
-#ifdef __LITTLE_ENDIAN__
-    reverse=value;
-#elif __BIG_ENDIAN__
-    reverse=((value&0xFF00)>>8)|((value&0x00FF)<<8);
-#else
-#error Unknown CPU byte order
-#endif
-    return (reverse<0)?~reverse:reverse;
-}
+    LockRequired locker(mainLock);
 
-void Xbox360Peripheral::normalizeAxis(SInt16& axis, short deadzone)
-{
-    static const UInt16 max16=32767;
-    const float current=getAbsolute(axis);
-    const float maxVal=max16-deadzone;
-
-    if (current>deadzone) {
-        if (axis<0) {
-            axis=max16*(current-deadzone)/maxVal;
-            axis=~axis;
-        } else {
-            axis=max16*(current-deadzone)/maxVal;
-        }
-    } else {
-        axis=0;
-    }
-}
-
-void Xbox360Peripheral::fiddleReport(XBOX360_HAT& left, XBOX360_HAT& right)
-{
-    // deadOff - Normalize checkbox is checked if true
-    // relative - Linked checkbox is checked if true
-
-    if(invertLeftX) left.x=~left.x;
-    if(!invertLeftY) left.y=~left.y;
-    if(invertRightX) right.x=~right.x;
-    if(!invertRightY) right.y=~right.y;
-
-    if(deadzoneLeft!=0) {
-        if(relativeLeft) {
-            if((getAbsolute(left.x)<deadzoneLeft)&&(getAbsolute(left.y)<deadzoneLeft)) {
-                left.x=0;
-                left.y=0;
-            }
-            else if(deadOffLeft) {
-                normalizeAxis(left.x, deadzoneLeft);
-                normalizeAxis(left.y, deadzoneLeft);
-            }
-        } else { // Linked checkbox has no check
-            if(getAbsolute(left.x)<deadzoneLeft)
-                left.x=0;
-            else if (deadOffLeft)
-                normalizeAxis(left.x, deadzoneLeft);
-
-            if(getAbsolute(left.y)<deadzoneLeft)
-                left.y=0;
-            else if (deadOffLeft)
-                normalizeAxis(left.y, deadzoneLeft);
-        }
-    }
-    if(deadzoneRight!=0) {
-        if(relativeRight) {
-            if((getAbsolute(right.x)<deadzoneRight)&&(getAbsolute(right.y)<deadzoneRight)) {
-                right.x=0;
-                right.y=0;
-            }
-            else if(deadOffRight) {
-                normalizeAxis(left.x, deadzoneRight);
-                normalizeAxis(left.y, deadzoneRight);
-            }
-        } else {
-            if(getAbsolute(right.x)<deadzoneRight)
-                right.x=0;
-            else if (deadOffRight)
-                normalizeAxis(right.x, deadzoneRight);
-            if(getAbsolute(right.y)<deadzoneRight)
-                right.y=0;
-            else if (deadOffRight)
-                normalizeAxis(right.y, deadzoneRight);
-        }
-    }
+    // The Y axes are flipped unless the user asked for them to be inverted
+    Xbox360_BuildStickTable(leftTable, invertLeftX, !invertLeftY, deadzoneLeft, relativeLeft, deadOffLeft,
+                            radialLeft, antiDeadzoneLeft, curveLeft);
+    Xbox360_BuildStickTable(rightTable, invertRightX, !invertRightY, deadzoneRight, relativeRight, deadOffRight,
+                            radialRight, antiDeadzoneRight, curveRight);
 }
 
 // This forwards a completed read notification to a member function
@@ -823,43 +1041,203 @@ void Xbox360Peripheral::WriteCompleteInternal(void *target,void *parameter,IORet
         ((Xbox360Peripheral*)target)->WriteComplete(parameter,status,bufferSizeRemaining);
 }
 
-// This handles a completed asynchronous read
+// This handles a completed asynchronous read. It only hands the packet over to
+// the workloop and queues the buffer again, so it never waits for mainLock.
 void Xbox360Peripheral::ReadComplete(void *parameter,IOReturn status,UInt32 bufferSizeRemaining)
 {
-    if (padHandler != NULL) // avoid deadlock with release
-    {
-        LockRequired locker(mainLock);
-        IOReturn err;
-        bool reread=!isInactive();
+    IOBufferMemoryDescriptor *buffer=(IOBufferMemoryDescriptor*)parameter;
+    bool reread=!isInactive();
+    bool queued=false;
+
+    if ((padHandler == NULL) || (buffer == NULL)) // being released
+        return;
+    switch(status) {
+        case kIOReturnOverrun:
+            IOLog("read - kIOReturnOverrun, clearing stall\n");
+            // The stall is cleared from the recovery timer, which then queues this read again
+            queued=Xbox360_RingPut(inRing,buffer->getBytesNoCopy(),(UInt32)buffer->getLength());
+            if(reread) ParkRead(buffer,false);
+            reread=false;
+            break;
+        case kIOReturnSuccess:
+            Xbox360_RecoveryGood(&inRecovery);
+            queued=Xbox360_RingPut(inRing,buffer->getBytesNoCopy(),(UInt32)buffer->getLength());
+            break;
+        case kIOReturnAborted:
+            if (!Xbox360_RecoveryTakeRestart(&inRecovery)) {
+                // Reads stopped by a reset wait with the idle ones to be started after it
+                if (reread && Xbox360_RecoveryResetting(&inRecovery)) ParkRead(buffer,false);
+                reread=false;
+            }
+            break;
+        case kIOReturnNotResponding:
+            IOLog("read - kIOReturnNotResponding\n");
+            // Fall through
+        default:
+            // Rather than leave the pipe silent, try again after a while
+            __atomic_fetch_add(&inRecovery.errors,1,__ATOMIC_RELAXED);
+            if(reread) ParkRead(buffer,true);
+            reread=false;
+            break;
+    }
+    if(reread) QueueRead(buffer);
+    if(queued && (inSource != NULL)) inSource->interruptOccurred(NULL, NULL, 0);
+}
 
-        switch(status) {
-            case kIOReturnOverrun:
-                IOLog("read - kIOReturnOverrun, clearing stall\n");
-                if (inPipe != NULL)
-                    inPipe->ClearStall();
-                // Fall through
-            case kIOReturnSuccess:
-                if (inBuffer != NULL)
-                {
-                    const XBOX360_IN_REPORT *report=(const XBOX360_IN_REPORT*)inBuffer->getBytesNoCopy();
-                    if(((report->header.command==inReport)&&(report->header.size==sizeof(XBOX360_IN_REPORT)))
-                       || (report->header.command==0x20) || (report->header.command==0x07)) /* Xbox One */ {
-                        err = padHandler->handleReport(inBuffer, kIOHIDReportTypeInput);
-                        if(err!=kIOReturnSuccess) {
-                            IOLog("read - failed to handle report: 0x%.8x\n",err);
-                        }
-                    }
+// Leaves a read to be restarted by the recovery timer. Failures back off, while
+// an overrun only needs the stall cleared and goes straight away.
+void Xbox360Peripheral::ParkRead(IOBufferMemoryDescriptor *buffer, bool failed)
+{
+    for (int i = 0; i < inBufferCount; i++) {
+        if (inBuffers[i] == buffer) {
+            if (Xbox360_RecoveryPark(&inRecovery, i) && (inRecoveryTimer != NULL))
+                inRecoveryTimer->setTimeoutMS(failed ? Xbox360_RecoveryDelay(&inRecovery) : 1);
+            return;
+        }
+    }
+}
+
+void Xbox360Peripheral::RecoveryTimerActionWrapper(OSObject *owner, IOTimerEventSource *sender)
+{
+    Xbox360Peripheral *controller = OSDynamicCast(Xbox360Peripheral, owner);
+
+    if (controller != NULL)
+        controller->RecoveryTimerAction(sender);
+}
+
+// Clears the stall on the input pipe and restarts the reads that stopped,
+// resetting the device if that keeps failing
+void Xbox360Peripheral::RecoveryTimerAction(IOTimerEventSource *sender)
+{
+    UInt32 idle, failed = 0;
+
+    if (isInactive() || (inPipe == NULL) || Xbox360_RecoveryResetting(&inRecovery))
+        return;
+    if (Xbox360_RecoveryExhausted(&inRecovery)) {
+        // The idle reads are kept, and restarted once the device is back
+        if (Xbox360_RecoveryBeginReset(&inRecovery)) {
+            IOLog("read - reads keep failing, resetting device\n");
+            setProperty(kDeviceResetsKey, inRecovery.resets, 32);
+            retain();
+            if (thread_call_enter(inResetCall))
+                release();
+        }
+        return;
+    }
+    idle = Xbox360_RecoveryTake(&inRecovery);
+    if (idle == 0)
+        return;
+    // Clearing the stall aborts the reads still queued, which are queued again as they come back
+    Xbox360_RecoverySetRestarts(&inRecovery, inBufferCount - __builtin_popcount(idle));
+    inPipe->ClearStall();
+    for (int i = 0; i < inBufferCount; i++) {
+        if ((idle & (1U << i)) && !QueueRead(inBuffers[i]))
+            failed |= 1U << i;
+    }
+    inRecovery.recoveries++;
+    setProperty(kReadErrorsKey, inRecovery.errors, 32);
+    setProperty(kReadRecoveriesKey, inRecovery.recoveries, 32);
+    for (int i = 0; i < inBufferCount; i++) {
+        if (failed & (1U << i))
+            ParkRead(inBuffers[i], true);
+    }
+}
+
+void Xbox360Peripheral::ResetThreadCall(thread_call_param_t param0, thread_call_param_t param1)
+{
+    Xbox360Peripheral *controller = (Xbox360Peripheral*)param0;
+
+    controller->ResetThreadAction();
+    controller->release();
+}
+
+// Resets the device, which blocks until it is done, then restarts the reads
+void Xbox360Peripheral::ResetThreadAction(void)
+{
+    IOUSBDevice *usb = device;
+
+    if (!isInactive() && (usb != NULL))
+        usb->ResetDevice();
+    ResumeReads();
+}
+
+// After a reset, lets the recovery timer restart the reads that were left idle
+void Xbox360Peripheral::ResumeReads(void)
+{
+    IOWorkLoop *workloop = getWorkLoop();
+
+    Xbox360_RecoveryEndReset(&inRecovery);
+    if (workloop != NULL)
+        workloop->runAction(ResumeReadsAction, this);
+}
+
+IOReturn Xbox360Peripheral::ResumeReadsAction(OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    Xbox360Peripheral *controller = OSDynamicCast(Xbox360Peripheral, owner);
+
+    if ((controller != NULL) && !controller->isInactive() && (controller->inRecoveryTimer != NULL))
+        controller->inRecoveryTimer->setTimeoutMS(1);
+    return kIOReturnSuccess;
+}
+
+// Called on the workloop after reads have completed, to pass the reports on
+void Xbox360Peripheral::ReportSourceActionWrapper(OSObject *owner, IOInterruptEventSource *sender, int count)
+{
+    Xbox360Peripheral *controller;
+
+    controller = OSDynamicCast(Xbox360Peripheral, owner);
+    if (controller != NULL)
+        controller->ReportSourceAction(sender, count);
+}
+
+void Xbox360Peripheral::ReportSourceAction(IOInterruptEventSource *sender, int count)
+{
+    LockRequired locker(mainLock);
+    const XBOX360_RING_SLOT *slot;
+    IOReturn err;
+
+    while ((slot = Xbox360_RingPeek(inRing)) != NULL)
+    {
+        if ((padHandler != NULL) && (reportBuffer != NULL))
+        {
+            const XBOX360_IN_REPORT *report=(const XBOX360_IN_REPORT*)slot->data;
+            if(((report->header.command==inReport)&&(report->header.size==sizeof(XBOX360_IN_REPORT)))
+               || (report->header.command==0x20) || (report->header.command==0x07)) /* Xbox One */ {
+                reportBuffer->writeBytes(0,slot->data,slot->length);
+                err = padHandler->handleReport(reportBuffer, kIOHIDReportTypeInput);
+                if(err!=kIOReturnSuccess) {
+                    IOLog("read - failed to handle report: 0x%.8x\n",err);
                 }
-                break;
-            case kIOReturnNotResponding:
-                IOLog("read - kIOReturnNotResponding\n");
-                reread=false;
-                break;
-            default:
-                reread=false;
-                break;
+            }
         }
-        if(reread) QueueRead();
+        Xbox360_RingPop(inRing);
+    }
+}
+
+// Called on the workloop after a write was turned away or the pool reached a new peak
+void Xbox360Peripheral::WriteStatsActionWrapper(OSObject *owner, IOInterruptEventSource *sender, int count)
+{
+    Xbox360Peripheral *controller;
+
+    controller = OSDynamicCast(Xbox360Peripheral, owner);
+    if (controller != NULL)
+        controller->WriteStatsAction(sender, count);
+}
+
+void Xbox360Peripheral::WriteStatsAction(IOInterruptEventSource *sender, int count)
+{
+    const UInt32 rejected = __atomic_load_n(&outPool.rejected, __ATOMIC_RELAXED);
+    const UInt32 peak = __atomic_load_n(&outPool.peak, __ATOMIC_RELAXED);
+
+    if (rejected != outPublishedRejected)
+    {
+        outPublishedRejected = rejected;
+        setProperty(kWritesRejectedKey, rejected, 32);
+    }
+    if (peak != outPublishedPeak)
+    {
+        outPublishedPeak = peak;
+        setProperty(kWritePeakKey, peak, 32);
     }
 }
 
@@ -900,11 +1278,15 @@ void Xbox360Peripheral::SerialReadComplete(void *parameter, IOReturn status, UIn
 // Handle a completed asynchronous write
 void Xbox360Peripheral::WriteComplete(void *parameter,IOReturn status,UInt32 bufferSizeRemaining)
 {
-    IOMemoryDescriptor *memory=(IOMemoryDescriptor*)parameter;
+    int slot=(int)((uintptr_t)parameter&~kWriteRumble);
     if(status!=kIOReturnSuccess) {
         IOLog("write - Error writing: 0x%.8x\n",status);
     }
-    memory->release();
+    Xbox360_PoolFree(&outPool,slot);
+    if((uintptr_t)parameter&kWriteRumble)
+        RumbleComplete(status);
+    else
+        RumbleResume();
 }
 
 
@@ -954,6 +1336,28 @@ void Xbox360Peripheral::MakeSettingsChanges()
             break;
         }
     }
+
+    LockRequired locker(mainLock);
+    Xbox360_BuildButtonTable(&buttonTable, mapping);
+    transform = Xbox360_SelectTransform(Xbox360_TransformFlags(leftTable, rightTable, !noMapping, swapSticks));
+    Xbox360_SetFilter(&filter, duplicateMode, duplicateKeepalive);
+}
+
+// Decides if a finished report is passed on to the HID stack, keeping count of the ones that aren't.
+// Called with mainLock held, from the pad's handleReport.
+bool Xbox360Peripheral::FilterReport(const XBOX360_IN_REPORT *report)
+{
+    bool pass;
+
+    if (filter.mode == filterOff)
+        return true;
+    pass = Xbox360_FilterReport(&filter, report, Xbox360_GetUptimeMS());
+    if ((filterPassed != NULL) && (filterSuppressed != NULL))
+    {
+        filterPassed->setValue(filter.passed);
+        filterSuppressed->setValue(filter.suppressed);
+    }
+    return pass;
 }
 
 
@@ -26,7 +26,25 @@
 #include <IOKit/hid/IOHIDDevice.h>
 #include <IOKit/usb/IOUSBDevice.h>
 #include <IOKit/usb/IOUSBInterface.h>
+#include <IOKit/IOInterruptEventSource.h>
+#include <kern/thread_call.h>
 #include "ControlStruct.h"
+#include "ReportTransform.h"
+#include "PacketRing.h"
+#include "BufferPool.h"
+#include "RumbleMailbox.h"
+#include "ReadRecovery.h"
+
+// Number of reads kept queued on the input pipe, set per device by the
+// ReadQueueDepth key of its personality in Info.plist (1 to kReadQueueMax)
+#define kReadQueueDefault   2
+#define kReadQueueMax       8
+
+// Output buffers reused for every write, each large enough for any packet
+#define kWritePoolSize      8
+#define kWriteBufferSize    64
+// Marks the completion parameter of a rumble write, above any pool slot
+#define kWriteRumble        0x100
 
 class Xbox360ControllerClass;
 class ChatPadKeyboardClass;
@@ -38,11 +56,27 @@ class Xbox360Peripheral : public IOService
 private:
     void ReleaseAll(void);
     bool QueueRead(void);
+    bool QueueRead(IOBufferMemoryDescriptor *buffer);
     bool QueueSerialRead(void);
+    bool StartWrite(const void *bytes,UInt32 length,UInt32 flags);
+    bool SendRumble(UInt8 *packet,UInt32 length);
+    void RumbleComplete(IOReturn status);
+    void RumbleResume(void);
 
     static void SerialReadCompleteInternal(void *target,void *parameter,IOReturn status,UInt32 bufferSizeRemaining);
     static void ReadCompleteInternal(void *target,void *parameter,IOReturn status,UInt32 bufferSizeRemaining);
     static void WriteCompleteInternal(void *target,void *parameter,IOReturn status,UInt32 bufferSizeRemaining);
+    static void ReportSourceActionWrapper(OSObject *owner, IOInterruptEventSource *sender, int count);
+    void ReportSourceAction(IOInterruptEventSource *sender, int count);
+    static void RecoveryTimerActionWrapper(OSObject *owner, IOTimerEventSource *sender);
+    void RecoveryTimerAction(IOTimerEventSource *sender);
+    static void ResetThreadCall(thread_call_param_t param0, thread_call_param_t param1);
+    void ResetThreadAction(void);
+    static IOReturn ResumeReadsAction(OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3);
+    void ResumeReads(void);
+    static void WriteStatsActionWrapper(OSObject *owner, IOInterruptEventSource *sender, int count);
+    void WriteStatsAction(IOInterruptEventSource *sender, int count);
+    void ParkRead(IOBufferMemoryDescriptor *buffer, bool failed);
 
     void SerialReadComplete(void *parameter, IOReturn status, UInt32 bufferSizeRemaining);
 
@@ -63,6 +97,7 @@ private:
     void SerialMessage(IOBufferMemoryDescriptor *data, size_t length);
 
     void MakeSettingsChanges(void);
+    void UpdateStickTables(void);
 
 protected:
     typedef enum TIMER_STATE {
@@ -89,7 +124,21 @@ protected:
     // Joypad
     IOUSBInterface *interface;
     IOUSBPipe *inPipe,*outPipe;
-    IOBufferMemoryDescriptor *inBuffer;
+    IOBufferMemoryDescriptor *inBuffers[kReadQueueMax];
+    int inBufferCount;
+    IOBufferMemoryDescriptor *reportBuffer;    // Report being passed on from the workloop
+    XBOX360_PACKET_RING *inRing;            // Completed reads waiting for the workloop
+    IOInterruptEventSource *inSource;
+    XBOX360_READ_RECOVERY inRecovery;       // Restarts reads that failed, from inRecoveryTimer
+    IOTimerEventSource *inRecoveryTimer;
+    thread_call_t inResetCall;              // Resets the device off the workloop, as that blocks
+    IOBufferMemoryDescriptor *outBuffers[kWritePoolSize];
+    XBOX360_BUFFER_POOL outPool;
+    IOInterruptEventSource *outStatsSource; // Publishes the pool's counters from the workloop
+    UInt32 outPublishedRejected, outPublishedPeak;
+    IOLock *rumbleLock;
+    XBOX360_RUMBLE_MAILBOX rumbleMailbox;   // Newest rumble waiting behind the one in flight
+    OSNumber *rumbleCoalesced;
 
     // Keyboard
     IOUSBInterface *serialIn;
@@ -110,8 +159,23 @@ protected:
     short deadzoneLeft,deadzoneRight;
     bool relativeLeft,relativeRight;
     bool deadOffLeft, deadOffRight;
+    bool radialLeft, radialRight;
+    short antiDeadzoneLeft, antiDeadzoneRight;
+    short curveLeft, curveRight;
+    UInt8 duplicateMode;
+    UInt32 duplicateKeepalive;
 
-    void normalizeAxis(SInt16& axis, short deadzone);
+    // Precomputed from the settings above, indexed by the raw axis value
+    XBOX360_STICK_TABLE *leftTable, *rightTable;
+    XBOX360_BUTTON_TABLE buttonTable;
+
+    // Chosen in MakeSettingsChanges to match the settings
+    XBOX360_REPORT_TRANSFORM transform;
+    XBOX360_TRANSFORM_STATE transformState;
+
+    // Spots repeated reports, with its counters published in the registry
+    XBOX360_REPORT_FILTER filter;
+    OSNumber *filterPassed, *filterSuppressed;
 
 public:
     // Controller specific
@@ -144,7 +208,9 @@ public:
     virtual void WriteComplete(void *parameter,IOReturn status,UInt32 bufferSizeRemaining);
 
     bool QueueWrite(const void *bytes,UInt32 length);
-    void fiddleReport(XBOX360_HAT& left, XBOX360_HAT& right);
+    bool QueueRumble(const void *bytes,UInt32 length);
+    void TransformReport(XBOX360_IN_REPORT *report) { transform(report, &transformState); }
+    bool FilterReport(const XBOX360_IN_REPORT *report);
 
     IOHIDDevice* getController(int index);
 
@@ -0,0 +1,114 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Force Feedback module
+    Copyright (C) 2013 David Ryskalczyk
+
+    CommandQueue.h - bounded queue from any number of threads to the effect thread
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Xbox360Controller; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef Feedback360_CommandQueue_h
+#define Feedback360_CommandQueue_h
+
+#include <stdint.h>
+
+// Each cell carries a sequence number saying whose turn it is: a producer may
+// fill it when the sequence equals its position, and the consumer may empty it
+// once the sequence is one past that. Producers claim positions with a compare
+// and swap, so Post never takes a lock or waits for the consumer. Only one
+// thread may call Take and IsEmpty.
+template <typename T, unsigned Size>
+class CommandQueue
+{
+public:
+    static_assert((Size & (Size - 1)) == 0, "Size must be a power of two");
+
+    CommandQueue() : Tail(0), Head(0), Overflows(0)
+    {
+        for (unsigned i = 0; i < Size; i++)
+            Cells[i].Sequence = i;
+    }
+
+    // Producers: copies a command into the queue, returning false if it was full
+    bool Post(const T &command)
+    {
+        uint32_t position = __atomic_load_n(&Tail, __ATOMIC_RELAXED);
+        Cell *cell;
+
+        for (;;)
+        {
+            cell = &Cells[position & (Size - 1)];
+            int32_t difference = (int32_t)(__atomic_load_n(&cell->Sequence, __ATOMIC_ACQUIRE) - position);
+            if (difference == 0)
+            {
+                if (__atomic_compare_exchange_n(&Tail, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    break;
+            }
+            else if (difference < 0)
+            {
+                __atomic_fetch_add(&Overflows, 1, __ATOMIC_RELAXED);
+                return false;
+            }
+            else
+                position = __atomic_load_n(&Tail, __ATOMIC_RELAXED);
+        }
+        cell->Command = command;
+        // Hand the cell to the consumer only once the command is written
+        __atomic_store_n(&cell->Sequence, position + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Consumer: copies out the oldest command, returning false if there was none
+    bool Take(T *command)
+    {
+        Cell *cell = &Cells[Head & (Size - 1)];
+
+        if (__atomic_load_n(&cell->Sequence, __ATOMIC_ACQUIRE) != Head + 1)
+            return false;
+        *command = cell->Command;
+        // Free the cell for the producers' next time round
+        __atomic_store_n(&cell->Sequence, Head + Size, __ATOMIC_RELEASE);
+        Head++;
+        return true;
+    }
+
+    // Consumer: true if nothing has been posted since the last Take
+    bool IsEmpty(void)
+    {
+        return __atomic_load_n(&Cells[Head & (Size - 1)].Sequence, __ATOMIC_SEQ_CST) != Head + 1;
+    }
+
+    // Commands turned away because the queue was full
+    uint32_t GetOverflows(void) const
+    {
+        return __atomic_load_n(&Overflows, __ATOMIC_RELAXED);
+    }
+
+private:
+    typedef struct Cell {
+        uint32_t Sequence;
+        T Command;
+    } Cell;
+
+    Cell Cells[Size];
+    uint32_t Tail;                  // Next position for a producer to claim
+    uint32_t Head;                  // Next position to take, only used by the consumer
+    uint32_t Overflows;
+};
+
+#endif
@@ -0,0 +1,158 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Force Feedback module
+    Copyright (C) 2013 David Ryskalczyk
+
+    EffectSlotMap.h - storage for downloaded effects, looked up by handle
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Xbox360Controller; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef Feedback360_EffectSlotMap_h
+#define Feedback360_EffectSlotMap_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+
+// Effects are kept in blocks that are never moved, so pointers into an effect
+// (like DiEffect.lpEnvelope) stay valid while it lives. A handle is the slot
+// index in the low 16 bits and the slot's generation above, which never
+// starts at 0, so a handle is never 0 and a stale one is never found again.
+// T is constructed from its handle.
+template <typename T, unsigned Capacity>
+class EffectSlotMap
+{
+public:
+    enum { BlockSize = 16 };
+    static_assert((Capacity % BlockSize) == 0 && Capacity <= 0x10000, "Capacity must be whole blocks with 16 bit slot indexes");
+
+    class Iterator
+    {
+    public:
+        Iterator(EffectSlotMap *map, unsigned position) : Map(map), Position(position) {}
+        T& operator*() const { return *Map->At(Map->Dense[Position]); }
+        T* operator->() const { return Map->At(Map->Dense[Position]); }
+        Iterator& operator++() { Position++; return *this; }
+        bool operator!=(const Iterator &other) const { return Position != other.Position; }
+        bool operator==(const Iterator &other) const { return Position == other.Position; }
+
+    private:
+        EffectSlotMap *Map;
+        unsigned Position;
+    };
+
+    EffectSlotMap() : Count(0), FreeCount(Capacity)
+    {
+        for (unsigned i = 0; i < Capacity / BlockSize; i++)
+            Blocks[i] = NULL;
+        for (unsigned i = 0; i < Capacity; i++)
+        {
+            Generation[i] = 1;
+            Position[i] = 0;
+            // Hand out the lowest slots first
+            Free[i] = (uint16_t)(Capacity - 1 - i);
+        }
+    }
+
+    ~EffectSlotMap()
+    {
+        Clear();
+        for (unsigned i = 0; i < Capacity / BlockSize; i++)
+            operator delete(Blocks[i]);
+    }
+
+    // Creates an effect with a new handle, or returns NULL if every slot is taken
+    T* Insert(void)
+    {
+        unsigned slot;
+        T *element;
+
+        if (FreeCount == 0)
+            return NULL;
+        slot = Free[FreeCount - 1];
+        if (Blocks[slot / BlockSize] == NULL)
+        {
+            Blocks[slot / BlockSize] = (T*)operator new(sizeof(T) * BlockSize, std::nothrow);
+            if (Blocks[slot / BlockSize] == NULL)
+                return NULL;
+        }
+        FreeCount--;
+        element = new (At(slot)) T(MakeHandle(slot));
+        Position[slot] = (uint16_t)Count;
+        Dense[Count++] = (uint16_t)slot;
+        return element;
+    }
+
+    // Returns the effect for a handle, or NULL if it was destroyed or never existed
+    T* Find(uint32_t handle)
+    {
+        unsigned slot = handle & 0xFFFF;
+
+        if ((slot >= Capacity) || (Generation[slot] != (handle >> 16)) || !IsUsed(slot))
+            return NULL;
+        return At(slot);
+    }
+
+    bool Erase(uint32_t handle)
+    {
+        unsigned slot = handle & 0xFFFF;
+        unsigned position;
+
+        if (Find(handle) == NULL)
+            return false;
+        At(slot)->~T();
+        // Keep the live effects packed by moving the last one into the gap
+        position = Position[slot];
+        Dense[position] = Dense[--Count];
+        Position[Dense[position]] = (uint16_t)position;
+        if (++Generation[slot] > 0xFFFF)
+            Generation[slot] = 1;
+        Free[FreeCount++] = (uint16_t)slot;
+        return true;
+    }
+
+    void Clear(void)
+    {
+        while (Count != 0)
+            Erase(MakeHandle(Dense[Count - 1]));
+    }
+
+    size_t size(void) const { return Count; }
+    static unsigned Slot(uint32_t handle) { return handle & 0xFFFF; }
+    Iterator begin(void) { return Iterator(this, 0); }
+    Iterator end(void) { return Iterator(this, Count); }
+
+private:
+    // Not copyable, as pointers to the effects are handed out
+    EffectSlotMap(const EffectSlotMap &src);
+    void operator = (const EffectSlotMap &src);
+
+    T* At(unsigned slot) const { return &Blocks[slot / BlockSize][slot % BlockSize]; }
+    uint32_t MakeHandle(unsigned slot) const { return (Generation[slot] << 16) | slot; }
+    bool IsUsed(unsigned slot) const { return (Position[slot] < Count) && (Dense[Position[slot]] == slot); }
+
+    T *Blocks[Capacity / BlockSize];
+    uint32_t Generation[Capacity];
+    uint16_t Position[Capacity];        // Index in Dense of each used slot
+    uint16_t Dense[Capacity];           // Used slots, packed for iteration
+    uint16_t Free[Capacity];            // Stack of unused slots
+    unsigned Count;
+    unsigned FreeCount;
+};
+
+#endif
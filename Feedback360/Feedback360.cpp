@@ -29,7 +29,9 @@
 using std::max;
 using std::min;
 
-#define LoopGranularity 10000 // Microseconds
+#define LoopGranularity 10000 // Microseconds, while the output changes all the time
+#define MinimumDelay    1000  // Microseconds between runs of the effects
+#define TimerLeeway     500   // Microseconds
 
 double CurrentTimeUsingMach()
 {
@@ -86,11 +88,13 @@ static IOForceFeedbackDeviceInterface functionMap360_IOForceFeedbackDeviceInterf
     &Feedback360::sStopEffect
 };
 
-Feedback360::Feedback360() : fRefCount(1),  EffectIndex(1), Stopped(true),
-Paused(false), PausedTime(0), LastTime(0), Gain(10000), PrvLeftLevel(0),
+Feedback360::Feedback360() : fRefCount(1), Stopped(true),
+Paused(false), PausedTime(0), LastTime(0), NextTime(DBL_MAX), Gain(10000), PrvLeftLevel(0),
 PrvRightLevel(0), Actuator(true), Manual(false)
 {
-    EffectList = Feedback360EffectVector();
+    memset(EffectStatus, 0, sizeof(EffectStatus));
+    State = FFGFFS_EMPTY | FFGFFS_STOPPED | FFGFFS_ACTUATORSON | FFGFFS_POWERON | FFGFFS_SAFETYSWITCHOFF | FFGFFS_USERFFSWITCHON;
+
 
     iIOCFPlugInInterface.pseudoVTable = (IUnknownVTbl *) &functionMap360_IOCFPlugInInterface;
     iIOCFPlugInInterface.obj = this;
@@ -183,191 +187,233 @@ HRESULT Feedback360::SetProperty(FFProperty property, void *value)
     }
 
     UInt32 NewGain = *((UInt32*)value);
-    __block HRESULT Result = FF_OK;
+    HRESULT Result = FF_OK;
+    Feedback360Command Command = {};
 
-    dispatch_sync(Queue, ^{
-        if (1 <= NewGain && NewGain <= 10000)
-        {
-            Gain = NewGain;
-        } else {
-            Gain = max((UInt32)1, min(NewGain, (UInt32)10000));
-            Result = FF_TRUNCATED;
-        }
-    });
+    if (!(1 <= NewGain && NewGain <= 10000))
+    {
+        NewGain = max((UInt32)1, min(NewGain, (UInt32)10000));
+        Result = FF_TRUNCATED;
+    }
+    Command.Type = CommandGain;
+    Command.Value = NewGain;
+    PostCommand(Command);
 
     return Result;
 }
 
 HRESULT Feedback360::StartEffect(FFEffectDownloadID EffectHandle, FFEffectStartFlag Mode, UInt32 Count)
 {
-    dispatch_sync(Queue, ^{
-        for (Feedback360EffectIterator effectIterator = EffectList.begin() ; effectIterator != EffectList.end(); ++effectIterator)
-        {
-            if (effectIterator->Handle == EffectHandle)
-            {
-                effectIterator->Status  = FFEGES_PLAYING;
-                effectIterator->PlayCount = Count;
-                effectIterator->StartTime = CurrentTimeUsingMach();
-                Stopped = false;
-            } else {
-                if (Mode & FFES_SOLO) {
-                    effectIterator->Status = NULL;
-                }
-            }
-        }
-    });
+    Feedback360Command Command = {};
+
+    Command.Type = CommandStart;
+    Command.Handle = EffectHandle;
+    Command.Value = Mode;
+    Command.Count = Count;
+    PostCommand(Command);
     return FF_OK;
 }
 
 HRESULT Feedback360::StopEffect(UInt32 EffectHandle)
 {
-    dispatch_sync(Queue, ^{
-        for (Feedback360EffectIterator effectIterator = EffectList.begin() ; effectIterator != EffectList.end(); ++effectIterator)
-        {
-            if (effectIterator->Handle == EffectHandle)
-            {
-                effectIterator->Status = NULL;
-                break;
-            }
-        }
-    });
+    Feedback360Command Command = {};
+
+    Command.Type = CommandStop;
+    Command.Handle = EffectHandle;
+    PostCommand(Command);
     return FF_OK;
 }
 
 HRESULT Feedback360::DownloadEffect(CFUUIDRef EffectType, FFEffectDownloadID *EffectHandle, FFEFFECT *DiEffect, FFEffectParameterFlag Flags)
 {
     __block HRESULT Result = FF_OK;
+    __block Feedback360Command Command = {};
 
     if (Flags & FFEP_NODOWNLOAD)
     {
         return FF_OK;
     }
 
-    dispatch_sync(Queue, ^{
-        Feedback360Effect *Effect = NULL;
-        if (*EffectHandle == 0) {
-            EffectList.push_back(Feedback360Effect(EffectIndex++));
-            Effect = &(EffectList.back());
-            *EffectHandle = Effect->Handle;
-        } else {
-            for (LONG Index = 0; Index < EffectList.size(); Index++) {
-                if (EffectList[Index].Handle == *EffectHandle) {
-                    Effect = &(EffectList[Index]);
-                    break;
-                }
-            }
+    // Take a copy of everything the effect points to, as it is applied later
+    Command.Type = CommandDownload;
+    Command.Handle = *EffectHandle;
+    Command.EffectType = EffectType;
+    Command.Flags = Flags;
+    memcpy(&Command.DiEffect, DiEffect, sizeof(FFEFFECT));
+    if (DiEffect->lpEnvelope != NULL)
+    {
+        memcpy(&Command.DiEnvelope, DiEffect->lpEnvelope, sizeof(FFENVELOPE));
+        Command.HasEnvelope = true;
+    }
+    if (DiEffect->lpvTypeSpecificParams != NULL)
+    {
+        Command.ParamsSize = min((UInt32)DiEffect->cbTypeSpecificParams, (UInt32)sizeof(Command.Params));
+        memcpy(&Command.Params, DiEffect->lpvTypeSpecificParams, Command.ParamsSize);
+    }
+    // The samples of a custom force are the caller's too, and read on every pass
+    if ((Flags & FFEP_TYPESPECIFICPARAMS) && CFEqual(EffectType, kFFEffectType_CustomForce_ID)
+        && (Command.ParamsSize >= sizeof(FFCUSTOMFORCE)) && (Command.Params.Custom.rglForceData != NULL)
+        && (Command.Params.Custom.cSamples >= 2))
+    {
+        Command.ForceData = (LONG*)malloc(Command.Params.Custom.cSamples * sizeof(LONG));
+        if (Command.ForceData == NULL)
+        {
+            return FFERR_OUTOFMEMORY;
         }
+        memcpy(Command.ForceData, Command.Params.Custom.rglForceData, Command.Params.Custom.cSamples * sizeof(LONG));
+    }
 
-        if (Effect == NULL || Result == -1) {
+    if (*EffectHandle != 0)
+    {
+        if (!IsEffect(*EffectHandle))
+        {
+            free(Command.ForceData);
+            return FFERR_INTERNAL;
+        }
+        PostCommand(Command);
+        return FF_OK;
+    }
+
+    // A new effect needs its handle straight away, so is made on the effect thread now
+    Command.Time = CurrentTimeUsingMach();
+    dispatch_sync(Queue, ^{
+        DrainCommands();
+        Feedback360Effect *Effect = EffectList.Insert();
+        if (Effect == NULL) {
+            free(Command.ForceData);
             Result = FFERR_INTERNAL;
         }
         else {
-            Effect->Type = EffectType;
-            Effect->DiEffect.dwFlags = DiEffect->dwFlags;
+            *EffectHandle = Effect->Handle;
+            ApplyDownload(Effect, Command);
+            PublishStatus();
+        }
+    });
+    Update();
+    return Result;
+}
 
-            if( Flags & FFEP_DURATION )
-            {
-                Effect->DiEffect.dwDuration = DiEffect->dwDuration;
-            }
+// Copies the parameters of a download into an effect, on the effect thread
+void Feedback360::ApplyDownload(Feedback360Effect *Effect, const Feedback360Command &Command)
+{
+    const FFEFFECT *DiEffect = &Command.DiEffect;
+    FFEffectParameterFlag Flags = Command.Flags;
 
-            if( Flags & FFEP_SAMPLEPERIOD )
-            {
-                Effect->DiEffect.dwSamplePeriod = DiEffect->dwSamplePeriod;
-            }
+    Effect->SetType(Command.EffectType);
+    Effect->DiEffect.dwFlags = DiEffect->dwFlags;
 
-            if( Flags & FFEP_GAIN )
-            {
-                Effect->DiEffect.dwGain = DiEffect->dwGain;
-            }
+    if( Flags & FFEP_DURATION )
+    {
+        Effect->DiEffect.dwDuration = DiEffect->dwDuration;
+    }
 
-            if( Flags & FFEP_TRIGGERBUTTON )
-            {
-                Effect->DiEffect.dwTriggerButton = DiEffect->dwTriggerButton;
-            }
+    if( Flags & FFEP_SAMPLEPERIOD )
+    {
+        Effect->DiEffect.dwSamplePeriod = DiEffect->dwSamplePeriod;
+    }
 
-            if( Flags & FFEP_TRIGGERREPEATINTERVAL )
-            {
-                Effect->DiEffect.dwTriggerRepeatInterval = DiEffect->dwTriggerRepeatInterval;
-            }
+    if( Flags & FFEP_GAIN )
+    {
+        Effect->DiEffect.dwGain = DiEffect->dwGain;
+    }
 
-            if( Flags & FFEP_AXES )
-            {
-                Effect->DiEffect.cAxes  = DiEffect->cAxes;
-                Effect->DiEffect.rgdwAxes = NULL;
-            }
+    if( Flags & FFEP_TRIGGERBUTTON )
+    {
+        Effect->DiEffect.dwTriggerButton = DiEffect->dwTriggerButton;
+    }
 
-            if( Flags & FFEP_DIRECTION )
-            {
-                Effect->DiEffect.cAxes   = DiEffect->cAxes;
-                Effect->DiEffect.rglDirection = NULL;
-            }
+    if( Flags & FFEP_TRIGGERREPEATINTERVAL )
+    {
+        Effect->DiEffect.dwTriggerRepeatInterval = DiEffect->dwTriggerRepeatInterval;
+    }
 
-            if( ( Flags & FFEP_ENVELOPE ) && DiEffect->lpEnvelope != NULL )
-            {
-                memcpy( &Effect->DiEnvelope, DiEffect->lpEnvelope, sizeof( FFENVELOPE ) );
-                if( Effect->DiEffect.dwDuration - Effect->DiEnvelope.dwFadeTime
-                   < Effect->DiEnvelope.dwAttackTime )
-                {
-                    Effect->DiEnvelope.dwFadeTime = Effect->DiEnvelope.dwAttackTime;
-                }
-                Effect->DiEffect.lpEnvelope = &Effect->DiEnvelope;
-            }
+    if( Flags & FFEP_AXES )
+    {
+        Effect->DiEffect.cAxes  = DiEffect->cAxes;
+        Effect->DiEffect.rgdwAxes = NULL;
+    }
 
-            Effect->DiEffect.cbTypeSpecificParams = DiEffect->cbTypeSpecificParams;
+    if( Flags & FFEP_DIRECTION )
+    {
+        Effect->DiEffect.cAxes   = DiEffect->cAxes;
+        Effect->DiEffect.rglDirection = NULL;
+    }
 
-            if( Flags & FFEP_TYPESPECIFICPARAMS )
-            {
-                if(CFEqual(EffectType, kFFEffectType_CustomForce_ID)) {
-                    memcpy(
-                           &Effect->DiCustomForce
-                           ,DiEffect->lpvTypeSpecificParams
-                           ,DiEffect->cbTypeSpecificParams );
-                    Effect->DiEffect.lpvTypeSpecificParams = &Effect->DiCustomForce;
-                }
+    if( ( Flags & FFEP_ENVELOPE ) && Command.HasEnvelope )
+    {
+        memcpy( &Effect->DiEnvelope, &Command.DiEnvelope, sizeof( FFENVELOPE ) );
+        if( Effect->DiEffect.dwDuration - Effect->DiEnvelope.dwFadeTime
+           < Effect->DiEnvelope.dwAttackTime )
+        {
+            Effect->DiEnvelope.dwFadeTime = Effect->DiEnvelope.dwAttackTime;
+        }
+        Effect->DiEffect.lpEnvelope = &Effect->DiEnvelope;
+    }
 
-                else if(CFEqual(EffectType, kFFEffectType_ConstantForce_ID)) {
-                    memcpy(
-                           &Effect->DiConstantForce
-                           ,DiEffect->lpvTypeSpecificParams
-                           ,DiEffect->cbTypeSpecificParams );
-                    Effect->DiEffect.lpvTypeSpecificParams = &Effect->DiConstantForce;
-                }
-                else if(CFEqual(EffectType, kFFEffectType_Square_ID) || CFEqual(EffectType, kFFEffectType_Sine_ID) || CFEqual(EffectType, kFFEffectType_Triangle_ID) || CFEqual(EffectType, kFFEffectType_SawtoothUp_ID) || CFEqual(EffectType, kFFEffectType_SawtoothDown_ID) ) {
-                    memcpy(
-                           &Effect->DiPeriodic
-                           ,DiEffect->lpvTypeSpecificParams
-                           ,DiEffect->cbTypeSpecificParams );
-                    Effect->DiEffect.lpvTypeSpecificParams = &Effect->DiPeriodic;
-                }
-                else if(CFEqual(EffectType, kFFEffectType_RampForce_ID)) {
-                    memcpy(
-                           &Effect->DiRampforce
-                           ,DiEffect->lpvTypeSpecificParams
-                           ,DiEffect->cbTypeSpecificParams );
-                    Effect->DiEffect.lpvTypeSpecificParams = &Effect->DiRampforce;
-                }
-            }
+    Effect->DiEffect.cbTypeSpecificParams = DiEffect->cbTypeSpecificParams;
 
-            if( Flags & FFEP_STARTDELAY )
-            {
-                Effect->DiEffect.dwStartDelay = DiEffect->dwStartDelay;
-            }
+    if( Flags & FFEP_TYPESPECIFICPARAMS )
+    {
+        switch (Effect->Kind) {
+            case CUSTOM_FORCE:
+                memcpy(
+                       &Effect->DiCustomForce
+                       ,&Command.Params
+                       ,min((UInt32)sizeof(Effect->DiCustomForce), Command.ParamsSize) );
+                // The effect owns the samples from now on
+                free(Effect->ForceData);
+                Effect->ForceData = Command.ForceData;
+                Effect->DiCustomForce.rglForceData = Effect->ForceData;
+                Effect->Index = 0;
+                Effect->DiEffect.lpvTypeSpecificParams = &Effect->DiCustomForce;
+                break;
 
-            if( Flags & FFEP_START )
-            {
-                Effect->Status  = FFEGES_PLAYING;
-                Effect->PlayCount = 1;
-                Effect->StartTime = CurrentTimeUsingMach();
-            }
+            case CONSTANT_FORCE:
+                memcpy(
+                       &Effect->DiConstantForce
+                       ,&Command.Params
+                       ,min((UInt32)sizeof(Effect->DiConstantForce), Command.ParamsSize) );
+                Effect->DiEffect.lpvTypeSpecificParams = &Effect->DiConstantForce;
+                break;
 
-            if( Flags & FFEP_NORESTART )
-            {
-                ;
-            }
-            Result = FF_OK;
+            case SQUARE:
+            case SINE:
+            case TRIANGLE:
+            case SAWTOOTH_UP:
+            case SAWTOOTH_DOWN:
+                memcpy(
+                       &Effect->DiPeriodic
+                       ,&Command.Params
+                       ,min((UInt32)sizeof(Effect->DiPeriodic), Command.ParamsSize) );
+                Effect->DiEffect.lpvTypeSpecificParams = &Effect->DiPeriodic;
+                break;
+
+            case RAMP_FORCE:
+                memcpy(
+                       &Effect->DiRampforce
+                       ,&Command.Params
+                       ,min((UInt32)sizeof(Effect->DiRampforce), Command.ParamsSize) );
+                Effect->DiEffect.lpvTypeSpecificParams = &Effect->DiRampforce;
+                break;
         }
-    });
-    return Result;
+    }
+
+    if( Flags & FFEP_STARTDELAY )
+    {
+        Effect->DiEffect.dwStartDelay = DiEffect->dwStartDelay;
+    }
+
+    if( Flags & FFEP_START )
+    {
+        Effect->Status  = FFEGES_PLAYING;
+        Effect->PlayCount = 1;
+        Effect->StartTime = Command.Time;
+    }
+
+    if( Flags & FFEP_NORESTART )
+    {
+        ;
+    }
 }
 
 HRESULT Feedback360::GetForceFeedbackState(ForceFeedbackDeviceState *DeviceState)
@@ -377,32 +423,8 @@ HRESULT Feedback360::GetForceFeedbackState(ForceFeedbackDeviceState *DeviceState
         return FFERR_INVALIDPARAM;
     }
 
-    dispatch_sync(Queue, ^{
-        DeviceState->dwState = NULL;
-        if( EffectList.size() == 0 )
-        {
-            DeviceState->dwState |= FFGFFS_EMPTY;
-        }
-        if( Stopped == true )
-        {
-            DeviceState->dwState |= FFGFFS_STOPPED;
-        }
-        if( Paused == true )
-        {
-            DeviceState->dwState |= FFGFFS_PAUSED;
-        }
-        if (Actuator == true)
-        {
-            DeviceState->dwState |= FFGFFS_ACTUATORSON;
-        } else {
-            DeviceState->dwState |= FFGFFS_ACTUATORSOFF;
-        }
-        DeviceState->dwState |= FFGFFS_POWERON;
-        DeviceState->dwState |= FFGFFS_SAFETYSWITCHOFF;
-        DeviceState->dwState |= FFGFFS_USERFFSWITCHON;
-
-        DeviceState->dwLoad  = 0;
-    });
+    DeviceState->dwState = __atomic_load_n(&State, __ATOMIC_ACQUIRE);
+    DeviceState->dwLoad  = 0;
 
     return FF_OK;
 }
@@ -419,7 +441,7 @@ HRESULT Feedback360::GetForceFeedbackCapabilities(FFCAPABILITIES *capabilities)
     capabilities->numFfAxes=2;
     capabilities->ffAxes[0]=FFJOFS_X;
     capabilities->ffAxes[1]=FFJOFS_Y;
-    capabilities->storageCapacity=256;
+    capabilities->storageCapacity=EffectCapacity;
     capabilities->playbackCapacity=1;
     capabilities->driverVer.majorRev=FeedbackDriverVersionMajor;
     capabilities->driverVer.minorAndBugRev=FeedbackDriverVersionMinor;
@@ -438,52 +460,11 @@ HRESULT Feedback360::GetForceFeedbackCapabilities(FFCAPABILITIES *capabilities)
 
 HRESULT Feedback360::SendForceFeedbackCommand(FFCommandFlag state)
 {
-    __block HRESULT Result = FF_OK;
+    Feedback360Command Command = {};
 
-    dispatch_sync(Queue, ^{
-        switch (state) {
-            case FFSFFC_RESET:
-                EffectList.clear();
-                Stopped = true;
-                Paused = false;
-                break;
-
-            case FFSFFC_STOPALL:
-                for (Feedback360EffectIterator effectIterator = EffectList.begin() ; effectIterator != EffectList.end(); ++effectIterator)
-                {
-                    effectIterator->Status = NULL;
-                }
-                Stopped = true;
-                Paused = false;
-                break;
-
-            case FFSFFC_PAUSE:
-                Paused  = true;
-                PausedTime = CurrentTimeUsingMach();
-                break;
-
-            case FFSFFC_CONTINUE:
-                for (Feedback360EffectIterator effectIterator = EffectList.begin() ; effectIterator != EffectList.end(); ++effectIterator)
-                {
-                    effectIterator->StartTime += ( CurrentTimeUsingMach() - PausedTime );
-                }
-                Paused = false;
-                break;
-
-            case FFSFFC_SETACTUATORSON:
-                Actuator = true;
-                break;
-
-            case FFSFFC_SETACTUATORSOFF:
-                Actuator = false;
-                break;
-
-            default:
-                Result = FFERR_INVALIDPARAM;
-                break;
-        }
-    });
-    //return Result;
+    Command.Type = CommandDevice;
+    Command.Value = state;
+    PostCommand(Command);
     return FF_OK;
 }
 
@@ -509,13 +490,17 @@ HRESULT Feedback360::InitializeTerminate(NumVersion APIversion, io_object_t hidD
         }
         Queue = dispatch_queue_create("com.mice.driver.Feedback360", NULL);
         Timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, Queue);
-        dispatch_source_set_timer(Timer, dispatch_walltime(NULL, 0), LoopGranularity*1000, 10);
+        // Nothing is playing yet, so the timer waits until an effect starts
+        NextTime = DBL_MAX;
+        dispatch_source_set_timer(Timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, TimerLeeway*1000);
         dispatch_set_context(Timer, this);
         dispatch_source_set_event_handler_f(Timer, EffectProc);
         dispatch_resume(Timer);
     }
     else {
         dispatch_sync(Queue, ^{
+            // Nothing left queued holds on to a copy of custom force samples
+            DrainCommands();
             dispatch_source_cancel(Timer);
             SetForce(0, 0);
             Device_Finalise(&this->device);
@@ -527,18 +512,12 @@ HRESULT Feedback360::InitializeTerminate(NumVersion APIversion, io_object_t hidD
 
 HRESULT Feedback360::DestroyEffect(FFEffectDownloadID EffectHandle)
 {
-    __block HRESULT Result = FF_OK;
-    dispatch_sync(Queue, ^{
-        for (Feedback360EffectIterator effectIterator = EffectList.begin() ; effectIterator != EffectList.end(); ++effectIterator)
-        {
-            if (effectIterator->Handle == EffectHandle)
-            {
-                EffectList.erase(effectIterator);
-                break;
-            }
-        }
-    });
-    return Result;
+    Feedback360Command Command = {};
+
+    Command.Type = CommandDestroy;
+    Command.Handle = EffectHandle;
+    PostCommand(Command);
+    return FF_OK;
 }
 
 HRESULT Feedback360::Escape(FFEffectDownloadID downloadID, FFEFFESCAPE *escape)
@@ -551,6 +530,7 @@ HRESULT Feedback360::Escape(FFEffectDownloadID downloadID, FFEFFESCAPE *escape)
             if(escape->cbInBuffer!=1) return FFERR_INVALIDPARAM;
             dispatch_sync(Queue, ^{
                 Manual=((unsigned char*)escape->lpvInBuffer)[0]!=0x00;
+                Update();
             });
             break;
 
@@ -599,14 +579,212 @@ void Feedback360::SetForce(LONG LeftLevel, LONG RightLevel)
     if (!Manual) Device_Send(&device, buf, sizeof(buf));
 }
 
+// Arms the timer to run the effects at a given time, or stops it for DBL_MAX
+void Feedback360::ScheduleAt(double When)
+{
+    double Now = CurrentTimeUsingMach();
+
+    if (When == DBL_MAX)
+    {
+        if (NextTime != DBL_MAX)
+            dispatch_source_set_timer(Timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, TimerLeeway*1000);
+    }
+    else
+    {
+        When = max(When, Now + MinimumDelay / 1000. / 1000.);
+        dispatch_source_set_timer(Timer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)((When - Now) * NSEC_PER_SEC)), DISPATCH_TIME_FOREVER, TimerLeeway*1000);
+    }
+    NextTime = When;
+    // A command posted while this ran may have had its wake up replaced above
+    if (!Commands.IsEmpty())
+        Update();
+}
+
+// Something changed, so run the effects as soon as possible to pick it up.
+// Safe to call from any thread.
+void Feedback360::Update(void)
+{
+    dispatch_source_set_timer(Timer, DISPATCH_TIME_NOW, DISPATCH_TIME_FOREVER, TimerLeeway*1000);
+}
+
+// Hands a change to the effect thread without waiting for it
+void Feedback360::PostCommand(Feedback360Command &Command)
+{
+    Command.Time = CurrentTimeUsingMach();
+    while (!Commands.Post(Command))
+    {
+        // Only when the effect thread has fallen far behind
+        dispatch_sync(Queue, ^{
+            DrainCommands();
+        });
+    }
+    Update();
+}
+
+// Applies every change posted since the last run, on the effect thread
+void Feedback360::DrainCommands(void)
+{
+    Feedback360Command Command;
+    bool Changed = false;
+
+    while (Commands.Take(&Command))
+    {
+        ApplyCommand(Command);
+        Changed = true;
+    }
+    if (Changed)
+        PublishStatus();
+}
+
+void Feedback360::ApplyCommand(const Feedback360Command &Command)
+{
+    Feedback360Effect *Effect;
+
+    switch (Command.Type) {
+        case CommandStart:
+            Effect = EffectList.Find(Command.Handle);
+            if (Command.Value & FFES_SOLO)
+            {
+                for (Feedback360EffectIterator effectIterator = EffectList.begin() ; effectIterator != EffectList.end(); ++effectIterator)
+                {
+                    effectIterator->Status = NULL;
+                }
+            }
+            if (Effect != NULL)
+            {
+                Effect->Status  = FFEGES_PLAYING;
+                Effect->PlayCount = Command.Count;
+                Effect->StartTime = Command.Time;
+                Stopped = false;
+            }
+            break;
+
+        case CommandStop:
+            Effect = EffectList.Find(Command.Handle);
+            if (Effect != NULL)
+            {
+                Effect->Status = NULL;
+            }
+            break;
+
+        case CommandDownload:
+            Effect = EffectList.Find(Command.Handle);
+            if (Effect != NULL)
+            {
+                ApplyDownload(Effect, Command);
+            }
+            else
+            {
+                free(Command.ForceData);
+            }
+            break;
+
+        case CommandDestroy:
+            EffectList.Erase(Command.Handle);
+            break;
+
+        case CommandGain:
+            Gain = Command.Value;
+            break;
+
+        case CommandDevice:
+            switch (Command.Value) {
+                case FFSFFC_RESET:
+                    EffectList.Clear();
+                    Stopped = true;
+                    Paused = false;
+                    break;
+
+                case FFSFFC_STOPALL:
+                    for (Feedback360EffectIterator effectIterator = EffectList.begin() ; effectIterator != EffectList.end(); ++effectIterator)
+                    {
+                        effectIterator->Status = NULL;
+                    }
+                    Stopped = true;
+                    Paused = false;
+                    break;
+
+                case FFSFFC_PAUSE:
+                    Paused  = true;
+                    PausedTime = Command.Time;
+                    break;
+
+                case FFSFFC_CONTINUE:
+                    for (Feedback360EffectIterator effectIterator = EffectList.begin() ; effectIterator != EffectList.end(); ++effectIterator)
+                    {
+                        effectIterator->StartTime += ( Command.Time - PausedTime );
+                    }
+                    Paused = false;
+                    break;
+
+                case FFSFFC_SETACTUATORSON:
+                    Actuator = true;
+                    break;
+
+                case FFSFFC_SETACTUATORSOFF:
+                    Actuator = false;
+                    break;
+            }
+            break;
+    }
+}
+
+// Publishes the state of the device and every effect for the status calls
+void Feedback360::PublishStatus(void)
+{
+    UInt64 Published[EffectCapacity] = {};
+    DWORD DeviceState = FFGFFS_POWERON | FFGFFS_SAFETYSWITCHOFF | FFGFFS_USERFFSWITCHON;
+
+    for (Feedback360EffectIterator effectIterator = EffectList.begin() ; effectIterator != EffectList.end(); ++effectIterator)
+    {
+        Published[Feedback360EffectMap::Slot(effectIterator->Handle)] = ((UInt64)effectIterator->Handle << 32) | (UInt32)effectIterator->Status;
+    }
+    for (unsigned i = 0; i < EffectCapacity; i++)
+    {
+        if (EffectStatus[i] != Published[i])
+            __atomic_store_n(&EffectStatus[i], Published[i], __ATOMIC_RELEASE);
+    }
+
+    if( EffectList.size() == 0 )
+    {
+        DeviceState |= FFGFFS_EMPTY;
+    }
+    if( Stopped == true )
+    {
+        DeviceState |= FFGFFS_STOPPED;
+    }
+    if( Paused == true )
+    {
+        DeviceState |= FFGFFS_PAUSED;
+    }
+    if (Actuator == true)
+    {
+        DeviceState |= FFGFFS_ACTUATORSON;
+    } else {
+        DeviceState |= FFGFFS_ACTUATORSOFF;
+    }
+    __atomic_store_n(&State, DeviceState, __ATOMIC_RELEASE);
+}
+
+// True if a handle belongs to an effect that has not been destroyed, as last published
+bool Feedback360::IsEffect(FFEffectDownloadID EffectHandle)
+{
+    unsigned Slot = Feedback360EffectMap::Slot(EffectHandle);
+
+    return (Slot < EffectCapacity) && ((__atomic_load_n(&EffectStatus[Slot], __ATOMIC_ACQUIRE) >> 32) == EffectHandle);
+}
+
 void Feedback360::EffectProc( void *params )
 {
     Feedback360 *cThis = (Feedback360 *)params;
 
+    cThis->DrainCommands();
+
     LONG LeftLevel = 0;
     LONG RightLevel = 0;
     LONG Gain  = cThis->Gain;
     LONG CalcResult = 0;
+    double Next = DBL_MAX;
 
     if (cThis->Actuator == true)
     {
@@ -616,7 +794,14 @@ void Feedback360::EffectProc( void *params )
                 CalcResult = effectIterator->Calc(&LeftLevel, &RightLevel);
             }
         }
+        // The timer only fires again when some effect can change the output
+        double Now = CurrentTimeUsingMach();
+        for (Feedback360EffectIterator effectIterator = cThis->EffectList.begin(); effectIterator != cThis->EffectList.end(); ++effectIterator)
+        {
+            Next = min(Next, effectIterator->NextChange(Now, LoopGranularity / 1000. / 1000.));
+        }
     }
+    cThis->ScheduleAt(Next);
 
     if ((cThis->PrvLeftLevel != LeftLevel || cThis->PrvRightLevel != RightLevel) && (CalcResult != -1))
     {
@@ -630,16 +815,16 @@ void Feedback360::EffectProc( void *params )
 
 HRESULT Feedback360::GetEffectStatus(FFEffectDownloadID EffectHandle, FFEffectStatusFlag *Status)
 {
-    dispatch_sync(Queue, ^{
-        for (Feedback360EffectIterator effectIterator = EffectList.begin() ; effectIterator != EffectList.end(); ++effectIterator)
+    unsigned Slot = Feedback360EffectMap::Slot(EffectHandle);
+
+    if (Slot < EffectCapacity)
+    {
+        UInt64 Published = __atomic_load_n(&EffectStatus[Slot], __ATOMIC_ACQUIRE);
+        if ((Published >> 32) == EffectHandle)
         {
-            if (effectIterator->Handle == EffectHandle)
-            {
-                *Status = effectIterator->Status;
-                break;
-            }
+            *Status = (FFEffectStatusFlag)Published;
         }
-    });
+    }
     return FF_OK;
 }
 
@@ -28,16 +28,22 @@
 
 #include <ForceFeedback/IOForceFeedbackLib.h>
 #include <IOKit/IOCFPlugIn.h>
-#include <vector>
 
 #include "devlink.h"
 #include "Feedback360Effect.h"
+#include "EffectSlotMap.h"
+#include "CommandQueue.h"
 
 #define FeedbackDriverVersionMajor      1
 #define FeedbackDriverVersionMinor      0
 #define FeedbackDriverVersionStage      developStage
 #define FeedbackDriverVersionNonRelRev  0
 
+// Effects that can be downloaded at once
+#define EffectCapacity                  256
+// Changes from the FF API waiting for the effect thread, a power of two
+#define CommandCapacity                 64
+
 class Feedback360 : IUnknown
 {
 public:
@@ -89,8 +95,40 @@ public:
     virtual ULONG   Release(void);
 
 private:
-    typedef std::vector<Feedback360Effect> Feedback360EffectVector;
-    typedef Feedback360EffectVector::iterator Feedback360EffectIterator;
+    typedef EffectSlotMap<Feedback360Effect, EffectCapacity> Feedback360EffectMap;
+    typedef Feedback360EffectMap::Iterator Feedback360EffectIterator;
+
+    // A change from the FF API, applied by the effect thread when it next runs
+    typedef enum {
+        CommandStart,
+        CommandStop,
+        CommandDownload,
+        CommandDestroy,
+        CommandGain,
+        CommandDevice,
+    } Feedback360CommandType;
+
+    typedef struct Feedback360Command {
+        Feedback360CommandType  Type;
+        FFEffectDownloadID      Handle;
+        UInt32                  Value;          // Start mode, gain or device command
+        UInt32                  Count;          // Iterations to start
+        double                  Time;           // When it was posted
+        // Downloads only, with copies of everything the caller's FFEFFECT points to
+        CFUUIDRef               EffectType;
+        FFEffectParameterFlag   Flags;
+        FFEFFECT                DiEffect;
+        bool                    HasEnvelope;
+        FFENVELOPE              DiEnvelope;
+        UInt32                  ParamsSize;
+        union {
+            FFCONSTANTFORCE     Constant;
+            FFCUSTOMFORCE       Custom;
+            FFPERIODIC          Periodic;
+            FFRAMPFORCE         Ramp;
+        } Params;
+        LONG                    *ForceData;     // Copy of a custom force's samples, handed to the effect
+    } Feedback360Command;
     // helper function
     static inline Feedback360 *getThis (void *self) { return (Feedback360 *) ((Xbox360InterfaceMap *) self)->obj; }
 
@@ -99,13 +137,18 @@ private:
     Xbox360InterfaceMap iIOForceFeedbackDeviceInterface;
     DeviceLink          device;
 
-    // GCD queue and timer
+    // GCD queue and timer, armed for the next time the output may change
     dispatch_queue_t    Queue;
     dispatch_source_t   Timer;
+    double              NextTime;
 
     // effects handling
-    Feedback360EffectVector EffectList;
-    UInt32              EffectIndex;
+    Feedback360EffectMap EffectList;
+    CommandQueue<Feedback360Command, CommandCapacity> Commands;
+
+    // Published by the effect thread, so status calls never wait for it
+    UInt64              EffectStatus[EffectCapacity];   // Handle in the top half, status below
+    DWORD               State;
 
     DWORD   Gain;
     bool    Actuator;
@@ -119,6 +162,14 @@ private:
     CFUUIDRef       FactoryID;
 
     void            SetForce(LONG LeftLevel, LONG RightLevel);
+    void            ScheduleAt(double When);
+    void            Update(void);
+    void            PostCommand(Feedback360Command &Command);
+    void            DrainCommands(void);
+    void            ApplyCommand(const Feedback360Command &Command);
+    void            ApplyDownload(Feedback360Effect *Effect, const Feedback360Command &Command);
+    void            PublishStatus(void);
+    bool            IsEffect(FFEffectDownloadID EffectHandle);
 
     // event loop func
     static void EffectProc( void *params );
@@ -30,9 +30,9 @@ using std::min;
 //----------------------------------------------------------------------------------------------
 // CEffect
 //----------------------------------------------------------------------------------------------
-Feedback360Effect::Feedback360Effect() : Type(NULL), Status(0), PlayCount(0),
+Feedback360Effect::Feedback360Effect() : Type(NULL), Kind(UNKNOWN_FORCE), Status(0), PlayCount(0),
 StartTime(0), Index(0), LastTime(0), Handle(0), DiEffect({0}), DiEnvelope({0}),
-DiCustomForce({0}), DiConstantForce({0}), DiPeriodic({0}), DiRampforce({0})
+DiCustomForce({0}), ForceData(NULL), DiConstantForce({0}), DiPeriodic({0}), DiRampforce({0})
 {
 
 }
@@ -43,7 +43,7 @@ Feedback360Effect::Feedback360Effect(FFEffectDownloadID theHand) : Feedback360Ef
 }
 
 Feedback360Effect::Feedback360Effect(const Feedback360Effect &src) : Type(src.Type),
-Handle(src.Handle), Status(src.Status), PlayCount(src.PlayCount),
+Kind(src.Kind), Handle(src.Handle), Status(src.Status), PlayCount(src.PlayCount),
 StartTime(src.StartTime), Index(src.Index), LastTime(src.LastTime)
 {
     memcpy(&DiEffect, &src.DiEffect, sizeof(FFEFFECT));
@@ -52,25 +52,86 @@ StartTime(src.StartTime), Index(src.Index), LastTime(src.LastTime)
     memcpy(&DiConstantForce, &src.DiConstantForce, sizeof(FFCONSTANTFORCE));
     memcpy(&DiPeriodic, &src.DiPeriodic, sizeof(FFPERIODIC));
     memcpy(&DiRampforce, &src.DiRampforce, sizeof(FFRAMPFORCE));
+    ForceData = NULL;
+    if (src.ForceData != NULL)
+    {
+        ForceData = (LONG*)malloc(DiCustomForce.cSamples * sizeof(LONG));
+        if (ForceData != NULL)
+            memcpy(ForceData, src.ForceData, DiCustomForce.cSamples * sizeof(LONG));
+    }
+    DiCustomForce.rglForceData = ForceData;
+}
+
+Feedback360Effect::~Feedback360Effect()
+{
+    free(ForceData);
 }
 
 //----------------------------------------------------------------------------------------------
-// Calc
+// SetType
+//
+// Works out the kind of effect from its UUID once, when it is downloaded,
+// rather than comparing UUIDs every time the effect is calculated
 //----------------------------------------------------------------------------------------------
-LONG Feedback360Effect::Calc(LONG *LeftLevel, LONG *RightLevel)
+void Feedback360Effect::SetType(CFUUIDRef EffectType)
+{
+    static const struct {
+        CFUUIDRef   Uuid;
+        DWORD       Kind;
+    } Kinds[] = {
+        { kFFEffectType_ConstantForce_ID, CONSTANT_FORCE },
+        { kFFEffectType_RampForce_ID, RAMP_FORCE },
+        { kFFEffectType_Square_ID, SQUARE },
+        { kFFEffectType_Sine_ID, SINE },
+        { kFFEffectType_Triangle_ID, TRIANGLE },
+        { kFFEffectType_SawtoothUp_ID, SAWTOOTH_UP },
+        { kFFEffectType_SawtoothDown_ID, SAWTOOTH_DOWN },
+        { kFFEffectType_Spring_ID, SPRING },
+        { kFFEffectType_Damper_ID, DAMPER },
+        { kFFEffectType_Inertia_ID, INERTIA },
+        { kFFEffectType_Friction_ID, FRICTION },
+        { kFFEffectType_CustomForce_ID, CUSTOM_FORCE },
+    };
+
+    Type = EffectType;
+    Kind = UNKNOWN_FORCE;
+    for (size_t i = 0; i < sizeof(Kinds) / sizeof(Kinds[0]); i++)
+    {
+        if (CFEqual(EffectType, Kinds[i].Uuid))
+        {
+            Kind = Kinds[i].Kind;
+            break;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// CalcTimes
+//----------------------------------------------------------------------------------------------
+void Feedback360Effect::CalcTimes(double *Duration, double *BeginTime, double *EndTime)
 {
-    CFTimeInterval Duration = 0;
     if(DiEffect.dwDuration != FF_INFINITE) {
-        Duration = max(1., DiEffect.dwDuration / 1000.) / 1000.;
+        *Duration = max(1., DiEffect.dwDuration / 1000.) / 1000.;
     } else {
-        Duration = DBL_MAX;
+        *Duration = DBL_MAX;
     }
-    double BeginTime = StartTime + ( DiEffect.dwStartDelay / 1000. / 1000.);
-    double EndTime  = DBL_MAX;
+    *BeginTime = StartTime + ( DiEffect.dwStartDelay / 1000. / 1000.);
+    *EndTime  = DBL_MAX;
     if (PlayCount != -1)
     {
-        EndTime = BeginTime + Duration * PlayCount;
+        *EndTime = *BeginTime + *Duration * PlayCount;
     }
+}
+
+//----------------------------------------------------------------------------------------------
+// Calc
+//----------------------------------------------------------------------------------------------
+LONG Feedback360Effect::Calc(LONG *LeftLevel, LONG *RightLevel)
+{
+    CFTimeInterval Duration;
+    double BeginTime;
+    double EndTime;
+    CalcTimes(&Duration, &BeginTime, &EndTime);
     double CurrentTime = CurrentTimeUsingMach();
 
     if (Status == FFEGES_PLAYING && BeginTime <= CurrentTime && CurrentTime <= EndTime)
@@ -92,8 +153,8 @@ LONG Feedback360Effect::Calc(LONG *LeftLevel, LONG *RightLevel)
                      ,&FadeLevel);
 
         // CustomForce allows setting each channel separately
-        if(CFEqual(Type, kFFEffectType_CustomForce_ID)) {
-            if((CurrentTimeUsingMach() - LastTime)*1000*1000 < DiCustomForce.dwSamplePeriod) {
+        if(Kind == CUSTOM_FORCE) {
+            if((ForceData == NULL) || ((CurrentTimeUsingMach() - LastTime)*1000*1000 < DiCustomForce.dwSamplePeriod)) {
                 return -1;
             }
             else {
@@ -128,6 +189,72 @@ LONG Feedback360Effect::Calc(LONG *LeftLevel, LONG *RightLevel)
     return 0;
 }
 
+//----------------------------------------------------------------------------------------------
+// NextChange
+//
+// Returns the time Calc could next give a different level, or DBL_MAX if the
+// effect has stopped for good. Outputs that change all the time, like a sine
+// wave or the envelope's attack and fade, are sampled every Granularity.
+//----------------------------------------------------------------------------------------------
+double Feedback360Effect::NextChange(double CurrentTime, double Granularity)
+{
+    CFTimeInterval Duration;
+    double BeginTime;
+    double EndTime;
+
+    if (Status != FFEGES_PLAYING)
+    {
+        return DBL_MAX;
+    }
+    CalcTimes(&Duration, &BeginTime, &EndTime);
+    if (CurrentTime < BeginTime)
+    {
+        return BeginTime;
+    }
+    if (EndTime < CurrentTime)
+    {
+        return DBL_MAX;
+    }
+
+    // Stopping at the end of the last iteration is a change too
+    double Next = EndTime;
+    double Position = fmod(CurrentTime - BeginTime, Duration);
+
+    if(Kind == CUSTOM_FORCE) {
+        double SamplePeriod = DiCustomForce.dwSamplePeriod / 1000. / 1000.;
+        if (SamplePeriod == 0)
+        {
+            SamplePeriod = Granularity;
+        }
+        return min(Next, max(CurrentTime, LastTime + SamplePeriod));
+    }
+
+    // Each iteration starts the envelope again
+    Next = min(Next, CurrentTime - Position + Duration);
+    if( ( DiEffect.dwFlags & FFEP_ENVELOPE ) && DiEffect.lpEnvelope != NULL )
+    {
+        double AttackTime = max( (DWORD)1, DiEnvelope.dwAttackTime / 1000 ) / 1000.;
+        double FadePos = Duration - max( (DWORD)1, DiEnvelope.dwFadeTime / 1000 ) / 1000.;
+
+        if (Position < AttackTime || FadePos < Position)
+        {
+            return min(Next, CurrentTime + Granularity);
+        }
+        Next = min(Next, CurrentTime - Position + FadePos);
+    }
+
+    if (Kind == CONSTANT_FORCE) {
+        return Next;
+    }
+    else if (Kind == SQUARE) {
+        // Only flips every half period
+        double Half = max( (DWORD)1, ( DiPeriodic.dwPeriod / 1000 ) ) / 2000.;
+        double Phase = ( DiPeriodic.dwPhase / 100 ) * Half / 180;
+        return min(Next, CurrentTime + Half - fmod(Position + Phase, Half));
+    }
+    return min(Next, CurrentTime + Granularity);
+}
+
 //----------------------------------------------------------------------------------------------
 // CalcEnvelope
 //----------------------------------------------------------------------------------------------
@@ -162,116 +289,143 @@ void Feedback360Effect::CalcEnvelope(ULONG Duration, ULONG CurrentPos, LONG *Nor
 	}
 }
 
+//----------------------------------------------------------------------------------------------
+// CalcForce
+//----------------------------------------------------------------------------------------------
+const Feedback360Effect::Evaluator Feedback360Effect::Evaluators[UNKNOWN_FORCE] = {
+    &Feedback360Effect::CalcConstant,       // CONSTANT_FORCE
+    &Feedback360Effect::CalcRamp,           // RAMP_FORCE
+    &Feedback360Effect::CalcSquare,         // SQUARE
+    &Feedback360Effect::CalcSine,           // SINE
+    &Feedback360Effect::CalcTriangle,       // TRIANGLE
+    &Feedback360Effect::CalcSawtoothUp,     // SAWTOOTH_UP
+    &Feedback360Effect::CalcSawtoothDown,   // SAWTOOTH_DOWN
+    NULL,                                   // SPRING
+    NULL,                                   // DAMPER
+    NULL,                                   // INERTIA
+    NULL,                                   // FRICTION
+    NULL,                                   // CUSTOM_FORCE, handled by Calc
+};
+
 void Feedback360Effect::CalcForce(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel, LONG * NormalLevel)
 {
     LONG Magnitude = 0;
-    LONG Period;
-    LONG R;
-    LONG Rate;
 
-    if (CFEqual(Type, kFFEffectType_ConstantForce_ID)) {
-        Magnitude	= DiConstantForce.lMagnitude;
-        Magnitude	= ( Magnitude * NormalRate + AttackLevel + FadeLevel ) / 100;
+    if (Kind < UNKNOWN_FORCE && Evaluators[Kind] != NULL) {
+        Magnitude = (this->*Evaluators[Kind])(Duration, CurrentPos, NormalRate, AttackLevel, FadeLevel);
     }
-    else if (CFEqual(Type, kFFEffectType_Square_ID)) {
-        Period	= max( (DWORD)1, ( DiPeriodic.dwPeriod / 1000 ) );
-        R		= ( CurrentPos%Period) * 360 / Period;
-        R	= ( R + ( DiPeriodic.dwPhase / 100 ) ) % 360;
 
-        Magnitude	= DiPeriodic.dwMagnitude;
-        Magnitude	= ( Magnitude * NormalRate + AttackLevel + FadeLevel ) / 100;
+    *NormalLevel = Magnitude * (LONG)DiEffect.dwGain / 10000;
+}
 
-        if (180 <= R)
-        {
-            Magnitude = Magnitude * -1;
-        }
+// Position in the period of a periodic effect, in degrees
+LONG Feedback360Effect::PeriodicAngle(ULONG CurrentPos)
+{
+    LONG Period	= max( (DWORD)1, ( DiPeriodic.dwPeriod / 1000 ) );
+    LONG R		= (CurrentPos%Period) * 360 / Period;
+    return ( R + ( DiPeriodic.dwPhase / 100 ) ) % 360;
+}
 
-        Magnitude	= Magnitude + DiPeriodic.lOffset;
-    }
-    else if (CFEqual(Type, kFFEffectType_Sine_ID)) {
-        Period	= max( (DWORD)1, ( DiPeriodic.dwPeriod / 1000 ) );
-        R		= (CurrentPos%Period) * 360 / Period;
-        R		= ( R + ( DiPeriodic.dwPhase / 100 ) ) % 360;
+LONG Feedback360Effect::PeriodicMagnitude(LONG NormalRate, LONG AttackLevel, LONG FadeLevel)
+{
+    LONG Magnitude	= DiPeriodic.dwMagnitude;
+    return ( Magnitude * NormalRate + AttackLevel + FadeLevel ) / 100;
+}
 
-        Magnitude	= DiPeriodic.dwMagnitude;
-        Magnitude	= ( Magnitude * NormalRate + AttackLevel + FadeLevel ) / 100;
+LONG Feedback360Effect::CalcConstant(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel)
+{
+    LONG Magnitude	= DiConstantForce.lMagnitude;
+    return ( Magnitude * NormalRate + AttackLevel + FadeLevel ) / 100;
+}
 
-        Magnitude	= ( int)( Magnitude * sin( R * M_PI / 180.0 ) );
+LONG Feedback360Effect::CalcRamp(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel)
+{
+    LONG Rate		= ( Duration - CurrentPos ) * 100
+    / Duration;//MAX( 1, DiEffect.dwDuration / 1000 );
 
-        Magnitude	= Magnitude + DiPeriodic.lOffset;
+    LONG Magnitude	= ( DiRampforce.lStart * Rate
+                       + DiRampforce.lEnd * ( 100 - Rate ) ) / 100;
+    return ( Magnitude * NormalRate + AttackLevel + FadeLevel ) / 100;
+}
+
+LONG Feedback360Effect::CalcSquare(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel)
+{
+    LONG R			= PeriodicAngle(CurrentPos);
+    LONG Magnitude	= PeriodicMagnitude(NormalRate, AttackLevel, FadeLevel);
+
+    if (180 <= R)
+    {
+        Magnitude = Magnitude * -1;
     }
-    else if (CFEqual(Type, kFFEffectType_Triangle_ID)) {
-        Period	= max( (DWORD)1, ( DiPeriodic.dwPeriod / 1000 ) );
-        R		= (CurrentPos%Period) * 360 / Period;
-        R		= ( R + ( DiPeriodic.dwPhase / 100 ) ) % 360;
 
-        Magnitude	= DiPeriodic.dwMagnitude;
-        Magnitude	= ( Magnitude * NormalRate + AttackLevel + FadeLevel ) / 100;
+    return Magnitude + DiPeriodic.lOffset;
+}
 
-        if (0 <= R && R < 90)
-        {
-            Magnitude	= -Magnitude * ( 90 - R ) / 90;
-        }
-        if (90 <= R && R < 180)
-        {
-            Magnitude	= Magnitude * ( R - 90 ) / 90;
-        }
-        if (180 <= R && R < 270)
-        {
-            Magnitude	= Magnitude * ( 90 - ( R - 180 ) ) / 90;
-        }
-        if (270 <= R && R < 360)
-        {
-            Magnitude	= -Magnitude * ( R - 270 ) / 90;
-        }
+LONG Feedback360Effect::CalcSine(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel)
+{
+    LONG R			= PeriodicAngle(CurrentPos);
+    LONG Magnitude	= PeriodicMagnitude(NormalRate, AttackLevel, FadeLevel);
 
-        Magnitude	= Magnitude + DiPeriodic.lOffset;
-    }
-    else if(CFEqual(Type, kFFEffectType_SawtoothUp_ID)) {
-        Period	= max( (DWORD)1, ( DiPeriodic.dwPeriod / 1000 ) );
-        R		= (CurrentPos%Period) * 360 / Period;
-        R		= ( R + ( DiPeriodic.dwPhase / 100 ) ) % 360;
+    Magnitude	= ( int)( Magnitude * sin( R * M_PI / 180.0 ) );
 
-        Magnitude	= DiPeriodic.dwMagnitude;
-        Magnitude	= ( Magnitude * NormalRate + AttackLevel + FadeLevel ) / 100;
+    return Magnitude + DiPeriodic.lOffset;
+}
 
-        if (0 <= R && R < 180)
-        {
-            Magnitude	= -Magnitude * ( 180 - R ) / 180;
-        }
-        if (180 <= R && R < 360)
-        {
-            Magnitude	= Magnitude * ( R - 180 ) / 180;
-        }
+LONG Feedback360Effect::CalcTriangle(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel)
+{
+    LONG R			= PeriodicAngle(CurrentPos);
+    LONG Magnitude	= PeriodicMagnitude(NormalRate, AttackLevel, FadeLevel);
 
-        Magnitude	= Magnitude + DiPeriodic.lOffset;
+    if (0 <= R && R < 90)
+    {
+        Magnitude	= -Magnitude * ( 90 - R ) / 90;
     }
-    else if (CFEqual(Type, kFFEffectType_SawtoothDown_ID)) {
-        Period	= max( (DWORD)1, ( DiPeriodic.dwPeriod / 1000 ) );
-        R		= (CurrentPos%Period) * 360 / Period;
-        R		= ( R + ( DiPeriodic.dwPhase / 100 ) ) % 360;
-
-        Magnitude	= DiPeriodic.dwMagnitude;
-        Magnitude	= ( Magnitude * NormalRate + AttackLevel + FadeLevel ) / 100;
-        if( 0 <= R && R < 180 )
-        {
-            Magnitude	= Magnitude * ( 180 - R ) / 180;
-        }
-        if( 180 <= R && R < 360 )
-        {
-            Magnitude	= -Magnitude * ( R - 180 ) / 180;
-        }
+    if (90 <= R && R < 180)
+    {
+        Magnitude	= Magnitude * ( R - 90 ) / 90;
+    }
+    if (180 <= R && R < 270)
+    {
+        Magnitude	= Magnitude * ( 90 - ( R - 180 ) ) / 90;
+    }
+    if (270 <= R && R < 360)
+    {
+        Magnitude	= -Magnitude * ( R - 270 ) / 90;
+    }
+
+    return Magnitude + DiPeriodic.lOffset;
+}
 
-        Magnitude	= Magnitude + DiPeriodic.lOffset;
+LONG Feedback360Effect::CalcSawtoothUp(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel)
+{
+    LONG R			= PeriodicAngle(CurrentPos);
+    LONG Magnitude	= PeriodicMagnitude(NormalRate, AttackLevel, FadeLevel);
+
+    if (0 <= R && R < 180)
+    {
+        Magnitude	= -Magnitude * ( 180 - R ) / 180;
+    }
+    if (180 <= R && R < 360)
+    {
+        Magnitude	= Magnitude * ( R - 180 ) / 180;
     }
-    else if (CFEqual(Type, kFFEffectType_RampForce_ID)) {
-        Rate		= ( Duration - CurrentPos ) * 100
-        / Duration;//MAX( 1, DiEffect.dwDuration / 1000 );
 
-        Magnitude	= ( DiRampforce.lStart * Rate
-                       + DiRampforce.lEnd * ( 100 - Rate ) ) / 100;
-        Magnitude	= ( Magnitude * NormalRate + AttackLevel + FadeLevel ) / 100;
+    return Magnitude + DiPeriodic.lOffset;
+}
+
+LONG Feedback360Effect::CalcSawtoothDown(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel)
+{
+    LONG R			= PeriodicAngle(CurrentPos);
+    LONG Magnitude	= PeriodicMagnitude(NormalRate, AttackLevel, FadeLevel);
+
+    if( 0 <= R && R < 180 )
+    {
+        Magnitude	= Magnitude * ( 180 - R ) / 180;
+    }
+    if( 180 <= R && R < 360 )
+    {
+        Magnitude	= -Magnitude * ( R - 180 ) / 180;
     }
 
-    *NormalLevel = Magnitude * (LONG)DiEffect.dwGain / 10000;
+    return Magnitude + DiPeriodic.lOffset;
 }
@@ -31,6 +31,7 @@
 #include <IOKit/IOCFPlugIn.h>
 #include <ForceFeedback/IOForceFeedbackLib.h>
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 #include <algorithm>
 
@@ -50,6 +51,7 @@
 #define	INERTIA			0x09
 #define	FRICTION		0x0A
 #define	CUSTOM_FORCE	0x0B
+#define	UNKNOWN_FORCE	0x0C
 
 #define SCALE_MAX (LONG)255
 
@@ -60,16 +62,21 @@ class Feedback360Effect
 public:
     Feedback360Effect(FFEffectDownloadID theHand);
     Feedback360Effect(const Feedback360Effect &src);
+    ~Feedback360Effect();
 
     LONG Calc(LONG *LeftLevel, LONG *RightLevel);
+    double NextChange(double CurrentTime, double Granularity);
+    void SetType(CFUUIDRef EffectType);
 
 	CFUUIDRef		Type;
+    DWORD           Kind;           // Type as one of the values above, found once by SetType
     FFEffectDownloadID Handle;
 
 	FFEFFECT		DiEffect;
     FFENVELOPE		DiEnvelope;
 	FFCONSTANTFORCE	DiConstantForce;
     FFCUSTOMFORCE   DiCustomForce;
+    LONG            *ForceData;     // DiCustomForce's samples, owned by the effect
 	FFPERIODIC		DiPeriodic;
 	FFRAMPFORCE		DiRampforce;
 
@@ -82,8 +89,24 @@ public:
 
 private:
     Feedback360Effect();
+    Feedback360Effect &operator=(const Feedback360Effect &src);
+    void CalcTimes(double *Duration, double *BeginTime, double *EndTime);
     void CalcEnvelope(ULONG Duration, ULONG CurrentPos, LONG *NormalRate, LONG *AttackLevel, LONG *FadeLevel);
     void CalcForce(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel, LONG * NormalLevel);
+
+    // Force of each kind of effect, given the magnitude after the envelope
+    typedef LONG (Feedback360Effect::*Evaluator)(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel);
+    static const Evaluator Evaluators[UNKNOWN_FORCE];
+
+    LONG PeriodicAngle(ULONG CurrentPos);
+    LONG PeriodicMagnitude(LONG NormalRate, LONG AttackLevel, LONG FadeLevel);
+    LONG CalcConstant(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel);
+    LONG CalcRamp(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel);
+    LONG CalcSquare(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel);
+    LONG CalcSine(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel);
+    LONG CalcTriangle(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel);
+    LONG CalcSawtoothUp(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel);
+    LONG CalcSawtoothDown(ULONG Duration, ULONG CurrentPos, LONG NormalRate, LONG AttackLevel, LONG FadeLevel);
 };
 
 #endif
@@ -22,8 +22,77 @@
 */
 
 #include <IOKit/IOCFPlugIn.h>
+#include <IOKit/usb/USB.h>
+#include <sys/time.h>
 #include "devlink.h"
 
+// Runs the link's run loop, where the reports complete
+static void* Device_Thread(void *context)
+{
+    DeviceLink *link = (DeviceLink*)context;
+
+    pthread_mutex_lock(&link->lock);
+    link->runLoop = CFRunLoopGetCurrent();
+    CFRetain(link->runLoop);
+    CFRunLoopAddSource(link->runLoop, link->source, kCFRunLoopDefaultMode);
+    pthread_cond_broadcast(&link->idle);
+    pthread_mutex_unlock(&link->lock);
+    // Wake up now and then in case the stop came before the run loop started
+    while (!__atomic_load_n(&link->stopping, __ATOMIC_ACQUIRE))
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.5, false);
+    CFRunLoopRemoveSource(link->runLoop, link->source, kCFRunLoopDefaultMode);
+    return NULL;
+}
+
+static void Device_Complete(void *target, IOReturn result, void *refcon, void *sender, uint32_t bufferSize);
+
+// Starts the oldest waiting report, with the lock held and nothing in flight
+static void Device_StartNext(DeviceLink *link)
+{
+    while (!link->busy)
+    {
+        DeviceReport *next = NULL;
+
+        for (int i = 0; i < DEVICE_REPORT_KINDS; i++)
+        {
+            if ((link->pending[i].sequence != 0) && ((next == NULL) || ((SInt32)(link->pending[i].sequence - next->sequence) < 0)))
+                next = &link->pending[i];
+        }
+        if (next == NULL)
+            break;
+        memcpy(link->sending, next->data, next->length);
+        next->sequence = 0;
+        IOReturn res=(*link->interface)->setReport(link->interface,kIOHIDReportTypeOutput,0,link->sending,next->length,DEVICE_SEND_TIMEOUT,Device_Complete,link,NULL);
+        if (res == kIOReturnSuccess)
+            link->busy = true;
+        else {
+            link->failures++;
+            fprintf(stderr, "Device_Send failed: 0x%.8x\n", res);
+        }
+    }
+    if (!link->busy)
+        pthread_cond_broadcast(&link->idle);
+}
+
+// Called on the link's run loop when a report has gone out, or failed to
+static void Device_Complete(void *target, IOReturn result, void *refcon, void *sender, uint32_t bufferSize)
+{
+    DeviceLink *link = (DeviceLink*)target;
+
+    pthread_mutex_lock(&link->lock);
+    link->busy = false;
+    if (result == kIOReturnSuccess)
+        link->sent++;
+    else if ((result == kIOReturnTimeout) || (result == kIOUSBTransactionTimeout))
+        link->timeouts++;
+    else {
+        link->failures++;
+        fprintf(stderr, "Device_Send failed: 0x%.8x\n", result);
+    }
+    Device_StartNext(link);
+    pthread_mutex_unlock(&link->lock);
+}
+
 // Initialise the link
 bool Device_Initialise(DeviceLink *link,io_object_t device)
 {
@@ -36,29 +105,99 @@ bool Device_Initialise(DeviceLink *link,io_object_t device)
     (*plugInInterface)->Release(plugInInterface);
     if (ret!=kIOReturnSuccess) return false;
     (*link->interface)->open(link->interface, 0);
+
+    memset(link->pending, 0, sizeof(link->pending));
+    link->busy = false;
+    link->stopping = false;
+    link->sequence = 0;
+    link->sent = link->replaced = link->failures = link->timeouts = 0;
+    pthread_mutex_init(&link->lock, NULL);
+    pthread_cond_init(&link->idle, NULL);
+    // Reports are still sent, synchronously, without a thread to complete them on
+    link->runLoop = NULL;
+    link->source = NULL;
+    if ((*link->interface)->createAsyncEventSource(link->interface, &link->source) == kIOReturnSuccess) {
+        if (pthread_create(&link->thread, NULL, Device_Thread, link) == 0) {
+            pthread_mutex_lock(&link->lock);
+            while (link->runLoop == NULL)
+                pthread_cond_wait(&link->idle, &link->lock);
+            pthread_mutex_unlock(&link->lock);
+        } else {
+            CFRelease(link->source);
+            link->source = NULL;
+        }
+    }
     return true;
 }
 
 // Finish the link
 void Device_Finalise(DeviceLink *link)
 {
+    if (link->runLoop != NULL) {
+        struct timeval now;
+        struct timespec deadline;
+
+        // Let the last reports, like turning the motors off, go out first
+        gettimeofday(&now, NULL);
+        deadline.tv_sec = now.tv_sec + (DEVICE_SEND_TIMEOUT / 1000) + 1;
+        deadline.tv_nsec = now.tv_usec * 1000;
+        pthread_mutex_lock(&link->lock);
+        while (link->busy) {
+            if (pthread_cond_timedwait(&link->idle, &link->lock, &deadline) != 0)
+                break;
+        }
+        memset(link->pending, 0, sizeof(link->pending));
+        pthread_mutex_unlock(&link->lock);
+    }
     (*link->interface)->close(link->interface);
+    if (link->runLoop != NULL) {
+        __atomic_store_n(&link->stopping, true, __ATOMIC_RELEASE);
+        CFRunLoopStop(link->runLoop);
+        pthread_join(link->thread, NULL);
+        CFRelease(link->runLoop);
+        CFRelease(link->source);
+        link->runLoop = NULL;
+        link->source = NULL;
+    }
     (*link->interface)->Release(link->interface);
     link->interface = NULL;
+    pthread_cond_destroy(&link->idle);
+    pthread_mutex_destroy(&link->lock);
 }
 
-// Send a report via the link
+// Send a report via the link. The newest report of each kind replaces any
+// still waiting, as only one goes out at a time.
 bool Device_Send(DeviceLink *link,void *data,int length)
 {
     if(link->interface==NULL) {
         fprintf(stderr, "Attempting to send to a closed link!\n");
         return false;
     }
-    else {
+    else if (link->runLoop==NULL) {
         //fprintf(stderr, "Attempting to send: %d %d %d %d\n",((unsigned char*)data)[0], ((unsigned char*)data)[1], ((unsigned char*)data)[2], ((unsigned char*)data)[3]);
-        IOReturn res=(*link->interface)->setReport(link->interface,kIOHIDReportTypeOutput,0,data,length,10000,NULL,NULL,NULL);
+        IOReturn res=(*link->interface)->setReport(link->interface,kIOHIDReportTypeOutput,0,data,length,DEVICE_SEND_TIMEOUT,NULL,NULL,NULL);
         if (res != kIOReturnSuccess)
             fprintf(stderr, "Device_Send failed: 0x%.8x\n", res);
         return res == kIOReturnSuccess;
     }
+    else if ((length <= 0) || (length > DEVICE_REPORT_SIZE)) {
+        fprintf(stderr, "Device_Send: report too large (%d)\n", length);
+        return false;
+    }
+    else {
+        UInt8 kind = ((UInt8*)data)[0];
+        DeviceReport *report = &link->pending[(kind < DEVICE_REPORT_KINDS) ? kind : (DEVICE_REPORT_KINDS - 1)];
+
+        pthread_mutex_lock(&link->lock);
+        if (report->sequence != 0)
+            link->replaced++;
+        memcpy(report->data, data, length);
+        report->length = length;
+        if (++link->sequence == 0)
+            link->sequence = 1;
+        report->sequence = link->sequence;
+        Device_StartNext(link);
+        pthread_mutex_unlock(&link->lock);
+        return true;
+    }
 }
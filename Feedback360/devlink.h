@@ -25,9 +25,42 @@
 
 #include <CoreFoundation/CoreFoundation.h>
 #include <IOKit/hid/IOHIDLib.h>
+#include <pthread.h>
+
+// Largest report that can be sent
+#define DEVICE_REPORT_SIZE      8
+// Reports are replaced by newer ones with the same first byte, with every
+// report starting with this or above sharing the last kind
+#define DEVICE_REPORT_KINDS     4
+// How long a report may take to go out, in ms
+#define DEVICE_SEND_TIMEOUT     1000
+
+typedef struct {
+    UInt8 data[DEVICE_REPORT_SIZE];
+    int length;
+    UInt32 sequence;                                // Order it was sent in, 0 if nothing is waiting
+} DeviceReport;
 
 typedef struct {
     IOHIDDeviceInterface121 **interface;
+
+    // Reports go out one at a time, completing on the link's own run loop
+    pthread_t thread;
+    CFRunLoopRef runLoop;                           // NULL if reports are sent synchronously
+    CFRunLoopSourceRef source;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    bool busy;
+    UInt8 sending[DEVICE_REPORT_SIZE];
+    DeviceReport pending[DEVICE_REPORT_KINDS];      // Newest report of each kind waiting to go
+    UInt32 sequence;
+
+    // Statistics
+    UInt32 sent;
+    UInt32 replaced;                                // Reports superseded before they went out
+    UInt32 failures;
+    UInt32 timeouts;
 } DeviceLink;
 
 bool Device_Initialise(DeviceLink *link,io_object_t device);
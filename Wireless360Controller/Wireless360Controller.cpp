@@ -25,35 +25,38 @@
 #include "../WirelessGamingReceiver/WirelessDevice.h"
 #include "../360Controller/ControlStruct.h"
 #include "../360Controller/xbox360hid.h"
+#include "../360Controller/Uptime.h"
 
 #define kDriverSettingKey "DeviceData"
+#define kReportStatisticsKey "ReportStatistics"
 
 OSDefineMetaClassAndStructors(Wireless360Controller, WirelessHIDDevice)
 #define super WirelessHIDDevice
 
-static inline Xbox360_SShort getAbsolute(Xbox360_SShort value)
-{
-    Xbox360_SShort reverse;
-
-#ifdef __LITTLE_ENDIAN__
-    reverse=value;
-#elif __BIG_ENDIAN__
-    reverse=((value&0xFF00)>>8)|((value&0x00FF)<<8);
-#else
-#error Unknown CPU byte order
-#endif
-    return (reverse<0)?~reverse:reverse;
-}
-
 bool Wireless360Controller::init(OSDictionary *propTable)
 {
     bool res = super::init(propTable);
 
+    settingsLock = IOLockAlloc();
+    leftTable = (XBOX360_STICK_TABLE*)IOMalloc(sizeof(XBOX360_STICK_TABLE));
+    rightTable = (XBOX360_STICK_TABLE*)IOMalloc(sizeof(XBOX360_STICK_TABLE));
+    if ((settingsLock == NULL) || (leftTable == NULL) || (rightTable == NULL))
+        return false;
+    transformState.left = leftTable;
+    transformState.right = rightTable;
+    transformState.buttons = &buttonTable;
     // Default settings
     invertLeftX = invertLeftY = false;
     invertRightX = invertRightY = false;
     deadzoneLeft = deadzoneRight = 0;
     relativeLeft = relativeRight = false;
+    radialLeft = radialRight = false;
+    antiDeadzoneLeft = antiDeadzoneRight = 0;
+    curveLeft = curveRight = XBOX360_CURVE_LINEAR;
+    duplicateMode = filterOff;
+    duplicateKeepalive = 100;
+    coalesceBacklog = false;
+    powerOffTimeout = POWEROFF_TIMEOUT;
     readSettings();
     // Bindings
     noMapping = true;
@@ -65,11 +68,43 @@ bool Wireless360Controller::init(OSDictionary *propTable)
     {
         mapping[i-1] = i;
     }
+    IOLockLock(settingsLock);
+    UpdateTransform();
+    IOLockUnlock(settingsLock);
+    filterPassed = OSNumber::withNumber((unsigned long long)0, 32);
+    filterSuppressed = OSNumber::withNumber((unsigned long long)0, 32);
+    if ((filterPassed != NULL) && (filterSuppressed != NULL))
+    {
+        OSDictionary *statistics = OSDictionary::withCapacity(2);
+
+        if (statistics != NULL)
+        {
+            statistics->setObject("Passed", filterPassed);
+            statistics->setObject("Suppressed", filterSuppressed);
+            setProperty(kReportStatisticsKey, statistics);
+            statistics->release();
+        }
+    }
 
     // Done
     return res;
 }
 
+void Wireless360Controller::free(void)
+{
+    if (leftTable != NULL)
+        IOFree(leftTable, sizeof(XBOX360_STICK_TABLE));
+    if (rightTable != NULL)
+        IOFree(rightTable, sizeof(XBOX360_STICK_TABLE));
+    if (filterPassed != NULL)
+        filterPassed->release();
+    if (filterSuppressed != NULL)
+        filterSuppressed->release();
+    if (settingsLock != NULL)
+        IOLockFree(settingsLock);
+    super::free();
+}
+
 // Read the settings from the registry
 void Wireless360Controller::readSettings(void)
 {
@@ -78,6 +113,8 @@ void Wireless360Controller::readSettings(void)
     OSDictionary *dataDictionary = OSDynamicCast(OSDictionary, getProperty(kDriverSettingKey));
 
     if(dataDictionary==NULL) return;
+    // Reports are held off while the settings and tables change
+    IOLockLock(settingsLock);
     value = OSDynamicCast(OSBoolean, dataDictionary->getObject("InvertLeftX"));
     if (value != NULL) invertLeftX = value->getValue();
     value = OSDynamicCast(OSBoolean, dataDictionary->getObject("InvertLeftY"));
@@ -98,8 +135,28 @@ void Wireless360Controller::readSettings(void)
     if (value != NULL) deadOffLeft = value->getValue();
     value = OSDynamicCast(OSBoolean, dataDictionary->getObject("DeadOffRight"));
     if (value != NULL) deadOffRight = value->getValue();
+    value = OSDynamicCast(OSBoolean, dataDictionary->getObject("RadialLeft"));
+    if (value != NULL) radialLeft = value->getValue();
+    value = OSDynamicCast(OSBoolean, dataDictionary->getObject("RadialRight"));
+    if (value != NULL) radialRight = value->getValue();
+    number = OSDynamicCast(OSNumber, dataDictionary->getObject("AntiDeadzoneLeft"));
+    if (number != NULL) antiDeadzoneLeft = number->unsigned32BitValue();
+    number = OSDynamicCast(OSNumber, dataDictionary->getObject("AntiDeadzoneRight"));
+    if (number != NULL) antiDeadzoneRight = number->unsigned32BitValue();
+    number = OSDynamicCast(OSNumber, dataDictionary->getObject("CurveLeft"));
+    if (number != NULL) curveLeft = number->unsigned32BitValue();
+    number = OSDynamicCast(OSNumber, dataDictionary->getObject("CurveRight"));
+    if (number != NULL) curveRight = number->unsigned32BitValue();
     number = OSDynamicCast(OSNumber, dataDictionary->getObject("RumbleType"));
     if (number != NULL) rumbleType = number->unsigned8BitValue();
+    number = OSDynamicCast(OSNumber, dataDictionary->getObject("DuplicateReports"));
+    if (number != NULL) duplicateMode = number->unsigned8BitValue();
+    number = OSDynamicCast(OSNumber, dataDictionary->getObject("DuplicateKeepalive"));
+    if (number != NULL) duplicateKeepalive = number->unsigned32BitValue();
+    value = OSDynamicCast(OSBoolean, dataDictionary->getObject("CoalesceBacklog"));
+    if (value != NULL) coalesceBacklog = value->getValue();
+    number = OSDynamicCast(OSNumber, dataDictionary->getObject("PowerOffTimeout"));
+    if (number != NULL) powerOffTimeout = number->unsigned32BitValue();
     number = OSDynamicCast(OSNumber, dataDictionary->getObject("BindingUp"));
     if (number != NULL) mapping[0] = number->unsigned32BitValue();
     number = OSDynamicCast(OSNumber, dataDictionary->getObject("BindingDown"));
@@ -143,6 +200,8 @@ void Wireless360Controller::readSettings(void)
             break;
         }
     }
+    UpdateTransform();
+    IOLockUnlock(settingsLock);
 #if 0
     IOLog("Xbox360ControllerClass preferences loaded:\n  invertLeft X: %s, Y: %s\n   invertRight X: %s, Y:%s\n  deadzone Left: %d, Right: %d\n\n",
             invertLeftX?"True":"False",invertLeftY?"True":"False",
@@ -151,189 +210,49 @@ void Wireless360Controller::readSettings(void)
 #endif
 }
 
-// Adjusts the report for any settings specified by the user
-void Wireless360Controller::fiddleReport(unsigned char *data, int length)
+// Rebuilds the tables and picks the transform for the current settings.
+// Called with settingsLock held.
+void Wireless360Controller::UpdateTransform(void)
 {
-    XBOX360_IN_REPORT *report=(XBOX360_IN_REPORT*)data;
-    if(invertLeftX) report->left.x=~report->left.x;
-    if(!invertLeftY) report->left.y=~report->left.y;
-    if(invertRightX) report->right.x=~report->right.x;
-    if(!invertRightY) report->right.y=~report->right.y;
-    if(deadzoneLeft!=0) {
-        if(relativeLeft) {
-            if((getAbsolute(report->left.x)<deadzoneLeft)&&(getAbsolute(report->left.y)<deadzoneLeft)) {
-                report->left.x=0;
-                report->left.y=0;
-            }
-            else if(deadOffLeft) {
-                const UInt16 max16=32767;
-                float maxVal=max16-deadzoneLeft;
-                float valX=getAbsolute(report->left.x);
-                if (valX>deadzoneLeft) {
-                    if (report->left.x<0) {
-                        report->left.x=max16*(valX-deadzoneLeft)/maxVal;
-                        report->left.x=~report->left.x;
-                    } else {
-                        report->left.x=max16*(valX-deadzoneLeft)/maxVal;
-                    }
-                } else {
-                    report->left.x=0;
-                }
-                float valY=getAbsolute(report->left.y);
-                if (valY>deadzoneLeft) {
-                    if (report->left.y<0) {
-                        report->left.y=max16*(valY-deadzoneLeft)/maxVal;
-                        report->left.y=~report->left.y;
-                    } else {
-                        report->left.y=max16*(valY-deadzoneLeft)/maxVal;
-                    }
-                } else {
-                    report->left.y=0;
-                }
-            }
-        } else {
-            if(getAbsolute(report->left.x)<deadzoneLeft)
-                report->left.x=0;
-            else if (deadOffLeft)
-            {
-                const UInt16 max16=32767;
-                float maxVal=max16-deadzoneLeft;
-                if (report->left.x<0) {
-                    float valX=getAbsolute(report->left.x);
-                    report->left.x=max16*(valX-deadzoneLeft)/maxVal;
-                    report->left.x=~report->left.x;
-                } else {
-                    float valX=getAbsolute(report->left.x);
-                    report->left.x=max16*(valX-deadzoneLeft)/maxVal;
-                }
-            }
-            if(getAbsolute(report->left.y)<deadzoneLeft)
-                report->left.y=0;
-            else if (deadOffLeft)
-            {
-                const UInt16 max16=32767;
-                float maxVal = max16-deadzoneLeft;
-                if (report->left.y<0) {
-                    float valY=getAbsolute(report->left.y);
-                    report->left.y=max16*(valY-deadzoneLeft)/maxVal;
-                    report->left.y=~report->left.y;
-                } else {
-                    float valY=getAbsolute(report->left.y);
-                    report->left.y=max16*(valY-deadzoneLeft)/maxVal;
-                }
-            }
-        }
-    }
-    if(deadzoneRight!=0) {
-        if(relativeRight) {
-            if((getAbsolute(report->right.x)<deadzoneRight)&&(getAbsolute(report->right.y)<deadzoneRight)) {
-                report->right.x=0;
-                report->right.y=0;
-            }
-            else if(deadOffRight) {
-                const UInt16 max16=32767;
-                float maxVal=max16-deadzoneRight;
-                float valX=getAbsolute(report->right.x);
-                if (valX>deadzoneRight) {
-                    if (report->right.x<0) {
-                        report->right.x=max16*(valX-deadzoneRight)/maxVal;
-                        report->right.x=~report->right.x;
-                    } else {
-                        report->right.x=max16*(valX-deadzoneRight)/maxVal;
-                    }
-                } else {
-                    report->right.x = 0;
-                }
-                float valY=getAbsolute(report->right.y);
-                if (valY>deadzoneRight) {
-                    if (report->right.y<0) {
-                        report->right.y=max16*(valY-deadzoneRight)/maxVal;
-                        report->right.y=~report->right.y;
-                    } else {
-                        report->right.y=max16*(valY-deadzoneRight)/maxVal;
-                    }
-                } else {
-                    report->right.y = 0;
-                }
-            }
-        } else {
-            if(getAbsolute(report->right.x)<deadzoneRight)
-                report->right.x=0;
-            else if (deadOffRight)
-            {
-                const UInt16 max16=32767;
-                float maxVal=max16-deadzoneRight;
-                if (report->right.x<0) {
-                    float valX=getAbsolute(report->right.x);
-                    report->right.x=max16*(valX-deadzoneRight)/maxVal;
-                    report->right.x=~report->right.x;
-                } else {
-                    float valX=getAbsolute(report->right.x);
-                    report->right.x=max16*(valX-deadzoneRight)/maxVal;
-                }
-            }
-            if(getAbsolute(report->right.y)<deadzoneRight)
-                report->right.y=0;
-            else if (deadOffRight)
-            {
-                const UInt16 max16=32767;
-                float maxVal=max16-deadzoneRight;
-                if (report->right.y<0) {
-                    float valY=getAbsolute(report->right.y);
-                    report->right.y=max16*(valY-deadzoneRight)/maxVal;
-                    report->right.y=~report->right.y;
-                } else {
-                    float valY=getAbsolute(report->right.y);
-                    report->right.y=max16*(valY-deadzoneRight)/maxVal;
-                }
-            }
-        }
-    }
+    // The Y axes are flipped unless the user asked for them to be inverted
+    Xbox360_BuildStickTable(leftTable, invertLeftX, !invertLeftY, deadzoneLeft, relativeLeft, deadOffLeft,
+                            radialLeft, antiDeadzoneLeft, curveLeft);
+    Xbox360_BuildStickTable(rightTable, invertRightX, !invertRightY, deadzoneRight, relativeRight, deadOffRight,
+                            radialRight, antiDeadzoneRight, curveRight);
+    Xbox360_BuildButtonTable(&buttonTable, mapping);
+    transform = Xbox360_SelectTransform(Xbox360_TransformFlags(leftTable, rightTable, !noMapping, swapSticks));
+    Xbox360_SetFilter(&filter, duplicateMode, duplicateKeepalive);
 }
 
-void Wireless360Controller::remapButtons(void *buffer)
+void Wireless360Controller::receivedHIDupdate(unsigned char *data, int length)
 {
-    XBOX360_IN_REPORT *report360 = (XBOX360_IN_REPORT*)buffer;
-    UInt16 new_buttons = 0;
-
-    new_buttons |= ((report360->buttons & 1) == 1) << mapping[0];
-    new_buttons |= ((report360->buttons & 2) == 2) << mapping[1];
-    new_buttons |= ((report360->buttons & 4) == 4) << mapping[2];
-    new_buttons |= ((report360->buttons & 8) == 8) << mapping[3];
-    new_buttons |= ((report360->buttons & 16) == 16) << mapping[4];
-    new_buttons |= ((report360->buttons & 32) == 32) << mapping[5];
-    new_buttons |= ((report360->buttons & 64) == 64) << mapping[6];
-    new_buttons |= ((report360->buttons & 128) == 128) << mapping[7];
-    new_buttons |= ((report360->buttons & 256) == 256) << mapping[8];
-    new_buttons |= ((report360->buttons & 512) == 512) << mapping[9];
-    new_buttons |= ((report360->buttons & 1024) == 1024) << mapping[10];
-    new_buttons |= ((report360->buttons & 4096) == 4096) << mapping[11];
-    new_buttons |= ((report360->buttons & 8192) == 8192) << mapping[12];
-    new_buttons |= ((report360->buttons & 16384) == 16384) << mapping[13];
-    new_buttons |= ((report360->buttons & 32768) == 32768) << mapping[14];
-
-//    IOLog("BUTTON PACKET - %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d\n", mapping[0], mapping[1], mapping[2], mapping[3], mapping[4], mapping[5], mapping[6], mapping[7], mapping[8], mapping[9], mapping[10], mapping[11], mapping[12], mapping[13], mapping[14]);
-
-    report360->buttons = new_buttons;
-}
+    bool pass = true;
 
-void Wireless360Controller::remapAxes(void *buffer)
-{
-    XBOX360_IN_REPORT *report360 = (XBOX360_IN_REPORT*)buffer;
+    IOLockLock(settingsLock);
+    transform((XBOX360_IN_REPORT*)data, &transformState);
+    if (filter.mode != filterOff)
+    {
+        pass = Xbox360_FilterReport(&filter, (XBOX360_IN_REPORT*)data, Xbox360_GetUptimeMS());
 
-    XBOX360_HAT temp = report360->left;
-    report360->left = report360->right;
-    report360->right = temp;
+        if ((filterPassed != NULL) && (filterSuppressed != NULL))
+        {
+            filterPassed->setValue(filter.passed);
+            filterSuppressed->setValue(filter.suppressed);
+        }
+    }
+    IOLockUnlock(settingsLock);
+    if (pass)
+        super::receivedHIDupdate(data, length);
 }
 
-void Wireless360Controller::receivedHIDupdate(unsigned char *data, int length)
+// The neutral report doesn't go through the filter, so start it afresh and the
+// controller's first report after it comes back is always passed on
+void Wireless360Controller::sendNeutralReport(void)
 {
-    fiddleReport(data, length);
-    if (!noMapping)
-        remapButtons(data);
-    if (swapSticks)
-        remapAxes(data);
-    super::receivedHIDupdate(data, length);
+    IOLockLock(settingsLock);
+    Xbox360_SetFilter(&filter, duplicateMode, duplicateKeepalive);
+    IOLockUnlock(settingsLock);
+    super::sendNeutralReport();
 }
 
 void Wireless360Controller::SetRumbleMotors(unsigned char large, unsigned char small)
@@ -342,7 +261,7 @@ void Wireless360Controller::SetRumbleMotors(unsigned char large, unsigned char s
     WirelessDevice *device = OSDynamicCast(WirelessDevice, getProvider());
 
     if (device != NULL)
-        device->SendPacket(buf, sizeof(buf));
+        device->SendRumble(buf, sizeof(buf));
 }
 
 IOReturn Wireless360Controller::setReport(IOMemoryDescriptor *report, IOHIDReportType reportType, IOOptionBits options)
@@ -385,6 +304,7 @@ IOReturn Wireless360Controller::setProperties(OSObject *properties)
     if(dictionary!=NULL) {
         setProperty(kDriverSettingKey,dictionary);
         readSettings();
+        UpdateIdleTimer();
         return kIOReturnSuccess;
     } else return kIOReturnBadArgument;
 }
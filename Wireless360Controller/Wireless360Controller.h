@@ -24,12 +24,14 @@
 #define __WIRELESS360CONTROLLER_H__
 
 #include "../WirelessGamingReceiver/WirelessHIDDevice.h"
+#include "../360Controller/ReportTransform.h"
 
 class Wireless360Controller : public WirelessHIDDevice
 {
     OSDeclareDefaultStructors(Wireless360Controller);
 public:
     bool init(OSDictionary *propTable = NULL);
+    void free(void);
 
     void SetRumbleMotors(unsigned char large, unsigned char small);
 
@@ -48,6 +50,7 @@ public:
 protected:
     void readSettings(void);
     void receivedHIDupdate(unsigned char *data, int length);
+    void sendNeutralReport(void);
 
     // Settings
     bool invertLeftX,invertLeftY;
@@ -55,6 +58,11 @@ protected:
     short deadzoneLeft,deadzoneRight;
     bool relativeLeft,relativeRight;
     bool deadOffLeft, deadOffRight;
+    bool radialLeft, radialRight;
+    short antiDeadzoneLeft, antiDeadzoneRight;
+    short curveLeft, curveRight;
+    UInt8 duplicateMode;
+    UInt32 duplicateKeepalive;
 
     UInt8 rumbleType;
 
@@ -63,9 +71,19 @@ protected:
     bool noMapping = true;
 
 private:
-    void fiddleReport(unsigned char *data, int length);
-    void remapButtons(void *buffer);
-    void remapAxes(void *buffer);
+    void UpdateTransform(void);
+
+    // Held while the settings are read and the tables rebuilt, and while a
+    // report goes through them, so a report never sees half-built tables
+    IOLock *settingsLock;
+    XBOX360_STICK_TABLE *leftTable, *rightTable;
+    XBOX360_BUTTON_TABLE buttonTable;
+    XBOX360_REPORT_TRANSFORM transform;
+    XBOX360_TRANSFORM_STATE transformState;
+
+    // Spots repeated reports, with its counters published in the registry
+    XBOX360_REPORT_FILTER filter;
+    OSNumber *filterPassed, *filterSuppressed;
 };
 
 #endif // __WIRELESS360CONTROLLER_H__
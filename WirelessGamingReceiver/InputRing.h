@@ -0,0 +1,140 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    InputRing.h - fixed size queue of packets from one wireless controller
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __INPUTRING_H__
+#define __INPUTRING_H__
+
+#include <string.h>
+#ifdef __APPLE__
+#include <libkern/OSTypes.h>
+#else
+#include <stdint.h>
+typedef uint8_t UInt8;
+typedef uint32_t UInt32;
+#endif
+
+// Must be a power of two
+#define WIRELESS_RING_SLOTS     16
+// Every message the controllers send fits in this
+#define WIRELESS_PACKET_SIZE    29
+
+typedef struct WIRELESS_RING_SLOT {
+    UInt8 length;
+    bool input;                 // Input state, which the next input state makes stale
+    UInt8 data[WIRELESS_PACKET_SIZE];
+} WIRELESS_RING_SLOT;
+
+// When the ring is full, the oldest input state is thrown away to make room,
+// whatever is arriving. Status messages are never thrown away for anything.
+// The caller must serialise access.
+typedef struct WIRELESS_INPUT_RING {
+    UInt32 head;                // Oldest packet
+    UInt32 count;
+    UInt32 highWater;           // Most packets ever waiting at once
+    UInt32 dropped;             // Input states thrown away
+    UInt32 lost;                // Status messages that found the ring full of other status messages
+    WIRELESS_RING_SLOT slots[WIRELESS_RING_SLOTS];
+} WIRELESS_INPUT_RING;
+
+static inline void Wireless_RingReset(WIRELESS_INPUT_RING *ring)
+{
+    ring->head = 0;
+    ring->count = 0;
+    ring->highWater = 0;
+    ring->dropped = 0;
+    ring->lost = 0;
+}
+
+// Controller state reports arrive as HID updates
+static inline bool Wireless_IsInputPacket(const UInt8 *data, UInt32 length)
+{
+    return (length >= 4) && (data[1] == 0x01) && (data[3] == 0xf0);
+}
+
+// Returns the packet at a position in the queue, 0 being the oldest
+static inline const WIRELESS_RING_SLOT* Wireless_RingAt(const WIRELESS_INPUT_RING *ring, UInt32 i)
+{
+    return &ring->slots[(ring->head + i) & (WIRELESS_RING_SLOTS - 1)];
+}
+
+// Removes the oldest input state, closing the gap it leaves behind
+static inline bool Wireless_RingEvictInput(WIRELESS_INPUT_RING *ring)
+{
+    UInt32 i;
+
+    for (i = 0; i < ring->count; i++) {
+        if (Wireless_RingAt(ring, i)->input)
+            break;
+    }
+    if (i == ring->count)
+        return false;
+    for (; i > 0; i--)
+        ring->slots[(ring->head + i) & (WIRELESS_RING_SLOTS - 1)] = *Wireless_RingAt(ring, i - 1);
+    ring->head++;
+    ring->count--;
+    ring->dropped++;
+    return true;
+}
+
+// Copies a packet onto the end of the queue, returning false if it was thrown away
+static inline bool Wireless_RingPut(WIRELESS_INPUT_RING *ring, const UInt8 *data, UInt32 length)
+{
+    const bool input = Wireless_IsInputPacket(data, length);
+    WIRELESS_RING_SLOT *slot;
+
+    // Nothing would make sense of a longer message
+    if (length > WIRELESS_PACKET_SIZE)
+        return false;
+    if ((ring->count == WIRELESS_RING_SLOTS) && !Wireless_RingEvictInput(ring)) {
+        if (input)
+            ring->dropped++;
+        else
+            ring->lost++;
+        return false;
+    }
+    slot = &ring->slots[(ring->head + ring->count) & (WIRELESS_RING_SLOTS - 1)];
+    memcpy(slot->data, data, length);
+    slot->length = (UInt8)length;
+    slot->input = input;
+    ring->count++;
+    if (ring->count > ring->highWater)
+        ring->highWater = ring->count;
+    return true;
+}
+
+// Copies the oldest packet out and removes it, returning its size or 0 if the queue was empty
+static inline UInt32 Wireless_RingGet(WIRELESS_INPUT_RING *ring, void *data, UInt32 size)
+{
+    const WIRELESS_RING_SLOT *slot;
+    UInt32 length;
+
+    if (ring->count == 0)
+        return 0;
+    slot = Wireless_RingAt(ring, 0);
+    length = (slot->length < size) ? slot->length : size;
+    memcpy(data, slot->data, length);
+    ring->head++;
+    ring->count--;
+    return length;
+}
+
+#endif // __INPUTRING_H__
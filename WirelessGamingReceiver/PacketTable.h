@@ -0,0 +1,128 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    PacketTable.h - recognises the messages sent by the wireless receiver
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __PACKETTABLE_H__
+#define __PACKETTABLE_H__
+
+#include <stddef.h>
+#ifdef __APPLE__
+#include <libkern/OSTypes.h>
+#else
+#include <stdint.h>
+typedef uint8_t UInt8;
+typedef uint32_t UInt32;
+#endif
+
+// Marks an unused offset in a table entry
+#define WIRELESS_FIELD_NONE     0xFF
+
+// Where the serial number sits in an initial info message
+#define WIRELESS_SERIAL_OFFSET  0x0A
+#define WIRELESS_SERIAL_LENGTH  4
+
+typedef enum WirelessPacketKind {
+    kPacketUnknown = 0,
+    kPacketLink,                // Receiver: a controller connected (value != 0) or disconnected
+    kPacketInfo,                // Controller: initial info, value being an optional update type
+    kPacketHIDUpdate,           // Controller: input report in the payload
+    kPacketUpdate,              // Controller: value type, with the new value in the payload
+} WirelessPacketKind;
+
+// One kind of message, described by where to find its fields
+typedef struct WIRELESS_PACKET_TYPE {
+    UInt8 typeOffset, type;     // Byte identifying the message
+    UInt8 checkOffset, check;   // Second byte that must match, if any
+    UInt8 length;               // Required length, or 0 for any
+    UInt8 kind;
+    UInt8 valueOffset;          // Byte handed over as the value, if any
+    UInt8 payloadOffset;        // Where the payload starts
+    UInt8 sizeOffset;           // Byte giving the payload size, if not the rest of the message
+} WIRELESS_PACKET_TYPE;
+
+// A recognised message, pointing into the buffer it was parsed from
+typedef struct WIRELESS_PACKET {
+    UInt8 kind;
+    UInt8 value;
+    UInt8 *payload;
+    UInt32 payloadLength;
+} WIRELESS_PACKET;
+
+// Messages the receiver handles itself, anything else is for the controller
+static const WIRELESS_PACKET_TYPE Wireless_ReceiverPackets[] = {
+    {0, 0x08, WIRELESS_FIELD_NONE, 0, 2, kPacketLink, 1, 2, WIRELESS_FIELD_NONE},
+};
+
+// Messages from a controller
+static const WIRELESS_PACKET_TYPE Wireless_ControllerPackets[] = {
+    {1, 0x0f, WIRELESS_FIELD_NONE, 0, 29, kPacketInfo, 16, 17, WIRELESS_FIELD_NONE},
+    {1, 0x01, 3, 0xf0, 29, kPacketHIDUpdate, WIRELESS_FIELD_NONE, 4, 5},
+    {1, 0x00, WIRELESS_FIELD_NONE, 0, 29, kPacketUpdate, 3, 4, WIRELESS_FIELD_NONE},
+};
+
+#define WIRELESS_PACKET_TYPES(table)    (sizeof(table) / sizeof(table[0]))
+
+// Reads the serial number out of an initial info message
+static inline UInt32 Wireless_PacketSerial(const UInt8 *data)
+{
+    const UInt8 *serial = data + WIRELESS_SERIAL_OFFSET;
+
+    return ((UInt32)serial[0] << 24) | ((UInt32)serial[1] << 16) | ((UInt32)serial[2] << 8) | serial[3];
+}
+
+// Finds the first entry in the table matching a message and extracts its
+// fields in place, returning the kind or kPacketUnknown if nothing matched
+static inline UInt8 Wireless_ParsePacket(const WIRELESS_PACKET_TYPE *table, UInt32 count, UInt8 *data, UInt32 length, WIRELESS_PACKET *packet)
+{
+    const WIRELESS_PACKET_TYPE *entry;
+    UInt32 i, size;
+
+    for (i = 0; i < count; i++) {
+        entry = &table[i];
+        if ((entry->length != 0) ? (length != entry->length) : (length <= entry->typeOffset))
+            continue;
+        if (data[entry->typeOffset] != entry->type)
+            continue;
+        if ((entry->checkOffset != WIRELESS_FIELD_NONE) && ((entry->checkOffset >= length) || (data[entry->checkOffset] != entry->check)))
+            continue;
+        packet->kind = entry->kind;
+        packet->value = ((entry->valueOffset != WIRELESS_FIELD_NONE) && (entry->valueOffset < length)) ? data[entry->valueOffset] : 0;
+        if (entry->payloadOffset >= length) {
+            packet->payload = NULL;
+            packet->payloadLength = 0;
+            return entry->kind;
+        }
+        packet->payload = data + entry->payloadOffset;
+        size = length - entry->payloadOffset;
+        // Never trust a size from the message past its end
+        if ((entry->sizeOffset != WIRELESS_FIELD_NONE) && (entry->sizeOffset < length) && (data[entry->sizeOffset] < size))
+            size = data[entry->sizeOffset];
+        packet->payloadLength = size;
+        return entry->kind;
+    }
+    packet->kind = kPacketUnknown;
+    packet->value = 0;
+    packet->payload = NULL;
+    packet->payloadLength = 0;
+    return kPacketUnknown;
+}
+
+#endif // __PACKETTABLE_H__
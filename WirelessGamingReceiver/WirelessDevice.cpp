@@ -32,8 +32,20 @@ bool WirelessDevice::init(OSDictionary *dictionary)
     if (!super::init(dictionary))
         return false;
     index = -1;
+    callbacksRunning = 0;
+    target = NULL;
     function = NULL;
-    return true;
+    receiverTarget = NULL;
+    receiverFunction = NULL;
+    callbackLock = IOLockAlloc();
+    return callbackLock != NULL;
+}
+
+void WirelessDevice::free(void)
+{
+    if (callbackLock != NULL)
+        IOLockFree(callbackLock);
+    super::free();
 }
 
 // Checks if there's any data for us
@@ -47,15 +59,15 @@ bool WirelessDevice::IsDataAvailable(void)
     return receiver->IsDataQueued(index);
 }
 
-// Gets the next item from our buffer
-IOMemoryDescriptor* WirelessDevice::NextPacket(void)
+// Copies the next item from our buffer, returning its size or 0 if there was none
+UInt32 WirelessDevice::NextPacket(void *data, UInt32 size)
 {
     if (index == -1)
-        return NULL;
+        return 0;
     WirelessGamingReceiver *receiver = OSDynamicCast(WirelessGamingReceiver, getProvider());
     if (receiver == NULL)
-        return NULL;
-    return receiver->ReadBuffer(index);
+        return 0;
+    return receiver->ReadBuffer(index, data, size);
 }
 
 // Sends a buffer for this controller
@@ -69,27 +81,132 @@ void WirelessDevice::SendPacket(const void *data, size_t length)
     receiver->QueueWrite(index, data, (UInt32)length);
 }
 
+// Sends several buffers for this controller, one after the other from a single output buffer
+void WirelessDevice::SendPackets(const WirelessOutPacket *packets, int count)
+{
+    if (index == -1)
+        return;
+    WirelessGamingReceiver *receiver = OSDynamicCast(WirelessGamingReceiver, getProvider());
+    if (receiver == NULL)
+        return;
+    receiver->QueueWriteBatch(index, packets, count);
+}
+
+// Sends a rumble update for this controller, replacing any still waiting to go out
+void WirelessDevice::SendRumble(const void *data, size_t length)
+{
+    if (index == -1)
+        return;
+    WirelessGamingReceiver *receiver = OSDynamicCast(WirelessGamingReceiver, getProvider());
+    if (receiver == NULL)
+        return;
+    receiver->QueueRumble(index, data, (UInt32)length);
+}
+
 // Registers a callback function
-void WirelessDevice::RegisterWatcher(void *target, WirelessDeviceWatcher function, void *parameter)
+void WirelessDevice::RegisterWatcher(OSObject *target, WirelessDeviceWatcher function, void *parameter)
 {
+    IOLockLock(callbackLock);
     this->target = target;
     this->parameter = parameter;
     this->function = function;
+    if (function == NULL)
+    {
+        while (callbacksRunning != 0)
+            IOLockSleep(callbackLock, &callbacksRunning, THREAD_UNINT);
+    }
+    IOLockUnlock(callbackLock);
     if ((function != NULL) && IsDataAvailable())
         NewData();
 }
 
+// Registers a callback function that takes packets straight from the read buffer
+void WirelessDevice::RegisterReceiver(OSObject *target, WirelessDeviceReceiver function)
+{
+    IOLockLock(callbackLock);
+    receiverTarget = target;
+    receiverFunction = function;
+    if (function == NULL)
+    {
+        while (callbacksRunning != 0)
+            IOLockSleep(callbackLock, &callbacksRunning, THREAD_UNINT);
+    }
+    IOLockUnlock(callbackLock);
+}
+
 // For internal use, sets this instances index on the wireless gaming receiver
 void WirelessDevice::SetIndex(int i)
 {
     index = i;
 }
 
+// For internal use, the controller has gone but this node is kept in case it comes back
+void WirelessDevice::Park(void)
+{
+    index = -1;
+    messageClients(kIOMessageServiceIsSuspended);
+}
+
+// For internal use, a controller that was parked has come back
+void WirelessDevice::Reattach(int i)
+{
+    index = i;
+    messageClients(kIOMessageServiceIsResumed);
+}
+
 // Called when new data arrives
 void WirelessDevice::NewData(void)
 {
-    if (function != NULL)
-        function(target, this, parameter);
+    WirelessDeviceWatcher watcher;
+    OSObject *watcherTarget;
+    void *watcherParameter;
+
+    IOLockLock(callbackLock);
+    watcher = function;
+    watcherTarget = target;
+    watcherParameter = parameter;
+    if (watcher != NULL)
+    {
+        watcherTarget->retain();
+        callbacksRunning++;
+    }
+    IOLockUnlock(callbackLock);
+    if (watcher == NULL)
+        return;
+    watcher(watcherTarget, this, watcherParameter);
+    EndCallback(watcherTarget);
+}
+
+// Passes a packet on without queueing it, if anything is ready to take it
+bool WirelessDevice::DeliverPacket(unsigned char *data, int length)
+{
+    WirelessDeviceReceiver receiver;
+    OSObject *receiverObject;
+
+    IOLockLock(callbackLock);
+    receiver = receiverFunction;
+    receiverObject = receiverTarget;
+    if (receiver != NULL)
+    {
+        receiverObject->retain();
+        callbacksRunning++;
+    }
+    IOLockUnlock(callbackLock);
+    if (receiver == NULL)
+        return false;
+    receiver(receiverObject, this, data, length);
+    EndCallback(receiverObject);
+    return true;
+}
+
+// A callback has returned, so wake anything waiting to unregister and drop its target
+void WirelessDevice::EndCallback(OSObject *callbackTarget)
+{
+    IOLockLock(callbackLock);
+    if (--callbacksRunning == 0)
+        IOLockWakeup(callbackLock, &callbacksRunning, false);
+    IOLockUnlock(callbackLock);
+    callbackTarget->release();
 }
 
 // Gets the location ID for this device
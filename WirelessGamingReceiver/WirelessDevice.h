@@ -24,10 +24,20 @@
 #define __WIRELESSDEVICE_H__
 
 #include <IOKit/IOService.h>
+#include <IOKit/IOLocks.h>
 
 class WirelessDevice;
 
 typedef void (*WirelessDeviceWatcher)(void *target, WirelessDevice *sender, void *parameter);
+typedef void (*WirelessDeviceReceiver)(void *target, WirelessDevice *sender, unsigned char *data, int length);
+
+// One of the packets sent together by SendPackets
+typedef struct WirelessOutPacket
+{
+    const void *data;
+    size_t length;
+}
+WirelessOutPacket;
 
 class WirelessDevice : public IOService
 {
@@ -35,25 +45,43 @@ class WirelessDevice : public IOService
 
 public:
     bool init(OSDictionary *dictionary = 0);
+    void free(void);
 
     // Controller interface
     bool IsDataAvailable(void);
-    IOMemoryDescriptor* NextPacket(void);
+    UInt32 NextPacket(void *data, UInt32 size);
 
     void SendPacket(const void *data, size_t length);
+    void SendPackets(const WirelessOutPacket *packets, int count);
+    void SendRumble(const void *data, size_t length);
 
-    void RegisterWatcher(void *target, WirelessDeviceWatcher function, void *parameter);
+    // Passing a NULL function waits for any callback already running to return,
+    // so neither may be called from inside a callback
+    void RegisterWatcher(OSObject *target, WirelessDeviceWatcher function, void *parameter);
+    void RegisterReceiver(OSObject *target, WirelessDeviceReceiver function);
 
     OSNumber* newLocationIDNumber() const;
 
 private:
     friend class WirelessGamingReceiver;
     void SetIndex(int i);
+    void Park(void);
+    void Reattach(int i);
     void NewData(void);
+    bool DeliverPacket(unsigned char *data, int length);
+    void EndCallback(OSObject *callbackTarget);
     int index;
+    // Guards the registrations below. Each call holds a reference on its
+    // target and is counted, so unregistering can wait for it to finish.
+    IOLock *callbackLock;
+    UInt32 callbacksRunning;
     // callback
-    void *target, *parameter;
+    OSObject *target;
+    void *parameter;
     WirelessDeviceWatcher function;
+    // direct delivery
+    OSObject *receiverTarget;
+    WirelessDeviceReceiver receiverFunction;
 };
 
 #endif // __WIRELESSDEVICE_H__
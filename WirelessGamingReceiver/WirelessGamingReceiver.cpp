@@ -23,18 +23,12 @@
 #include "WirelessGamingReceiver.h"
 #include "WirelessDevice.h"
 #include "devices.h"
+#include "../360Controller/Uptime.h"
 
 //#define PROTOCOL_DEBUG
 
 OSDefineMetaClassAndStructors(WirelessGamingReceiver, IOService)
 
-// Holds data for asynchronous reads
-typedef struct WGRREAD
-{
-    int index;
-    IOBufferMemoryDescriptor *buffer;
-} WGRREAD;
-
 // Get maximum packet size for a pipe
 static UInt32 GetMaxPacketSize(IOUSBPipe *pipe)
 {
@@ -59,6 +53,58 @@ bool WirelessGamingReceiver::start(IOService *provider)
         return false;
     }
 
+    if (rumbleLock == NULL)
+        rumbleLock = IOLockAlloc();
+    if (rumbleLock == NULL)
+    {
+        // IOLog("start - failed to allocate rumble lock\n");
+        goto fail;
+    }
+    if (rumbleCoalesced == NULL)
+    {
+        rumbleCoalesced = OSNumber::withNumber((unsigned long long)0, 32);
+        if (rumbleCoalesced != NULL)
+            setProperty("RumbleCoalesced", rumbleCoalesced);
+    }
+    if (inputLock == NULL)
+        inputLock = IOLockAlloc();
+    if (inputLock == NULL)
+    {
+        // IOLog("start - failed to allocate input lock\n");
+        goto fail;
+    }
+    if (parkLock == NULL)
+        parkLock = IOLockAlloc();
+    if (parkLock == NULL)
+    {
+        // IOLog("start - failed to allocate park lock\n");
+        goto fail;
+    }
+    if (resetCall == NULL)
+        resetCall = thread_call_allocate(ResetThreadCall, this);
+    if (resetCall == NULL)
+    {
+        // IOLog("start - failed to allocate receiver reset call\n");
+        goto fail;
+    }
+    if (inputHighWater == NULL)
+    {
+        OSDictionary *statistics = OSDictionary::withCapacity(3);
+
+        inputHighWater = OSNumber::withNumber((unsigned long long)0, 32);
+        inputDropped = OSNumber::withNumber((unsigned long long)0, 32);
+        inputLost = OSNumber::withNumber((unsigned long long)0, 32);
+        if ((statistics != NULL) && (inputHighWater != NULL) && (inputDropped != NULL) && (inputLost != NULL))
+        {
+            statistics->setObject("HighWater", inputHighWater);
+            statistics->setObject("Dropped", inputDropped);
+            statistics->setObject("Lost", inputLost);
+            setProperty("InputStatistics", statistics);
+        }
+        if (statistics != NULL)
+            statistics->release();
+    }
+
     device = OSDynamicCast(IOUSBDevice, provider);
     if (device == NULL)
     {
@@ -103,9 +149,43 @@ bool WirelessGamingReceiver::start(IOService *provider)
         connections[i].other = NULL;
         connections[i].otherIn = NULL;
         connections[i].otherOut = NULL;
-        connections[i].inputArray = NULL;
+        for (int j = 0; j < WIRELESS_READ_QUEUE; j++)
+        {
+            connections[i].reads[j].index = i;
+            connections[i].reads[j].buffer = NULL;
+        }
+        Xbox360_RecoveryInit(&connections[i].recovery);
+        connections[i].recoveryTimer = NULL;
+        for (int j = 0; j < WIRELESS_WRITE_POOL; j++)
+            connections[i].outBuffers[j] = NULL;
+        Xbox360_PoolInit(&connections[i].outPool, 0);
+        Xbox360_MailboxInit(&connections[i].rumble);
+        Wireless_RingReset(&connections[i].input);
         connections[i].service = NULL;
         connections[i].controllerStarted = false;
+        connections[i].serialValid = false;
+        connections[i].parked = false;
+        bzero(&connections[i].stats, sizeof(connections[i].stats));
+    }
+    statsArmed = 0;
+    deviceResets = 0;
+
+    parkTimer = IOTimerEventSource::timerEventSource(this, ParkTimerActionWrapper);
+    if ((parkTimer == NULL) || (getWorkLoop() == NULL) || (getWorkLoop()->addEventSource(parkTimer) != kIOReturnSuccess))
+    {
+        // IOLog("start - failed to create reconnection timer\n");
+        goto fail;
+    }
+    statsTimer = IOTimerEventSource::timerEventSource(this, StatsTimerActionWrapper);
+    if ((statsTimer == NULL) || (getWorkLoop()->addEventSource(statsTimer) != kIOReturnSuccess))
+    {
+        // IOLog("start - failed to create statistics timer\n");
+        if (statsTimer != NULL)
+        {
+            statsTimer->release();
+            statsTimer = NULL;
+        }
+        goto fail;
     }
 
     pipeRequest.interval = 0;
@@ -190,10 +270,34 @@ bool WirelessGamingReceiver::start(IOService *provider)
 
     for (i = 0; i < connectionCount; i++)
     {
-        connections[i].inputArray = OSArray::withCapacity(5);
-        if (connections[i].inputArray == NULL)
+        for (int j = 0; j < WIRELESS_READ_QUEUE; j++)
+        {
+            connections[i].reads[j].buffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionIn, GetMaxPacketSize(connections[i].controllerIn));
+            if (connections[i].reads[j].buffer == NULL)
+            {
+                // IOLog("start: Failed to allocate input buffer %d\n", i);
+                goto fail;
+            }
+        }
+        Xbox360_PoolInit(&connections[i].outPool, WIRELESS_WRITE_POOL);
+        for (int j = 0; j < WIRELESS_WRITE_POOL; j++)
+        {
+            connections[i].outBuffers[j] = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionOut, WIRELESS_WRITE_SIZE);
+            if (connections[i].outBuffers[j] == NULL)
+            {
+                // IOLog("start: Failed to allocate output buffer %d\n", i);
+                goto fail;
+            }
+        }
+        connections[i].recoveryTimer = IOTimerEventSource::timerEventSource(this, RecoveryTimerActionWrapper);
+        if ((connections[i].recoveryTimer == NULL) || (getWorkLoop()->addEventSource(connections[i].recoveryTimer) != kIOReturnSuccess))
         {
-            // IOLog("start: Failed to allocate packet buffer %d\n", i);
+            // IOLog("start: Failed to create recovery timer %d\n", i);
+            if (connections[i].recoveryTimer != NULL)
+            {
+                connections[i].recoveryTimer->release();
+                connections[i].recoveryTimer = NULL;
+            }
             goto fail;
         }
         if (!QueueRead(i))
@@ -218,6 +322,28 @@ void WirelessGamingReceiver::stop(IOService *provider)
     IOService::stop(provider);
 }
 
+// Free the driver
+void WirelessGamingReceiver::free(void)
+{
+    if (rumbleCoalesced != NULL)
+        rumbleCoalesced->release();
+    if (rumbleLock != NULL)
+        IOLockFree(rumbleLock);
+    if (inputHighWater != NULL)
+        inputHighWater->release();
+    if (inputDropped != NULL)
+        inputDropped->release();
+    if (inputLost != NULL)
+        inputLost->release();
+    if (inputLock != NULL)
+        IOLockFree(inputLock);
+    if (parkLock != NULL)
+        IOLockFree(parkLock);
+    if (resetCall != NULL)
+        thread_call_free(resetCall);
+    IOService::free();
+}
+
 // Handle termination
 bool WirelessGamingReceiver::didTerminate(IOService *provider, IOOptionBits options, bool *defer)
 {
@@ -231,6 +357,12 @@ bool WirelessGamingReceiver::didTerminate(IOService *provider, IOOptionBits opti
 IOReturn WirelessGamingReceiver::message(UInt32 type,IOService *provider,void *argument)
 {
     // IOLog("Message\n");
+    if (type == kIOUSBMessagePortHasBeenReset)
+    {
+        // Whoever reset it, the reads that stopped have to be started again
+        ResumeReads();
+        return kIOReturnSuccess;
+    }
 #if 0
     switch(type) {
         case kIOMessageServiceIsTerminated:
@@ -245,34 +377,35 @@ IOReturn WirelessGamingReceiver::message(UInt32 type,IOService *provider,void *a
 #endif
 }
 
-// Queue a read on a controller
+// Queue all the reads on a controller
 bool WirelessGamingReceiver::QueueRead(int index)
 {
+    for (int i = 0; i < WIRELESS_READ_QUEUE; i++)
+    {
+        if (!QueueRead(&connections[index].reads[i]))
+            return false;
+    }
+    return true;
+}
+
+// Queue one read on a controller, reusing its buffer
+bool WirelessGamingReceiver::QueueRead(WGRREAD *read)
+{
+    IOUSBPipe *pipe = connections[read->index].controllerIn;
     IOUSBCompletion complete;
     IOReturn err;
-    WGRREAD *data = (WGRREAD*)IOMalloc(sizeof(WGRREAD));
 
-    if (data == NULL)
-        return false;
-    data->index = index;
-    data->buffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionIn, GetMaxPacketSize(connections[index].controllerIn));
-    if (data->buffer == NULL)
-    {
-        IOFree(data, sizeof(WGRREAD));
+    if ((pipe == NULL) || (read->buffer == NULL))
         return false;
-    }
 
     complete.target = this;
     complete.action = _ReadComplete;
-    complete.parameter = data;
+    complete.parameter = read;
 
-    err = connections[index].controllerIn->Read(data->buffer, 0, 0, data->buffer->getLength(), &complete);
+    err = pipe->Read(read->buffer, 0, 0, read->buffer->getLength(), &complete);
     if (err == kIOReturnSuccess)
         return true;
 
-    data->buffer->release();
-    IOFree(data, sizeof(WGRREAD));
-
     // IOLog("read - failed to start (0x%.8x)\n", err);
     return false;
 }
@@ -287,72 +420,552 @@ void WirelessGamingReceiver::ReadComplete(void *parameter, IOReturn status, UInt
     {
         case kIOReturnOverrun:
             // IOLog("read - kIOReturnOverrun, clearing stall\n");
-            connections[data->index].controllerIn->ClearStall();
-            // fall through
+            // The stall is cleared from the recovery timer, which then queues this read again
+            connections[data->index].stats.overruns++;
+            CountArrival(data->index);
+            ProcessMessage(data->index, (unsigned char*)data->buffer->getBytesNoCopy(), (int)data->buffer->getLength() - bufferSizeRemaining);
+            ParkRead(data, false);
+            reread = false;
+            break;
+
         case kIOReturnSuccess:
+            Xbox360_RecoveryGood(&connections[data->index].recovery);
+            CountArrival(data->index);
             ProcessMessage(data->index, (unsigned char*)data->buffer->getBytesNoCopy(), (int)data->buffer->getLength() - bufferSizeRemaining);
             break;
 
+        case kIOReturnAborted:
+            if (!Xbox360_RecoveryTakeRestart(&connections[data->index].recovery))
+            {
+                // Reads stopped by a reset wait with the idle ones to be started after it
+                if (Xbox360_RecoveryResetting(&connections[data->index].recovery))
+                    ParkRead(data, false);
+                reread = false;
+            }
+            break;
+
         case kIOReturnNotResponding:
             // IOLog("read - kIOReturnNotResponding\n");
             // fall through
         default:
+            // Rather than leave the controller silent, try again after a while
+            connections[data->index].stats.readErrors++;
+            ParkRead(data, true);
             reread = false;
             break;
     }
 
-    int newIndex = data->index;
-    data->buffer->release();
-    IOFree(data, sizeof(WGRREAD));
-
     if (reread)
-        QueueRead(newIndex);
+        QueueRead(data);
+}
+
+// Leaves a read to be restarted by the controller's recovery timer. Failures
+// back off, while an overrun only needs the stall cleared and goes straight away.
+void WirelessGamingReceiver::ParkRead(WGRREAD *read, bool failed)
+{
+    WIRELESS_CONNECTION *connection = &connections[read->index];
+
+    if (Xbox360_RecoveryPark(&connection->recovery, (int)(read - connection->reads)) && (connection->recoveryTimer != NULL))
+        connection->recoveryTimer->setTimeoutMS(failed ? Xbox360_RecoveryDelay(&connection->recovery) : 1);
+}
+
+void WirelessGamingReceiver::RecoveryTimerActionWrapper(OSObject *owner, IOTimerEventSource *sender)
+{
+    WirelessGamingReceiver *receiver = OSDynamicCast(WirelessGamingReceiver, owner);
+
+    if (receiver != NULL)
+        receiver->RecoveryTimerAction(sender);
+}
+
+// Clears the stall on a controller's input pipe and restarts the reads that
+// stopped, resetting the receiver if that keeps failing
+void WirelessGamingReceiver::RecoveryTimerAction(IOTimerEventSource *sender)
+{
+    WIRELESS_CONNECTION *connection = NULL;
+    UInt32 idle, failed = 0;
+
+    for (int i = 0; i < connectionCount; i++)
+    {
+        if (connections[i].recoveryTimer == sender)
+            connection = &connections[i];
+    }
+    if (isInactive() || (connection == NULL) || (connection->controllerIn == NULL)
+        || Xbox360_RecoveryResetting(&connection->recovery))
+        return;
+    if (Xbox360_RecoveryExhausted(&connection->recovery))
+    {
+        // The idle reads are kept, and restarted once the receiver is back
+        if (Xbox360_RecoveryBeginReset(&connection->recovery))
+        {
+            IOLog("read - reads keep failing, resetting receiver\n");
+            // Every controller's reads go down with the receiver
+            for (int i = 0; i < connectionCount; i++)
+                Xbox360_RecoveryBeginReset(&connections[i].recovery);
+            deviceResets++;
+            setProperty("DeviceResets", deviceResets, 32);
+            retain();
+            if (thread_call_enter(resetCall))
+                release();
+        }
+        return;
+    }
+    idle = Xbox360_RecoveryTake(&connection->recovery);
+    if (idle == 0)
+        return;
+    // Clearing the stall aborts the reads still queued, which are queued again as they come back
+    Xbox360_RecoverySetRestarts(&connection->recovery, WIRELESS_READ_QUEUE - __builtin_popcount(idle));
+    connection->controllerIn->ClearStall();
+    connection->stats.stallsCleared++;
+    for (int i = 0; i < WIRELESS_READ_QUEUE; i++)
+    {
+        if ((idle & (1U << i)) && !QueueRead(&connection->reads[i]))
+            failed |= 1U << i;
+    }
+    connection->stats.recoveries++;
+    for (int i = 0; i < WIRELESS_READ_QUEUE; i++)
+    {
+        if (failed & (1U << i))
+            ParkRead(&connection->reads[i], true);
+    }
+}
+
+void WirelessGamingReceiver::ResetThreadCall(thread_call_param_t param0, thread_call_param_t param1)
+{
+    WirelessGamingReceiver *receiver = (WirelessGamingReceiver*)param0;
+
+    receiver->ResetThreadAction();
+    receiver->release();
+}
+
+// Resets the receiver, which blocks until it is done, then restarts the reads
+void WirelessGamingReceiver::ResetThreadAction(void)
+{
+    IOUSBDevice *usb = device;
+
+    if (!isInactive() && (usb != NULL))
+        usb->ResetDevice();
+    ResumeReads();
+}
+
+// After a reset, lets the recovery timers restart the reads that were left idle
+void WirelessGamingReceiver::ResumeReads(void)
+{
+    IOWorkLoop *workloop = getWorkLoop();
+
+    for (int i = 0; i < connectionCount; i++)
+        Xbox360_RecoveryEndReset(&connections[i].recovery);
+    if (workloop != NULL)
+        workloop->runAction(ResumeReadsAction, this);
+}
+
+IOReturn WirelessGamingReceiver::ResumeReadsAction(OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+    WirelessGamingReceiver *receiver = OSDynamicCast(WirelessGamingReceiver, owner);
+
+    if ((receiver == NULL) || receiver->isInactive())
+        return kIOReturnSuccess;
+    for (int i = 0; i < receiver->connectionCount; i++)
+    {
+        if (receiver->connections[i].recoveryTimer != NULL)
+            receiver->connections[i].recoveryTimer->setTimeoutMS(1);
+    }
+    return kIOReturnSuccess;
+}
+
+// Keeps count of the packets on a controller and how far apart they arrive
+void WirelessGamingReceiver::CountArrival(int index)
+{
+    WIRELESS_LINK_STATS *stats = &connections[index].stats;
+    UInt64 now, gap;
+    int bucket;
+
+    clock_get_uptime(&now);
+    if (stats->lastArrival != 0)
+    {
+        absolutetime_to_nanoseconds(now - stats->lastArrival, &gap);
+        gap /= 1000000;
+        bucket = (gap == 0) ? 0 : (64 - __builtin_clzll(gap));
+        if (bucket >= WIRELESS_GAP_BUCKETS)
+            bucket = WIRELESS_GAP_BUCKETS - 1;
+        stats->gaps[bucket]++;
+    }
+    stats->lastArrival = now;
+    stats->packets++;
+    __atomic_add_fetch(&stats->windowPackets, 1, __ATOMIC_RELAXED);
+    ArmStatistics();
+}
+
+// Has the statistics published at the end of the current interval, from the
+// workloop. Called from completions, so it only arms the timer.
+void WirelessGamingReceiver::ArmStatistics(void)
+{
+    IOTimerEventSource *timer = statsTimer;
+
+    if ((timer != NULL) && (__atomic_exchange_n(&statsArmed, 1, __ATOMIC_ACQ_REL) == 0))
+        timer->setTimeoutMS(WIRELESS_STATS_INTERVAL);
+}
+
+void WirelessGamingReceiver::StatsTimerActionWrapper(OSObject *owner, IOTimerEventSource *sender)
+{
+    WirelessGamingReceiver *receiver = OSDynamicCast(WirelessGamingReceiver, owner);
+
+    if (receiver != NULL)
+        receiver->StatsTimerAction(sender);
+}
+
+// Publishes the statistics. After a window with packets in it the timer goes
+// round again, so the rates published drop back to zero once the packets stop.
+void WirelessGamingReceiver::StatsTimerAction(IOTimerEventSource *sender)
+{
+    // Cleared before anything is read, so whatever is counted from here on arms it again
+    __atomic_store_n(&statsArmed, 0, __ATOMIC_SEQ_CST);
+    if (isInactive())
+        return;
+    UpdateWriteStatistics();
+    if (PublishLinkStatistics() != 0)
+        ArmStatistics();
+}
+
+// Publishes the statistics of every controller as an array, one dictionary per slot,
+// returning the number of packets in the window just published
+UInt32 WirelessGamingReceiver::PublishLinkStatistics(void)
+{
+    OSArray *slots = OSArray::withCapacity(connectionCount);
+    UInt32 total = 0;
+
+    if (slots == NULL)
+        return 0;
+    for (int i = 0; i < connectionCount; i++)
+    {
+        WIRELESS_LINK_STATS *stats = &connections[i].stats;
+        UInt32 windowPackets = __atomic_exchange_n(&stats->windowPackets, 0, __ATOMIC_RELAXED);
+        OSDictionary *slot = OSDictionary::withCapacity(12);
+        OSArray *gaps = OSArray::withCapacity(WIRELESS_GAP_BUCKETS);
+        OSNumber *number;
+
+        total += windowPackets;
+        if ((slot == NULL) || (gaps == NULL))
+        {
+            if (slot != NULL)
+                slot->release();
+            if (gaps != NULL)
+                gaps->release();
+            continue;
+        }
+#define SET_STATISTIC(key, value) \
+        if ((number = OSNumber::withNumber((unsigned long long)(value), 32)) != NULL) \
+        { \
+            slot->setObject(key, number); \
+            number->release(); \
+        }
+        SET_STATISTIC("Packets", stats->packets);
+        // The timer is armed by the first packet of a window, so each one lasts an interval
+        SET_STATISTIC("PacketsPerSecond", (windowPackets * 1000ULL) / WIRELESS_STATS_INTERVAL);
+        SET_STATISTIC("Overruns", stats->overruns);
+        SET_STATISTIC("StallsCleared", stats->stallsCleared);
+        SET_STATISTIC("ReadErrors", stats->readErrors);
+        SET_STATISTIC("Recoveries", stats->recoveries);
+        SET_STATISTIC("Connects", stats->connects);
+        SET_STATISTIC("Reattaches", stats->reattaches);
+        SET_STATISTIC("QueueHighWater", connections[i].input.highWater);
+        SET_STATISTIC("QueueDropped", connections[i].input.dropped);
+#undef SET_STATISTIC
+        for (int j = 0; j < WIRELESS_GAP_BUCKETS; j++)
+        {
+            if ((number = OSNumber::withNumber((unsigned long long)stats->gaps[j], 32)) != NULL)
+            {
+                gaps->setObject(number);
+                number->release();
+            }
+        }
+        slot->setObject("ArrivalGaps", gaps);
+        gaps->release();
+        slots->setObject(slot);
+        slot->release();
+    }
+    setProperty("LinkStatistics", slots);
+    slots->release();
+    return total;
 }
 
 // Queue an asynchronous write on a controller
 bool WirelessGamingReceiver::QueueWrite(int index, const void *bytes, UInt32 length)
 {
-    IOBufferMemoryDescriptor *outBuffer;
-    IOUSBCompletion complete;
-    IOReturn err;
+    return StartWrite(index, bytes, length, 0);
+}
+
+// Queue an asynchronous rumble write, or leave it in the mailbox if one is in flight
+bool WirelessGamingReceiver::QueueRumble(int index, const void *bytes, UInt32 length)
+{
+    XBOX360_RUMBLE_MAILBOX *mailbox = &connections[index].rumble;
+    UInt8 packet[XBOX360_MAILBOX_SIZE];
+    bool send;
 
-    outBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionOut, length);
-    if (outBuffer == NULL)
+    if (length > XBOX360_MAILBOX_SIZE)
     {
-        // IOLog("send - unable to allocate buffer\n");
+        // IOLog("send - rumble packet too large\n");
         return false;
     }
+    memcpy(packet, bytes, length);
+    IOLockLock(rumbleLock);
+    send = Xbox360_MailboxPost(mailbox, packet, length);
+    IOLockUnlock(rumbleLock);
+    UpdateRumbleStatistics();
+    if (send)
+        SendRumble(index, packet, length);
+    return true;
+}
+
+// Writes a rumble packet claimed from a controller's mailbox. If the write can't
+// start, a newer packet waiting is tried instead, or else this one stays in the mailbox.
+bool WirelessGamingReceiver::SendRumble(int index, UInt8 *packet, UInt32 length)
+{
+    XBOX360_RUMBLE_MAILBOX *mailbox = &connections[index].rumble;
+
+    while (!StartWrite(index, packet, length, WIRELESS_WRITE_RUMBLE))
+    {
+        IOLockLock(rumbleLock);
+        length = Xbox360_MailboxRetry(mailbox, packet, length);
+        IOLockUnlock(rumbleLock);
+        if (length == 0)
+            return false;
+    }
+    return true;
+}
+
+// Sends whatever rumble arrived for a controller while the last one was in flight,
+// even if that one failed
+void WirelessGamingReceiver::RumbleComplete(int index, IOReturn status)
+{
+    UInt8 packet[XBOX360_MAILBOX_SIZE];
+    UInt32 length;
+
+    IOLockLock(rumbleLock);
+    length = Xbox360_MailboxNext(&connections[index].rumble, packet);
+    IOLockUnlock(rumbleLock);
+    if (length != 0)
+        SendRumble(index, packet, length);
+}
+
+// Another write on a controller freed a buffer, so send any rumble that couldn't get one
+void WirelessGamingReceiver::RumbleResume(int index)
+{
+    UInt8 packet[XBOX360_MAILBOX_SIZE];
+    UInt32 length;
+
+    IOLockLock(rumbleLock);
+    length = Xbox360_MailboxResume(&connections[index].rumble, packet);
+    IOLockUnlock(rumbleLock);
+    if (length != 0)
+        SendRumble(index, packet, length);
+}
+
+// Queue several packets to go out one after the other, using a single output buffer
+bool WirelessGamingReceiver::QueueWriteBatch(int index, const WirelessOutPacket *packets, int count)
+{
+    WIRELESS_WRITE_BATCH *batch;
+    UInt32 total = 0;
+    int slot;
+
+    if ((count <= 0) || (count > WIRELESS_BATCH_PACKETS))
+        return false;
+    for (int i = 0; i < count; i++)
+    {
+        if ((packets[i].length == 0) || (packets[i].length > (WIRELESS_WRITE_SIZE - total)))
+        {
+            // IOLog("send - batch too large\n");
+            return false;
+        }
+        total += (UInt32)packets[i].length;
+    }
+    slot = ClaimWrite(index);
+    if (slot < 0)
+        return false;
+    batch = &connections[index].outBatches[slot];
+    total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(batch->data + total, packets[i].data, packets[i].length);
+        batch->lengths[i] = (UInt8)packets[i].length;
+        total += (UInt32)packets[i].length;
+    }
+    batch->count = (UInt8)count;
+    batch->next = 1;
+    batch->offset = batch->lengths[0];
+    if (SubmitWrite(index, slot, batch->data, batch->lengths[0], 0))
+        return true;
+    batch->count = 0;
+    Xbox360_PoolFree(&connections[index].outPool, slot);
+    return false;
+}
+
+bool WirelessGamingReceiver::StartWrite(int index, const void *bytes, UInt32 length, UInt32 flags)
+{
+    int slot;
+
+    if (length > WIRELESS_WRITE_SIZE)
+    {
+        // IOLog("send - packet too large\n");
+        return false;
+    }
+    slot = ClaimWrite(index);
+    if (slot < 0)
+        return false;
+    if (SubmitWrite(index, slot, bytes, length, flags))
+        return true;
+    Xbox360_PoolFree(&connections[index].outPool, slot);
+    return false;
+}
+
+// Claims an output buffer for a controller, returning its slot or -1 if none is free
+int WirelessGamingReceiver::ClaimWrite(int index)
+{
+    XBOX360_BUFFER_POOL *pool = &connections[index].outPool;
+    UInt32 peak = pool->peak;
+    int slot;
+
+    // Rather than queue up, writes are turned away while every buffer is in flight
+    slot = Xbox360_PoolAlloc(pool);
+    if (slot < 0)
+    {
+        ArmStatistics();
+        return -1;
+    }
+    if (pool->peak != peak)
+        ArmStatistics();
+    connections[index].outBatches[slot].count = 0;
+    return slot;
+}
+
+// Copies a packet into a claimed output buffer and starts writing it
+bool WirelessGamingReceiver::SubmitWrite(int index, int slot, const void *bytes, UInt32 length, UInt32 flags)
+{
+    IOBufferMemoryDescriptor *outBuffer = connections[index].outBuffers[slot];
+    IOUSBCompletion complete;
+    IOReturn err;
+
+    outBuffer->setLength(length);
     outBuffer->writeBytes(0, bytes, length);
 
     complete.target = this;
     complete.action = _WriteComplete;
-    complete.parameter = outBuffer;
+    complete.parameter = (void*)(uintptr_t)(((index * XBOX360_POOL_MAX) + slot) | flags);
 
     err = connections[index].controllerOut->Write(outBuffer, 0, 0, length, &complete);
-    if (err == kIOReturnSuccess)
-        return true;
-    else
+    if (err != kIOReturnSuccess)
     {
         // IOLog("send - failed to start (0x%.8x)\n",err);
         return false;
     }
+    return true;
 }
 
 // Handle a completed write on a controller
 void WirelessGamingReceiver::WriteComplete(void *parameter,IOReturn status,UInt32 bufferSizeRemaining)
 {
-    IOMemoryDescriptor *memory=(IOMemoryDescriptor*)parameter;
+    int index = (int)((uintptr_t)parameter & ~WIRELESS_WRITE_RUMBLE) / XBOX360_POOL_MAX;
+    int slot = (int)((uintptr_t)parameter & ~WIRELESS_WRITE_RUMBLE) % XBOX360_POOL_MAX;
+    WIRELESS_WRITE_BATCH *batch = &connections[index].outBatches[slot];
     if(status!=kIOReturnSuccess) {
         IOLog("write - Error writing: 0x%.8x\n",status);
     }
-    memory->release();
+    else if (batch->next < batch->count)
+    {
+        // More of a batch to go, from the same buffer
+        UInt8 *bytes = batch->data + batch->offset;
+        UInt32 length = batch->lengths[batch->next];
+
+        batch->next++;
+        batch->offset += length;
+        if (SubmitWrite(index, slot, bytes, length, (UInt32)((uintptr_t)parameter & WIRELESS_WRITE_RUMBLE)))
+            return;
+    }
+    batch->count = 0;
+    Xbox360_PoolFree(&connections[index].outPool, slot);
+    if ((uintptr_t)parameter & WIRELESS_WRITE_RUMBLE)
+        RumbleComplete(index, status);
+    else
+        RumbleResume(index);
+}
+
+// Publish how hard the output buffers are being pushed, across all controllers.
+// On the workloop, from statsTimer.
+void WirelessGamingReceiver::UpdateWriteStatistics(void)
+{
+    UInt32 rejected = 0, peak = 0;
+
+    for (int i = 0; i < connectionCount; i++)
+    {
+        rejected += connections[i].outPool.rejected;
+        if (connections[i].outPool.peak > peak)
+            peak = connections[i].outPool.peak;
+    }
+    setProperty("WritesRejected", rejected, 32);
+    setProperty("WritePeak", peak, 32);
+}
+
+// Keep the count of rumble updates replaced before being sent up to date, across all controllers
+void WirelessGamingReceiver::UpdateRumbleStatistics(void)
+{
+    UInt32 coalesced = 0;
+
+    if (rumbleCoalesced == NULL)
+        return;
+    IOLockLock(rumbleLock);
+    for (int i = 0; i < connectionCount; i++)
+        coalesced += connections[i].rumble.coalesced;
+    IOLockUnlock(rumbleLock);
+    rumbleCoalesced->setValue(coalesced);
+}
+
+// Keep the input queue counters up to date, across all controllers
+void WirelessGamingReceiver::UpdateInputStatistics(void)
+{
+    UInt32 highWater = 0, dropped = 0, lost = 0;
+
+    if ((inputHighWater == NULL) || (inputDropped == NULL) || (inputLost == NULL))
+        return;
+    for (int i = 0; i < connectionCount; i++)
+    {
+        if (connections[i].input.highWater > highWater)
+            highWater = connections[i].input.highWater;
+        dropped += connections[i].input.dropped;
+        lost += connections[i].input.lost;
+    }
+    inputHighWater->setValue(highWater);
+    inputDropped->setValue(dropped);
+    inputLost->setValue(lost);
 }
 
 // Release any allocated objects
 void WirelessGamingReceiver::ReleaseAll(void)
 {
+    if (statsTimer != NULL)
+    {
+        // Completions check for the timer before arming it
+        IOTimerEventSource *timer = statsTimer;
+
+        statsTimer = NULL;
+        timer->cancelTimeout();
+        if (getWorkLoop() != NULL)
+            getWorkLoop()->removeEventSource(timer);
+        timer->release();
+    }
+    // A reset still waiting to run holds a reference
+    if ((resetCall != NULL) && thread_call_cancel(resetCall))
+        release();
+    if (parkTimer != NULL)
+    {
+        parkTimer->cancelTimeout();
+        if (getWorkLoop() != NULL)
+            getWorkLoop()->removeEventSource(parkTimer);
+        parkTimer->release();
+        parkTimer = NULL;
+    }
     for (int i = 0; i < connectionCount; i++)
     {
+        connections[i].parked = false;
+        connections[i].serialValid = false;
         if (connections[i].service != NULL)
         {
             connections[i].service->terminate(kIOServiceRequired);
@@ -360,8 +973,20 @@ void WirelessGamingReceiver::ReleaseAll(void)
             connections[i].service->release();
             connections[i].service = NULL;
         }
+        if (connections[i].recoveryTimer != NULL)
+        {
+            // Failing reads check for the timer before arming it
+            IOTimerEventSource *timer = connections[i].recoveryTimer;
+
+            connections[i].recoveryTimer = NULL;
+            timer->cancelTimeout();
+            if (getWorkLoop() != NULL)
+                getWorkLoop()->removeEventSource(timer);
+            timer->release();
+        }
         if (connections[i].controllerIn != NULL)
         {
+            Xbox360_RecoverySetRestarts(&connections[i].recovery, 0);
             connections[i].controllerIn->Abort();
             connections[i].controllerIn->release();
             connections[i].controllerIn = NULL;
@@ -394,10 +1019,21 @@ void WirelessGamingReceiver::ReleaseAll(void)
             connections[i].other->close(this);
             connections[i].other = NULL;
         }
-        if (connections[i].inputArray != NULL)
+        for (int j = 0; j < WIRELESS_READ_QUEUE; j++)
         {
-            connections[i].inputArray->release();
-            connections[i].inputArray = NULL;
+            if (connections[i].reads[j].buffer != NULL)
+            {
+                connections[i].reads[j].buffer->release();
+                connections[i].reads[j].buffer = NULL;
+            }
+        }
+        for (int j = 0; j < WIRELESS_WRITE_POOL; j++)
+        {
+            if (connections[i].outBuffers[j] != NULL)
+            {
+                connections[i].outBuffers[j]->release();
+                connections[i].outBuffers[j] = NULL;
+            }
         }
         connections[i].controllerStarted = false;
     }
@@ -423,7 +1059,7 @@ void WirelessGamingReceiver::_WriteComplete(void *target, void *parameter, IORet
 }
 
 // Processes a message for a controller
-void WirelessGamingReceiver::ProcessMessage(int index, const unsigned char *data, int length)
+void WirelessGamingReceiver::ProcessMessage(int index, unsigned char *data, int length)
 {
 #ifdef PROTOCOL_DEBUG
     char s[1024];
@@ -437,24 +1073,28 @@ void WirelessGamingReceiver::ProcessMessage(int index, const unsigned char *data
     s[i * 2] = '\0';
     IOLog("Got data (%d, %d bytes): %s\n", index, length, s);
 #endif
+    WIRELESS_PACKET packet;
+
     // Handle device connections
-    if ((length == 2) && (data[0] == 0x08))
+    if (Wireless_ParsePacket(Wireless_ReceiverPackets, WIRELESS_PACKET_TYPES(Wireless_ReceiverPackets), data, length, &packet) == kPacketLink)
     {
-        if (data[1] == 0x00)
+        if (packet.value == 0x00)
         {
             // Device disconnected
 #ifdef PROTOCOL_DEBUG
             IOLog("process: Device detached\n");
 #endif
-            if (connections[index].service != NULL)
+            if ((connections[index].service != NULL) && !connections[index].parked)
             {
-                connections[index].service->SetIndex(-1);
-                if (connections[index].controllerStarted)
-                    connections[index].service->terminate(kIOServiceRequired | kIOServiceSynchronous);
-                connections[index].service->detach(this);
-                connections[index].service->release();
-                connections[index].service = NULL;
-                connections[index].controllerStarted = false;
+                if (connections[index].controllerStarted && connections[index].serialValid && (parkTimer != NULL))
+                    ParkService(index);
+                else
+                {
+                    ReleaseService(connections[index].service, connections[index].controllerStarted, true);
+                    connections[index].service = NULL;
+                    connections[index].controllerStarted = false;
+                    connections[index].serialValid = false;
+                }
             }
         }
         else
@@ -463,22 +1103,22 @@ void WirelessGamingReceiver::ProcessMessage(int index, const unsigned char *data
 #ifdef PROTOCOL_DEBUG
             IOLog("process: Attempting to add new device\n");
 #endif
+            connections[index].stats.connects++;
             if (connections[index].service == NULL)
             {
+                const WIRELESS_RING_SLOT *slot;
                 bool ready;
-                int i, j;
-                IOMemoryDescriptor *data;
-                char c;
+                UInt32 i;
 
                 ready = false;
-                j = connections[index].inputArray->getCount();
-                for (i = 0; !ready && (i < j); i++)
+                IOLockLock(inputLock);
+                for (i = 0; !ready && (i < connections[index].input.count); i++)
                 {
-                    data = OSDynamicCast(IOMemoryDescriptor, connections[index].inputArray->getObject(i));
-                    data->readBytes(1, &c, 1);
-                    if (c == 0x0f)
+                    slot = Wireless_RingAt(&connections[index].input, i);
+                    if (Wireless_ParsePacket(Wireless_ControllerPackets, WIRELESS_PACKET_TYPES(Wireless_ControllerPackets), (UInt8*)slot->data, slot->length, &packet) == kPacketInfo)
                         ready = true;
                 }
+                IOLockUnlock(inputLock);
                 InstantiateService(index);
                 if (ready && connections[index].service != NULL)
                 {
@@ -493,10 +1133,60 @@ void WirelessGamingReceiver::ProcessMessage(int index, const unsigned char *data
         return;
     }
 
+    bool info = Wireless_ParsePacket(Wireless_ControllerPackets, WIRELESS_PACKET_TYPES(Wireless_ControllerPackets), data, length, &packet) == kPacketInfo;
+
+    // A parked service waits for the initial info to tell whether the same controller is back
+    if (connections[index].parked)
+    {
+        WirelessDevice *stale = NULL;
+        bool reattach = false;
+
+        if (!info)
+        {
+            QueueMessage(index, data, length);
+            return;
+        }
+        IOLockLock(parkLock);
+        if (connections[index].parked)
+        {
+            connections[index].parked = false;
+            if (Wireless_PacketSerial(data) == connections[index].serial)
+                reattach = true;
+            else
+            {
+                stale = connections[index].service;
+                connections[index].service = NULL;
+            }
+        }
+        IOLockUnlock(parkLock);
+        if (stale != NULL)
+            ReleaseService(stale, true, true);
+        if (reattach)
+        {
+#ifdef PROTOCOL_DEBUG
+            IOLog("process: Reattaching wireless device\n");
+#endif
+            connections[index].controllerStarted = true;
+            connections[index].service->Reattach(index);
+            connections[index].stats.reattaches++;
+        }
+    }
+    if (info)
+    {
+        connections[index].serial = Wireless_PacketSerial(data);
+        connections[index].serialValid = true;
+    }
+
+    // Once the controller driver is running, it parses packets straight out of the
+    // read buffer. Anything still queued from before then has to go first.
+    if (connections[index].controllerStarted && (connections[index].service != NULL) && !IsDataQueued(index))
+    {
+        if (connections[index].service->DeliverPacket(data, length))
+            return;
+    }
+
     // Add anything else to the queue
-    IOMemoryDescriptor *copy = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionOut, length);
-    copy->writeBytes(0, data, length);
-    connections[index].inputArray->setObject(copy);
+    QueueMessage(index, data, length);
     if (connections[index].service == NULL)
         InstantiateService(index);
     if (connections[index].service != NULL)
@@ -504,10 +1194,7 @@ void WirelessGamingReceiver::ProcessMessage(int index, const unsigned char *data
         connections[index].service->NewData();
         if (!connections[index].controllerStarted)
         {
-            char c;
-
-            copy->readBytes(1, &c, 1);
-            if (c == 0x0f)
+            if (info)
             {
 #ifdef PROTOCOL_DEBUG
                 IOLog("Registering wireless device");
@@ -517,7 +1204,88 @@ void WirelessGamingReceiver::ProcessMessage(int index, const unsigned char *data
             }
         }
     }
-    copy->release();
+}
+
+// Copies a message onto a controller's queue
+void WirelessGamingReceiver::QueueMessage(int index, const unsigned char *data, int length)
+{
+    WIRELESS_INPUT_RING *ring = &connections[index].input;
+    UInt32 highWater = ring->highWater;
+    UInt32 lost = ring->lost + ring->dropped;
+
+    IOLockLock(inputLock);
+    Wireless_RingPut(ring, data, length);
+    IOLockUnlock(inputLock);
+    if ((ring->highWater != highWater) || ((ring->lost + ring->dropped) != lost))
+        UpdateInputStatistics();
+}
+
+// Tear down a controller's node and whatever driver matched it
+void WirelessGamingReceiver::ReleaseService(WirelessDevice *service, bool started, bool synchronous)
+{
+    service->SetIndex(-1);
+    if (started)
+        service->terminate(kIOServiceRequired | (synchronous ? kIOServiceSynchronous : 0));
+    service->detach(this);
+    service->release();
+}
+
+// Keep a disconnected controller's node, and the driver above it, for a while in
+// case it reconnects. A battery swap then doesn't go through matching again.
+void WirelessGamingReceiver::ParkService(int index)
+{
+    bool armed = false;
+
+    connections[index].service->Park();
+    IOLockLock(parkLock);
+    for (int i = 0; i < connectionCount; i++)
+        armed |= connections[i].parked;
+    connections[index].controllerStarted = false;
+    connections[index].parkDeadline = Xbox360_GetUptimeMS() + WIRELESS_PARK_TIMEOUT;
+    connections[index].parked = true;
+    IOLockUnlock(parkLock);
+    // An earlier deadline is already pending otherwise, and the timer moves on to this one
+    if (!armed)
+        parkTimer->setTimeoutMS(WIRELESS_PARK_TIMEOUT);
+}
+
+void WirelessGamingReceiver::ParkTimerActionWrapper(OSObject *owner, IOTimerEventSource *sender)
+{
+    WirelessGamingReceiver *receiver = OSDynamicCast(WirelessGamingReceiver, owner);
+
+    if (receiver != NULL)
+        receiver->ParkTimerAction(sender);
+}
+
+// Gives up on parked services whose controller hasn't come back in time
+void WirelessGamingReceiver::ParkTimerAction(IOTimerEventSource *sender)
+{
+    UInt64 now = Xbox360_GetUptimeMS(), next = 0;
+
+    for (int i = 0; i < connectionCount; i++)
+    {
+        WirelessDevice *expired = NULL;
+
+        IOLockLock(parkLock);
+        if (connections[i].parked)
+        {
+            if (now >= connections[i].parkDeadline)
+            {
+                expired = connections[i].service;
+                connections[i].service = NULL;
+                connections[i].parked = false;
+                connections[i].serialValid = false;
+            }
+            else if ((next == 0) || (connections[i].parkDeadline < next))
+                next = connections[i].parkDeadline;
+        }
+        IOLockUnlock(parkLock);
+        // On the workloop, so the driver above can't be waited for here
+        if (expired != NULL)
+            ReleaseService(expired, true, false);
+    }
+    if (next != 0)
+        sender->setTimeoutMS((UInt32)(next - now));
 }
 
 // Create a new node for the attached controller
@@ -555,19 +1323,18 @@ void WirelessGamingReceiver::InstantiateService(int index)
 // Check a controller's queue
 bool WirelessGamingReceiver::IsDataQueued(int index)
 {
-    return connections[index].inputArray->getCount() > 0;
+    return connections[index].input.count > 0;
 }
 
-// Read a controller's queue
-IOMemoryDescriptor* WirelessGamingReceiver::ReadBuffer(int index)
+// Copy the oldest packet out of a controller's queue, returning its size or 0 if there was none
+UInt32 WirelessGamingReceiver::ReadBuffer(int index, void *data, UInt32 size)
 {
-    IOMemoryDescriptor *data;
+    UInt32 length;
 
-    data = OSDynamicCast(IOMemoryDescriptor, connections[index].inputArray->getObject(0));
-    if (data != NULL)
-        data->retain();
-    connections[index].inputArray->removeObject(0);
-    return data;
+    IOLockLock(inputLock);
+    length = Wireless_RingGet(&connections[index].input, data, size);
+    IOLockUnlock(inputLock);
+    return length;
 }
 
 // Get our location ID
@@ -25,11 +25,71 @@
 
 #include <IOKit/usb/IOUSBDevice.h>
 #include <IOKit/usb/IOUSBInterface.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <kern/thread_call.h>
+#include "../360Controller/BufferPool.h"
+#include "../360Controller/RumbleMailbox.h"
+#include "../360Controller/ReadRecovery.h"
+#include "InputRing.h"
+#include "PacketTable.h"
+#include "WirelessDevice.h"
 
 // This value is defined by the hardware and fixed
 #define WIRELESS_CONNECTIONS        4
 
-class WirelessDevice;
+// Output buffers reused for every write to a controller, each large enough for any packet
+#define WIRELESS_WRITE_POOL         8
+#define WIRELESS_WRITE_SIZE         64
+// Marks the completion parameter of a rumble write, above any connection and slot
+#define WIRELESS_WRITE_RUMBLE       0x100
+// Packets that can be sent together from one output buffer, which must hold all of them
+#define WIRELESS_BATCH_PACKETS      4
+
+// Reads kept queued on each controller, re-armed in place as they complete
+#define WIRELESS_READ_QUEUE         3
+
+// How long a disconnected controller's driver is kept for it to come back, in ms
+#define WIRELESS_PARK_TIMEOUT       10000
+
+// Statistics are published this often from statsTimer while anything changes, in ms
+#define WIRELESS_STATS_INTERVAL     1000
+// Gaps between packets are counted in buckets of <1, <2, <4 ... <64 and 64+ ms
+#define WIRELESS_GAP_BUCKETS        8
+
+// Radio health of one controller slot
+typedef struct WIRELESS_LINK_STATS
+{
+    UInt32 packets;
+    UInt32 windowPackets;                   // Since the last time the statistics were published, taken by statsTimer
+    UInt64 lastArrival;                     // Uptime of the last packet, in absolute time units
+    UInt32 gaps[WIRELESS_GAP_BUCKETS];      // Histogram of time between packets
+    UInt32 overruns;
+    UInt32 stallsCleared;
+    UInt32 readErrors;
+    UInt32 recoveries;
+    UInt32 connects;
+    UInt32 reattaches;
+}
+WIRELESS_LINK_STATS;
+
+// Packets still to be sent from an output buffer, each one written as the last completes
+typedef struct WIRELESS_WRITE_BATCH
+{
+    UInt8 count;                            // Zero for a single packet
+    UInt8 next;
+    UInt8 offset;                           // Of the next packet in data
+    UInt8 lengths[WIRELESS_BATCH_PACKETS];
+    UInt8 data[WIRELESS_WRITE_SIZE];
+}
+WIRELESS_WRITE_BATCH;
+
+// Holds data for asynchronous reads
+typedef struct WGRREAD
+{
+    int index;
+    IOBufferMemoryDescriptor *buffer;
+} WGRREAD;
 
 typedef struct WIRELESS_CONNECTION
 {
@@ -42,9 +102,24 @@ typedef struct WIRELESS_CONNECTION
     IOUSBPipe *otherIn, *otherOut;
 
     // Runtime data
-    OSArray *inputArray;
+    WGRREAD reads[WIRELESS_READ_QUEUE];
+    XBOX360_READ_RECOVERY recovery;         // Restarts reads that failed, from recoveryTimer
+    IOTimerEventSource *recoveryTimer;
+    IOBufferMemoryDescriptor *outBuffers[WIRELESS_WRITE_POOL];
+    XBOX360_BUFFER_POOL outPool;
+    WIRELESS_WRITE_BATCH outBatches[WIRELESS_WRITE_POOL];
+    XBOX360_RUMBLE_MAILBOX rumble;          // Newest rumble waiting behind the one in flight
+    WIRELESS_INPUT_RING input;              // Packets waiting for the controller driver
     WirelessDevice *service;
     bool controllerStarted;
+
+    // Reconnection
+    UInt32 serial;                          // From the controller's initial info message
+    bool serialValid;
+    bool parked;                            // Service kept after a disconnect, waiting for the same serial
+    UInt64 parkDeadline;                    // Uptime in ms when a parked service is given up
+
+    WIRELESS_LINK_STATS stats;
 }
 WIRELESS_CONNECTION;
 
@@ -54,6 +129,7 @@ class WirelessGamingReceiver : public IOService
 public:
     bool start(IOService *provider);
     void stop(IOService *provider);
+    void free(void);
 
     IOReturn message(UInt32 type,IOService *provider,void *argument);
 
@@ -63,22 +139,63 @@ public:
 private:
     friend class WirelessDevice;
     bool IsDataQueued(int index);
-    IOMemoryDescriptor* ReadBuffer(int index);
+    UInt32 ReadBuffer(int index, void *data, UInt32 size);
     bool QueueWrite(int index, const void *bytes, UInt32 length);
+    bool QueueWriteBatch(int index, const WirelessOutPacket *packets, int count);
+    bool QueueRumble(int index, const void *bytes, UInt32 length);
 
 private:
     IOUSBDevice *device;
     WIRELESS_CONNECTION connections[WIRELESS_CONNECTIONS];
     int connectionCount;
+    IOLock *rumbleLock;
+    OSNumber *rumbleCoalesced;
+    IOLock *inputLock;
+    OSNumber *inputHighWater, *inputDropped, *inputLost;
+    IOLock *parkLock;
+    IOTimerEventSource *parkTimer;
+    IOTimerEventSource *statsTimer;         // Publishes the statistics from the workloop, as building them allocates
+    UInt32 statsArmed;                      // Nonzero while statsTimer is pending, set atomically
+    UInt32 deviceResets;
+    thread_call_t resetCall;                // Resets the receiver off the workloop, as that blocks
 
     void InstantiateService(int index);
+    void ReleaseService(WirelessDevice *service, bool started, bool synchronous);
+    void ParkService(int index);
+
+    static void ParkTimerActionWrapper(OSObject *owner, IOTimerEventSource *sender);
+    void ParkTimerAction(IOTimerEventSource *sender);
 
-    void ProcessMessage(int index, const unsigned char *data, int length);
+    void ProcessMessage(int index, unsigned char *data, int length);
+    void QueueMessage(int index, const unsigned char *data, int length);
 
     bool QueueRead(int index);
+    bool QueueRead(WGRREAD *read);
     void ReadComplete(void *parameter, IOReturn status, UInt32 bufferSizeRemaining);
-
+    void ParkRead(WGRREAD *read, bool failed);
+
+    static void RecoveryTimerActionWrapper(OSObject *owner, IOTimerEventSource *sender);
+    void RecoveryTimerAction(IOTimerEventSource *sender);
+    static void ResetThreadCall(thread_call_param_t param0, thread_call_param_t param1);
+    void ResetThreadAction(void);
+    static IOReturn ResumeReadsAction(OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3);
+    void ResumeReads(void);
+
+    bool StartWrite(int index, const void *bytes, UInt32 length, UInt32 flags);
+    int ClaimWrite(int index);
+    bool SubmitWrite(int index, int slot, const void *bytes, UInt32 length, UInt32 flags);
     void WriteComplete(void *parameter, IOReturn status, UInt32 bufferSizeRemaining);
+    bool SendRumble(int index, UInt8 *packet, UInt32 length);
+    void RumbleComplete(int index, IOReturn status);
+    void RumbleResume(int index);
+    void UpdateRumbleStatistics(void);
+    void UpdateInputStatistics(void);
+    void CountArrival(int index);
+    void ArmStatistics(void);
+    static void StatsTimerActionWrapper(OSObject *owner, IOTimerEventSource *sender);
+    void StatsTimerAction(IOTimerEventSource *sender);
+    UInt32 PublishLinkStatistics(void);
+    void UpdateWriteStatistics(void);
 
     void ReleaseAll(void);
 
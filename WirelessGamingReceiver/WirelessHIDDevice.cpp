@@ -24,9 +24,12 @@
 #include <IOKit/IOTimerEventSource.h>
 #include "WirelessHIDDevice.h"
 #include "WirelessDevice.h"
+#include "InputRing.h"
+#include "PacketTable.h"
 #include "devices.h"
 
-#define POWEROFF_TIMEOUT (15 * 60)
+// Large enough for the HID part of any message
+#define REPORT_BUFFER_SIZE 32
 
 OSDefineMetaClassAndAbstractStructors(WirelessHIDDevice, IOHIDDevice)
 #define super IOHIDDevice
@@ -38,25 +41,68 @@ void WirelessHIDDevice::ChatPadTimerActionWrapper(OSObject *owner, IOTimerEventS
 {
 	WirelessHIDDevice *device = OSDynamicCast(WirelessHIDDevice, owner);
 
-    // Automatic shutoff
-    device->serialTimerCount++;
-    if (device->serialTimerCount > POWEROFF_TIMEOUT)
-        device->PowerOff();
-    // Reset
-    sender->setTimeoutMS(1000);
+    if (device != NULL)
+        device->IdleTimerAction(sender);
+}
+
+// Automatic shutoff. The timer only fires at the deadline computed from the
+// last input it knew of, so if there has been input since it just moves on.
+void WirelessHIDDevice::IdleTimerAction(IOTimerEventSource *sender)
+{
+    UInt64 now, remaining;
+
+    if (IdleRemainingMS(&now, &remaining) && (remaining == 0))
+    {
+        PowerOff();
+        // Try again after another full timeout if the controller is somehow still here
+        lastInputTime = now;
+    }
+    UpdateIdleTimer();
+}
+
+// Works out how long until the controller has been idle for powerOffTimeout,
+// returning false if it never powers off
+bool WirelessHIDDevice::IdleRemainingMS(UInt64 *now, UInt64 *remaining)
+{
+    UInt64 idle;
+
+    if (powerOffTimeout == 0)
+        return false;
+    clock_get_uptime(now);
+    absolutetime_to_nanoseconds(*now - lastInputTime, &idle);
+    idle /= 1000000;
+    *remaining = (idle >= (powerOffTimeout * 1000ULL)) ? 0 : ((powerOffTimeout * 1000ULL) - idle);
+    return true;
+}
+
+// Arms the timer for the idle deadline, after the timeout or last input has changed
+void WirelessHIDDevice::UpdateIdleTimer(void)
+{
+    UInt64 now, remaining;
+
+    if (serialTimer == NULL)
+        return;
+    if (IdleRemainingMS(&now, &remaining))
+    {
+        // A very long timeout just takes more than one firing to reach
+        if (remaining > 0x7FFFFFFF)
+            remaining = 0x7FFFFFFF;
+        serialTimer->setTimeoutMS((UInt32)((remaining == 0) ? 1 : remaining));
+    }
+    else
+        serialTimer->cancelTimeout();
 }
 
 // Sets the LED with the same format as the wired controller
 void WirelessHIDDevice::SetLEDs(int mode)
 {
     unsigned char buf[] = {0x00, 0x00, 0x08, (unsigned char)(0x40 + (mode % 0x0e)), 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+    const WirelessOutPacket packets[] = {{buf, sizeof(buf)}, {weirdStart, sizeof(weirdStart)}};
     WirelessDevice *device = OSDynamicCast(WirelessDevice, getProvider());
 
+    ledMode = mode;
     if (device != NULL)
-    {
-        device->SendPacket(buf, sizeof(buf));
-        device->SendPacket(weirdStart, sizeof(weirdStart));
-    }
+        device->SendPackets(packets, sizeof(packets) / sizeof(packets[0]));
 }
 
 // Returns the battery level
@@ -100,6 +146,31 @@ IOReturn WirelessHIDDevice::setReport(IOMemoryDescriptor *report, IOHIDReportTyp
     }
 }
 
+// Handle messages from the wireless device
+IOReturn WirelessHIDDevice::message(UInt32 type, IOService *provider, void *argument)
+{
+    WirelessDevice *device = OSDynamicCast(WirelessDevice, provider);
+
+    if ((type == kIOMessageServiceIsResumed) && (device != NULL))
+    {
+        // The same controller reconnected, so set it up again as it was
+        clock_get_uptime(&lastInputTime);
+        // Setting the LEDs starts it as well, all in one go
+        if (ledMode >= 0)
+            SetLEDs(ledMode);
+        else
+            device->SendPacket(weirdStart, sizeof(weirdStart));
+        return kIOReturnSuccess;
+    }
+    if ((type == kIOMessageServiceIsSuspended) && (device != NULL))
+    {
+        // The controller went away, so nothing it was holding should stay held
+        sendNeutralReport();
+        return kIOReturnSuccess;
+    }
+    return super::message(type, provider, argument);
+}
+
 // Start up the driver
 bool WirelessHIDDevice::handleStart(IOService *provider)
 {
@@ -113,7 +184,30 @@ bool WirelessHIDDevice::handleStart(IOService *provider)
     if (device == NULL)
         goto fail;
 
-    serialTimerCount = 0;
+    clock_get_uptime(&lastInputTime);
+    ledMode = -1;
+
+    packetLock = IOLockAlloc();
+    if (packetLock == NULL)
+    {
+        IOLog("start - failed to allocate packet lock\n");
+        goto fail;
+    }
+
+    reportBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionOut, REPORT_BUFFER_SIZE);
+    if (reportBuffer == NULL)
+    {
+        IOLog("start - failed to allocate report buffer\n");
+        goto fail;
+    }
+
+    staleSkipped = OSNumber::withNumber((unsigned long long)0, 32);
+    if (staleSkipped != NULL)
+        setProperty("StaleReportsSkipped", staleSkipped);
+    unknownPackets = 0;
+    unknownCount = OSNumber::withNumber((unsigned long long)0, 32);
+    if (unknownCount != NULL)
+        setProperty("UnknownPackets", unknownCount);
 
 	serialTimer = IOTimerEventSource::timerEventSource(this, ChatPadTimerActionWrapper);
 	if (serialTimer == NULL)
@@ -129,10 +223,11 @@ bool WirelessHIDDevice::handleStart(IOService *provider)
 	}
 
     device->RegisterWatcher(this, _receivedData, NULL);
+    device->RegisterReceiver(this, _receivedPacket);
 
     device->SendPacket(weirdStart, sizeof(weirdStart));
 
-    serialTimer->setTimeoutMS(1000);
+    UpdateIdleTimer();
 
     return true;
 
@@ -140,13 +235,23 @@ fail:
     return false;
 }
 
+void WirelessHIDDevice::free(void)
+{
+    if (packetLock != NULL)
+        IOLockFree(packetLock);
+    super::free();
+}
+
 // Shut down the driver
 void WirelessHIDDevice::handleStop(IOService *provider)
 {
     WirelessDevice *device = OSDynamicCast(WirelessDevice, provider);
 
     if (device != NULL)
+    {
+        device->RegisterReceiver(NULL, NULL);
         device->RegisterWatcher(NULL, NULL, NULL);
+    }
 
     if (serialTimer != NULL) {
         serialTimer->cancelTimeout();
@@ -157,63 +262,95 @@ void WirelessHIDDevice::handleStop(IOService *provider)
         serialTimer = NULL;
     }
 
+    if (reportBuffer != NULL) {
+        IOLockLock(packetLock);
+        reportBuffer->release();
+        reportBuffer = NULL;
+        IOLockUnlock(packetLock);
+    }
+
+    if (staleSkipped != NULL) {
+        staleSkipped->release();
+        staleSkipped = NULL;
+    }
+
+    if (unknownCount != NULL) {
+        unknownCount->release();
+        unknownCount = NULL;
+    }
+
     super::handleStop(provider);
 }
 
 // Handle new data from the device
 void WirelessHIDDevice::receivedData(void)
 {
-    IOMemoryDescriptor *data;
+    unsigned char buf[WIRELESS_PACKET_SIZE], latest[WIRELESS_PACKET_SIZE];
+    UInt32 length, latestLength = 0, skipped = 0;
     WirelessDevice *device = OSDynamicCast(WirelessDevice, getProvider());
     if (device == NULL)
         return;
 
-    while ((data = device->NextPacket()) != NULL)
+    // Packets delivered directly can't start until the backlog is done
+    IOLockLock(packetLock);
+    while ((length = device->NextPacket(buf, sizeof(buf))) != 0)
     {
-        receivedMessage(data);
-        data->release();
+        if (coalesceBacklog && Wireless_IsInputPacket(buf, length))
+        {
+            // Hold on to it in case a newer report follows straight after
+            if (latestLength != 0)
+                skipped++;
+            memcpy(latest, buf, length);
+            latestLength = length;
+            continue;
+        }
+        if (latestLength != 0)
+        {
+            receivedMessage(latest, (int)latestLength);
+            latestLength = 0;
+        }
+        receivedMessage(buf, (int)length);
     }
+    if (latestLength != 0)
+        receivedMessage(latest, (int)latestLength);
+    IOLockUnlock(packetLock);
+    if ((skipped != 0) && (staleSkipped != NULL))
+        staleSkipped->addValue(skipped);
 }
 
 const char *HexData = "0123456789ABCDEF";
 
 // Process new data
-void WirelessHIDDevice::receivedMessage(IOMemoryDescriptor *data)
+void WirelessHIDDevice::receivedMessage(unsigned char *buf, int length)
 {
-    unsigned char buf[29];
-
-    if (data->getLength() != 29)
-        return;
-
-    data->readBytes(0, buf, 29);
+    WIRELESS_PACKET packet;
 
-    switch (buf[1])
+    switch (Wireless_ParsePacket(Wireless_ControllerPackets, WIRELESS_PACKET_TYPES(Wireless_ControllerPackets), buf, length, &packet))
     {
-        case 0x0f:  // Initial info
-            if (buf[16] == 0x13)
-                receivedUpdate(0x13, buf + 17);
-            serialString[0] = HexData[(buf[0x0A] & 0xF0) >> 4];
-            serialString[1] = HexData[buf[0x0A] & 0x0F];
-            serialString[2] = HexData[(buf[0x0B] & 0xF0) >> 4];
-            serialString[3] = HexData[buf[0x0B] & 0x0F];
-            serialString[4] = HexData[(buf[0x0C] & 0xF0) >> 4];
-            serialString[5] = HexData[buf[0x0C] & 0x0F];
-            serialString[6] = HexData[(buf[0x0D] & 0xF0) >> 4];
-            serialString[7] = HexData[buf[0x0D] & 0x0F];
-            serialString[8] = '\0';
+        case kPacketInfo:
+            if (packet.value == 0x13)
+                receivedUpdate(0x13, packet.payload);
+            for (int i = 0; i < WIRELESS_SERIAL_LENGTH; i++)
+            {
+                serialString[(i * 2) + 0] = HexData[(buf[WIRELESS_SERIAL_OFFSET + i] & 0xF0) >> 4];
+                serialString[(i * 2) + 1] = HexData[buf[WIRELESS_SERIAL_OFFSET + i] & 0x0F];
+            }
+            serialString[WIRELESS_SERIAL_LENGTH * 2] = '\0';
             IOLog("Got serial number: %s", serialString);
             break;
 
-        case 0x01:  // HID info update
-            if (buf[3] == 0xf0)
-                receivedHIDupdate(buf + 4, buf[5]);
+        case kPacketHIDUpdate:
+            receivedHIDupdate(packet.payload, packet.payloadLength);
             break;
 
-        case 0x00:  // Info update
-            receivedUpdate(buf[3], buf + 4);
+        case kPacketUpdate:
+            receivedUpdate(packet.value, packet.payload);
             break;
 
         default:
+            unknownPackets++;
+            if (unknownCount != NULL)
+                unknownCount->setValue(unknownPackets);
             break;
     }
 }
@@ -244,22 +381,54 @@ void WirelessHIDDevice::receivedUpdate(unsigned char type, unsigned char *data)
 void WirelessHIDDevice::receivedHIDupdate(unsigned char *data, int length)
 {
     IOReturn err;
-    IOMemoryDescriptor *report;
 
-    serialTimerCount = 0;
-    report = IOMemoryDescriptor::withAddress(data, length, kIODirectionNone);
-    err = handleReport(report);
-    report->release();
+    clock_get_uptime(&lastInputTime);
+    if ((reportBuffer == NULL) || (length > REPORT_BUFFER_SIZE))
+        return;
+    reportBuffer->setLength(length);
+    reportBuffer->writeBytes(0, data, length);
+    reportSent = true;
+    err = handleReport(reportBuffer);
     if (err != kIOReturnSuccess)
         IOLog("handleReport return: 0x%.8x\n", err);
 }
 
+// Passes on a report with the sticks centred and nothing pressed, keeping the
+// header of the last report, so no input stays held while the controller is away
+void WirelessHIDDevice::sendNeutralReport(void)
+{
+    static const unsigned char neutral[REPORT_BUFFER_SIZE] = {0};
+    IOReturn err;
+
+    if (packetLock == NULL)
+        return;
+    IOLockLock(packetLock);
+    if ((reportBuffer != NULL) && reportSent && (reportBuffer->getLength() > 2))
+    {
+        reportBuffer->writeBytes(2, neutral, reportBuffer->getLength() - 2);
+        err = handleReport(reportBuffer);
+        if (err != kIOReturnSuccess)
+            IOLog("handleReport return: 0x%.8x\n", err);
+    }
+    IOLockUnlock(packetLock);
+}
+
 // Wrapper for notification of receiving data
 void WirelessHIDDevice::_receivedData(void *target, WirelessDevice *sender, void *parameter)
 {
     ((WirelessHIDDevice*)target)->receivedData();
 }
 
+// Wrapper for packets delivered straight from the receiver
+void WirelessHIDDevice::_receivedPacket(void *target, WirelessDevice *sender, unsigned char *data, int length)
+{
+    WirelessHIDDevice *device = (WirelessHIDDevice*)target;
+
+    IOLockLock(device->packetLock);
+    device->receivedMessage(data, length);
+    IOLockUnlock(device->packetLock);
+}
+
 // Get a location ID for this device, as some games require it
 OSNumber* WirelessHIDDevice::newLocationIDNumber() const
 {
@@ -24,6 +24,10 @@
 #define __WIRELESSHIDDEVICE_H__
 
 #include <IOKit/hid/IOHIDDevice.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+
+// Default for how long a controller can sit idle before it is turned off, in seconds
+#define POWEROFF_TIMEOUT (15 * 60)
 
 class WirelessDevice;
 
@@ -31,11 +35,14 @@ class WirelessHIDDevice : public IOHIDDevice
 {
     OSDeclareDefaultStructors(WirelessHIDDevice);
 public:
+    void free(void);
+
     void SetLEDs(int mode);
     void PowerOff(void);
     unsigned char GetBatteryLevel(void);
 
     IOReturn setReport(IOMemoryDescriptor *report, IOHIDReportType reportType, IOOptionBits options);
+    IOReturn message(UInt32 type, IOService *provider, void *argument);
 
     OSNumber* newLocationIDNumber() const;
     OSString* newSerialNumberString() const;
@@ -43,17 +50,36 @@ protected:
     bool handleStart(IOService *provider);
     void handleStop(IOService *provider);
     virtual void receivedData(void);
-    virtual void receivedMessage(IOMemoryDescriptor *data);
+    virtual void receivedMessage(unsigned char *buf, int length);
     virtual void receivedUpdate(unsigned char type, unsigned char *data);
     virtual void receivedHIDupdate(unsigned char *data, int length);
+    virtual void sendNeutralReport(void);
+
+    void UpdateIdleTimer(void);
+
+    // Setting: when draining a backlog, pass on only the newest of each run of input reports
+    bool coalesceBacklog;
+    // Setting: seconds without input before the controller is turned off, 0 for never
+    UInt32 powerOffTimeout;
 private:
     static void _receivedData(void *target, WirelessDevice *sender, void *parameter);
+    static void _receivedPacket(void *target, WirelessDevice *sender, unsigned char *data, int length);
     static void ChatPadTimerActionWrapper(OSObject *owner, IOTimerEventSource *sender);
+    void IdleTimerAction(IOTimerEventSource *sender);
+    bool IdleRemainingMS(UInt64 *now, UInt64 *remaining);
 
 	IOTimerEventSource *serialTimer;
-    int serialTimerCount;
+    UInt64 lastInputTime;                       // Uptime of the last input report, in absolute time units
+
+    IOLock *packetLock;                         // Held while parsing, as queued and direct packets share reportBuffer
+    IOBufferMemoryDescriptor *reportBuffer;     // Reused for every report passed to handleReport
+    bool reportSent;                            // Set once reportBuffer holds a report
+    OSNumber *staleSkipped;                     // Input reports dropped by coalesceBacklog
+    UInt32 unknownPackets;                      // Messages no entry in the packet table matched
+    OSNumber *unknownCount;
 
     unsigned char battery;
+    int ledMode;                                // Last LED mode set, or -1
     char serialString[10];
 };
 
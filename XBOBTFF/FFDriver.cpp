@@ -99,11 +99,10 @@ static IOForceFeedbackDeviceInterface functionMapXBOBT_IOForceFeedbackDeviceInte
 	&FeedbackXBOBT::sStopEffect
 };
 
-FeedbackXBOBT::FeedbackXBOBT() : fRefCount(1),  EffectIndex(1), Stopped(true),
+FeedbackXBOBT::FeedbackXBOBT() : fRefCount(1), Stopped(true),
 Paused(false), PausedTime(0), LastTime(0), Gain(10000), PrvLeftLevel(0),
 PrvRightLevel(0), Actuator(true), Manual(false)
 {
-	EffectList = FeedbackXBOEffectVector();
 	
 	iIOCFPlugInInterface.pseudoVTable = (IUnknownVTbl *) &functionMapXBOBT_IOCFPlugInInterface;
 	iIOCFPlugInInterface.obj = this;
@@ -218,20 +217,21 @@ HRESULT FeedbackXBOBT::SetProperty(FFProperty property, void *value)
 HRESULT FeedbackXBOBT::StartEffect(FFEffectDownloadID EffectHandle, FFEffectStartFlag Mode, UInt32 Count)
 {
 	dispatch_sync(Queue, ^{
-		for (FeedbackXBOEffectIterator effectIterator = EffectList.begin() ; effectIterator != EffectList.end(); ++effectIterator)
+		FeedbackXBOEffect *Effect = EffectList.Find(EffectHandle);
+		if (Mode & FFES_SOLO)
 		{
-			if (effectIterator->Handle == EffectHandle)
+			for (FeedbackXBOEffectIterator effectIterator = EffectList.begin() ; effectIterator != EffectList.end(); ++effectIterator)
 			{
-				effectIterator->Status  = FFEGES_PLAYING;
-				effectIterator->PlayCount = Count;
-				effectIterator->StartTime = CurrentTimeUsingMach();
-				Stopped = false;
-			} else {
-				if (Mode & FFES_SOLO) {
-					effectIterator->Status = NULL;
-				}
+				effectIterator->Status = NULL;
 			}
 		}
+		if (Effect != NULL)
+		{
+			Effect->Status  = FFEGES_PLAYING;
+			Effect->PlayCount = Count;
+			Effect->StartTime = CurrentTimeUsingMach();
+			Stopped = false;
+		}
 	});
 	return FF_OK;
 }
@@ -239,13 +239,10 @@ HRESULT FeedbackXBOBT::StartEffect(FFEffectDownloadID EffectHandle, FFEffectStar
 HRESULT FeedbackXBOBT::StopEffect(UInt32 EffectHandle)
 {
 	dispatch_sync(Queue, ^{
-		for (FeedbackXBOEffectIterator effectIterator = EffectList.begin() ; effectIterator != EffectList.end(); ++effectIterator)
+		FeedbackXBOEffect *Effect = EffectList.Find(EffectHandle);
+		if (Effect != NULL)
 		{
-			if (effectIterator->Handle == EffectHandle)
-			{
-				effectIterator->Status = NULL;
-				break;
-			}
+			Effect->Status = NULL;
 		}
 	});
 	return FF_OK;
@@ -263,16 +260,12 @@ HRESULT FeedbackXBOBT::DownloadEffect(CFUUIDRef EffectType, FFEffectDownloadID *
 	dispatch_sync(Queue, ^{
 		FeedbackXBOEffect *Effect = NULL;
 		if (*EffectHandle == 0) {
-			EffectList.push_back(FeedbackXBOEffect(EffectIndex++));
-			Effect = &(EffectList.back());
-			*EffectHandle = Effect->Handle;
-		} else {
-			for (LONG Index = 0; Index < EffectList.size(); Index++) {
-				if (EffectList[Index].Handle == *EffectHandle) {
-					Effect = &(EffectList[Index]);
-					break;
-				}
+			Effect = EffectList.Insert();
+			if (Effect != NULL) {
+				*EffectHandle = Effect->Handle;
 			}
+		} else {
+			Effect = EffectList.Find(*EffectHandle);
 		}
 		
 		if (Effect == NULL || Result == -1) {
@@ -438,7 +431,7 @@ HRESULT FeedbackXBOBT::GetForceFeedbackCapabilities(FFCAPABILITIES *capabilities
 	capabilities->ffAxes[1]=FFJOFS_Y;
 	capabilities->ffAxes[2]=FFJOFS_Z;
 	capabilities->ffAxes[3]=FFJOFS_RZ;
-	capabilities->storageCapacity=256;
+	capabilities->storageCapacity=EffectCapacity;
 	capabilities->playbackCapacity=1;
 	capabilities->driverVer.majorRev=FeedbackDriverVersionMajor;
 	capabilities->driverVer.minorAndBugRev=FeedbackDriverVersionMinor;
@@ -462,7 +455,7 @@ HRESULT FeedbackXBOBT::SendForceFeedbackCommand(FFCommandFlag state)
 	dispatch_sync(Queue, ^{
 		switch (state) {
 			case FFSFFC_RESET:
-				EffectList.clear();
+				EffectList.Clear();
 				Stopped = true;
 				Paused = false;
 				break;
@@ -550,14 +543,7 @@ HRESULT FeedbackXBOBT::DestroyEffect(FFEffectDownloadID EffectHandle)
 {
 	__block HRESULT Result = FF_OK;
 	dispatch_sync(Queue, ^{
-		for (FeedbackXBOEffectIterator effectIterator = EffectList.begin() ; effectIterator != EffectList.end(); ++effectIterator)
-		{
-			if (effectIterator->Handle == EffectHandle)
-			{
-				EffectList.erase(effectIterator);
-				break;
-			}
-		}
+		EffectList.Erase(EffectHandle);
 	});
 	return Result;
 }
@@ -669,13 +655,10 @@ void FeedbackXBOBT::EffectProc( void *params )
 HRESULT FeedbackXBOBT::GetEffectStatus(FFEffectDownloadID EffectHandle, FFEffectStatusFlag *Status)
 {
 	dispatch_sync(Queue, ^{
-		for (FeedbackXBOEffectIterator effectIterator = EffectList.begin() ; effectIterator != EffectList.end(); ++effectIterator)
+		FeedbackXBOEffect *Effect = EffectList.Find(EffectHandle);
+		if (Effect != NULL)
 		{
-			if (effectIterator->Handle == EffectHandle)
-			{
-				*Status = effectIterator->Status;
-				break;
-			}
+			*Status = Effect->Status;
 		}
 	});
 	return FF_OK;
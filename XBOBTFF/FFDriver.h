@@ -13,8 +13,8 @@
 #include <CoreFoundation/CFPlugInCOM.h>
 #include <ForceFeedback/IOForceFeedbackLib.h>
 #include <IOKit/hid/IOHIDLib.h>
-#include <vector>
 #include "FeedbackXBOEffect.hpp"
+#include "../Feedback360/EffectSlotMap.h"
 
 // 0F793F56-8C17-4BA0-9201-D52FEC6C2702
 #define BTFFPLUGINTERFACE CFUUIDGetConstantUUIDWithBytes(kCFAllocatorSystemDefault, 0x0F, 0x79, 0x3F, 0x56, 0x8C, 0x17, 0x4B, 0xA0, 0x92, 0x01, 0xD5, 0x2F, 0xEC, 0x6C, 0x27, 0x02)
@@ -24,6 +24,9 @@
 #define FeedbackDriverVersionStage      developStage
 #define FeedbackDriverVersionNonRelRev  0
 
+// Effects that can be downloaded at once
+#define EffectCapacity                  256
+
 class FeedbackXBOBT : IUnknown
 {
 public:
@@ -75,8 +78,8 @@ public:
     virtual ULONG   Release(void);
     
 private:
-    typedef std::vector<FeedbackXBOEffect> FeedbackXBOEffectVector;
-    typedef FeedbackXBOEffectVector::iterator FeedbackXBOEffectIterator;
+    typedef EffectSlotMap<FeedbackXBOEffect, EffectCapacity> FeedbackXBOEffectMap;
+    typedef FeedbackXBOEffectMap::Iterator FeedbackXBOEffectIterator;
     // helper function
     static inline FeedbackXBOBT *getThis (void *self) { return (FeedbackXBOBT *) ((XboxOneBTInterfaceMap *) self)->obj; }
     
@@ -90,8 +93,7 @@ private:
     dispatch_source_t   Timer;
     
     // effects handling
-    FeedbackXBOEffectVector EffectList;
-    UInt32              EffectIndex;
+    FeedbackXBOEffectMap EffectList;
     
     DWORD   Gain;
     bool    Actuator;
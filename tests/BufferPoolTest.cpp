@@ -0,0 +1,119 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    BufferPoolTest.cpp - checks the output buffer pool from several threads
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <stdio.h>
+#include <thread>
+#include "360Controller/BufferPool.h"
+
+// The drivers' pool size, and more threads than slots sharing it so it runs out
+#define POOL_SLOTS      8
+#define THREAD_COUNT    12
+#define THREAD_CLAIMS   50000
+
+static XBOX360_BUFFER_POOL pool;
+static int owners[POOL_SLOTS];
+static unsigned long failures;
+
+#define CHECK(condition) \
+    do { if (!(condition)) { printf("  %s:%d: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+// One thread: claims every slot lowest first, is turned away, and gets freed slots back
+static void TestSingleThread(void)
+{
+    Xbox360_PoolInit(&pool, POOL_SLOTS);
+    for (int i = 0; i < POOL_SLOTS; i++)
+        CHECK(Xbox360_PoolAlloc(&pool) == i);
+    CHECK(Xbox360_PoolAlloc(&pool) == -1);
+    CHECK(pool.rejected == 1);
+    CHECK(pool.peak == POOL_SLOTS);
+    Xbox360_PoolFree(&pool, 5);
+    Xbox360_PoolFree(&pool, 2);
+    CHECK(Xbox360_PoolAlloc(&pool) == 2);
+    CHECK(Xbox360_PoolAlloc(&pool) == 5);
+    for (int i = 0; i < POOL_SLOTS; i++)
+        Xbox360_PoolFree(&pool, i);
+    CHECK(pool.available == ((1U << POOL_SLOTS) - 1));
+
+    // Sizes at and past the end of the mask
+    Xbox360_PoolInit(&pool, XBOX360_POOL_MAX);
+    CHECK(pool.available == 0xFFFFFFFF);
+    Xbox360_PoolInit(&pool, XBOX360_POOL_MAX + 8);
+    CHECK(pool.count == XBOX360_POOL_MAX);
+    CHECK(pool.available == 0xFFFFFFFF);
+}
+
+// Several threads claim and release slots as fast as they can, each marking
+// itself as the owner of the slot while it holds it. A slot handed to two
+// threads at once shows up as an owner that isn't free.
+static void TestThreads(void)
+{
+    std::thread threads[THREAD_COUNT];
+    unsigned long claims[THREAD_COUNT], shared[THREAD_COUNT];
+    unsigned long totalClaims = 0, totalShared = 0;
+
+    Xbox360_PoolInit(&pool, POOL_SLOTS);
+    for (int t = 0; t < THREAD_COUNT; t++)
+    {
+        claims[t] = shared[t] = 0;
+        threads[t] = std::thread([t, &claims, &shared] {
+            const int id = t + 1;
+
+            for (int i = 0; i < THREAD_CLAIMS; i++)
+            {
+                const int slot = Xbox360_PoolAlloc(&pool);
+                int expected = 0;
+
+                if (slot < 0)
+                    continue;
+                claims[t]++;
+                if (!__atomic_compare_exchange_n(&owners[slot], &expected, id, false,
+                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    shared[t]++;
+                // Hold some slots while other threads run, so every slot gets taken now and then
+                if ((i % 4) == 0)
+                    std::this_thread::yield();
+                __atomic_store_n(&owners[slot], 0, __ATOMIC_RELAXED);
+                Xbox360_PoolFree(&pool, slot);
+            }
+        });
+    }
+    for (int t = 0; t < THREAD_COUNT; t++)
+    {
+        threads[t].join();
+        totalClaims += claims[t];
+        totalShared += shared[t];
+    }
+    CHECK(totalShared == 0);
+    CHECK(totalClaims + pool.rejected == (unsigned long)THREAD_COUNT * THREAD_CLAIMS);
+    CHECK(pool.available == ((1U << POOL_SLOTS) - 1));
+    CHECK((pool.peak >= 1) && (pool.peak <= POOL_SLOTS));
+    printf("BufferPoolTest: %lu claims from %d threads, %u rejected, peak %u\n",
+           totalClaims, THREAD_COUNT, pool.rejected, pool.peak);
+}
+
+int main(void)
+{
+    TestSingleThread();
+    TestThreads();
+    printf("BufferPoolTest: %lu failures\n", failures);
+    return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    ButtonBench.cpp - checks and times the button tables against the original code
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include "OriginalReport.h"
+
+// Every value of the button field, and how many times each run goes over them
+#define BUTTON_VALUES   65536
+#define BUTTON_PASSES   500
+
+// Bindings checked, each a shuffle of the bits the buttons can go to
+#define BINDING_COUNT   1000
+
+static XBOX360_IN_REPORT input[BUTTON_VALUES];
+static XBOX360_IN_REPORT expected[BUTTON_VALUES];
+static XBOX360_IN_REPORT actual[BUTTON_VALUES];
+
+static UInt32 NextRandom(UInt32 *seed)
+{
+    *seed = (*seed * 1103515245) + 12345;
+    return *seed >> 8;
+}
+
+// Binds each button to a random bit, which may be shared with other buttons
+static void RandomBindings(ORIGINAL_SETTINGS *s, UInt32 *seed)
+{
+    for (int i = 0; i < 15; i++)
+        s->mapping[i] = (UInt8)(NextRandom(seed) % 16);
+    s->noMapping = false;
+}
+
+// Nanoseconds per report of running a function over every button value
+template <typename Function>
+static double TimeReports(XBOX360_IN_REPORT *reports, Function process)
+{
+    std::chrono::steady_clock::time_point start;
+    double elapsed;
+
+    start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < BUTTON_PASSES; pass++)
+    {
+        memcpy(reports, input, sizeof(input));
+        process(reports);
+    }
+    elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    return elapsed / ((double)BUTTON_VALUES * BUTTON_PASSES);
+}
+
+int main(void)
+{
+    ORIGINAL_SETTINGS settings;
+    XBOX360_BUTTON_TABLE table;
+    UInt32 seed = 1;
+    unsigned long checked = 0, failures = 0;
+    double original, single, batched;
+
+    memset(input, 0, sizeof(input));
+    for (int i = 0; i < BUTTON_VALUES; i++)
+        input[i].buttons = (UInt16)i;
+
+    // Every button value under each binding, starting with the defaults
+    memset(&settings, 0, sizeof(settings));
+    Original_DefaultMapping(&settings);
+    for (int binding = 0; binding < BINDING_COUNT; binding++)
+    {
+        if (binding != 0)
+            RandomBindings(&settings, &seed);
+        Xbox360_BuildButtonTable(&table, settings.mapping);
+        for (int i = 0; i < BUTTON_VALUES; i++)
+        {
+            XBOX360_IN_REPORT old = input[i], remapped = input[i];
+
+            Original_RemapButtons(&settings, &old);
+            Xbox360_RemapButtons(&remapped, &table);
+            checked++;
+            if (old.buttons != remapped.buttons)
+            {
+                if (failures++ < 10)
+                    printf("  buttons %04x: expected %04x, got %04x\n", i, old.buttons, remapped.buttons);
+            }
+        }
+    }
+    printf("ButtonBench: %lu button values checked, %lu differ\n", checked, failures);
+
+    // Times the last binding three ways
+    original = TimeReports(expected, [&settings](XBOX360_IN_REPORT *reports) {
+        for (int i = 0; i < BUTTON_VALUES; i++)
+            Original_RemapButtons(&settings, &reports[i]);
+    });
+    single = TimeReports(actual, [&table](XBOX360_IN_REPORT *reports) {
+        for (int i = 0; i < BUTTON_VALUES; i++)
+            Xbox360_RemapButtons(&reports[i], &table);
+    });
+    batched = TimeReports(actual, [&table](XBOX360_IN_REPORT *reports) {
+        Xbox360_RemapButtons(reports, BUTTON_VALUES, &table);
+    });
+    if (memcmp(expected, actual, sizeof(actual)) != 0)
+        failures++;
+    printf("%-20s %8s\n", "remap", "ns");
+    printf("%-20s %8.2f\n", "original", original);
+    printf("%-20s %8.2f\n", "table", single);
+    printf("%-20s %8.2f\n", "table, batched", batched);
+    return (failures == 0) ? 0 : 1;
+}
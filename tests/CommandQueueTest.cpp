@@ -0,0 +1,176 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Force Feedback module
+    Copyright (C) 2013 David Ryskalczyk
+
+    CommandQueueTest.cpp - checks the effect command queue with several producer threads
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Xbox360Controller; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <stdio.h>
+#include <thread>
+#include "Feedback360/CommandQueue.h"
+
+// Small, so the producers keep finding it full
+#define QUEUE_SIZE          16
+#define PRODUCER_COUNT      4
+#define PRODUCER_COMMANDS   250000
+#define COMMAND_WORDS       8
+
+static unsigned long failures;
+
+#define CHECK(condition) \
+    do { if (!(condition)) { printf("  %s:%d: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+// Larger than a word, so a command read while half written shows up
+typedef struct TEST_COMMAND {
+    uint32_t Producer;
+    uint32_t Sequence;
+    uint32_t Check[COMMAND_WORDS];
+} TEST_COMMAND;
+
+static CommandQueue<TEST_COMMAND, QUEUE_SIZE> queue;
+
+static void MakeCommand(TEST_COMMAND *command, uint32_t producer, uint32_t sequence)
+{
+    command->Producer = producer;
+    command->Sequence = sequence;
+    for (int i = 0; i < COMMAND_WORDS; i++)
+        command->Check[i] = (sequence * 31) + (producer * 7) + i;
+}
+
+static bool CheckCommand(const TEST_COMMAND *command)
+{
+    for (int i = 0; i < COMMAND_WORDS; i++)
+    {
+        if (command->Check[i] != (command->Sequence * 31) + (command->Producer * 7) + i)
+            return false;
+    }
+    return true;
+}
+
+// One thread: fills the queue, overflows it, and drains it in order, round
+// the cells several times
+static void TestSingleThread(void)
+{
+    CommandQueue<TEST_COMMAND, QUEUE_SIZE> *single = new CommandQueue<TEST_COMMAND, QUEUE_SIZE>;
+    TEST_COMMAND command;
+    uint32_t sequence = 0;
+
+    CHECK(single->IsEmpty());
+    CHECK(!single->Take(&command));
+    for (int round = 0; round < 5; round++)
+    {
+        for (int i = 0; i < QUEUE_SIZE; i++)
+        {
+            MakeCommand(&command, 0, sequence + i);
+            CHECK(single->Post(command));
+        }
+        CHECK(!single->Post(command));
+        CHECK(single->GetOverflows() == (uint32_t)(round + 1));
+        for (int i = 0; i < QUEUE_SIZE; i++)
+        {
+            CHECK(!single->IsEmpty());
+            CHECK(single->Take(&command));
+            CHECK((command.Sequence == sequence + i) && CheckCommand(&command));
+        }
+        CHECK(single->IsEmpty());
+        CHECK(!single->Take(&command));
+        sequence += QUEUE_SIZE;
+    }
+
+    // Taking as it goes keeps the queue from ever filling
+    for (int i = 0; i < QUEUE_SIZE * 10; i++)
+    {
+        MakeCommand(&command, 0, i);
+        CHECK(single->Post(command));
+        CHECK(single->Take(&command));
+        CHECK((command.Sequence == (uint32_t)i) && CheckCommand(&command));
+    }
+    CHECK(single->GetOverflows() == 5);
+    delete single;
+}
+
+// Several producers post at once, retrying when the queue is full, while the
+// consumer checks each command arrives once, intact, and in the order its
+// producer posted it
+static void TestThreads(void)
+{
+    std::thread producers[PRODUCER_COUNT];
+    uint32_t retries[PRODUCER_COUNT];
+    uint32_t next[PRODUCER_COUNT] = {0};
+    uint32_t received = 0, misordered = 0, corrupt = 0, totalRetries = 0;
+
+    for (int p = 0; p < PRODUCER_COUNT; p++)
+    {
+        retries[p] = 0;
+        producers[p] = std::thread([p, &retries] {
+            TEST_COMMAND command;
+
+            for (uint32_t i = 0; i < PRODUCER_COMMANDS; i++)
+            {
+                MakeCommand(&command, p, i);
+                while (!queue.Post(command))
+                {
+                    retries[p]++;
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    while (received < (uint32_t)PRODUCER_COUNT * PRODUCER_COMMANDS)
+    {
+        TEST_COMMAND command;
+
+        if (!queue.Take(&command))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        received++;
+        if (command.Producer >= PRODUCER_COUNT)
+        {
+            corrupt++;
+            continue;
+        }
+        if (command.Sequence != next[command.Producer])
+            misordered++;
+        next[command.Producer] = command.Sequence + 1;
+        if (!CheckCommand(&command))
+            corrupt++;
+    }
+    for (int p = 0; p < PRODUCER_COUNT; p++)
+    {
+        producers[p].join();
+        totalRetries += retries[p];
+        CHECK(next[p] == PRODUCER_COMMANDS);
+    }
+    CHECK(misordered == 0);
+    CHECK(corrupt == 0);
+    CHECK(queue.GetOverflows() == totalRetries);
+    CHECK(queue.IsEmpty());
+    printf("CommandQueueTest: %u commands from %d threads, %u retried when full\n",
+           received, PRODUCER_COUNT, totalRetries);
+}
+
+int main(void)
+{
+    TestSingleThread();
+    TestThreads();
+    printf("CommandQueueTest: %lu failures\n", failures);
+    return (failures == 0) ? 0 : 1;
+}
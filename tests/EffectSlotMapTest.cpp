@@ -0,0 +1,212 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Force Feedback module
+    Copyright (C) 2013 David Ryskalczyk
+
+    EffectSlotMapTest.cpp - checks the effect storage against std::map with random operations
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Xbox360Controller; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <stdio.h>
+#include <map>
+#include <set>
+#include "Feedback360/EffectSlotMap.h"
+
+// Small enough that the map fills up often, and spans several blocks
+#define MAP_CAPACITY    48
+#define FUZZ_STEPS      2000000
+// Every so often the whole map is compared with the reference
+#define FULL_CHECK      97
+
+static unsigned long failures;
+static long liveEffects;
+
+#define CHECK(condition) \
+    do { if (!(condition)) { printf("  %s:%d: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+// Stands in for Feedback360Effect: made from its handle, and points into itself
+// the way DiEffect.lpEnvelope does, so a moved element shows up
+typedef struct TEST_EFFECT {
+    uint32_t Handle;
+    uint32_t Tag;
+    uint32_t *Self;
+
+    TEST_EFFECT(uint32_t handle) : Handle(handle), Tag(0), Self(&Tag) { liveEffects++; }
+    ~TEST_EFFECT() { liveEffects--; Self = NULL; }
+} TEST_EFFECT;
+
+typedef EffectSlotMap<TEST_EFFECT, MAP_CAPACITY> TEST_MAP;
+
+// What the map should hold for each handle
+typedef struct EXPECTED_EFFECT {
+    TEST_EFFECT *address;
+    uint32_t tag;
+} EXPECTED_EFFECT;
+
+// Small generator so every run does the same operations
+static uint32_t NextRandom(uint32_t *seed)
+{
+    *seed = (*seed * 1103515245) + 12345;
+    return *seed >> 8;
+}
+
+// Every effect in the reference is found where it was made, unchanged, and
+// iterating visits exactly those
+static void CheckAll(TEST_MAP *map, std::map<uint32_t, EXPECTED_EFFECT> &expected)
+{
+    std::set<uint32_t> visited;
+
+    CHECK(map->size() == expected.size());
+    CHECK(liveEffects == (long)expected.size());
+    for (std::map<uint32_t, EXPECTED_EFFECT>::iterator i = expected.begin(); i != expected.end(); ++i)
+    {
+        TEST_EFFECT *effect = map->Find(i->first);
+
+        CHECK(effect == i->second.address);
+        if (effect == NULL)
+            continue;
+        CHECK(effect->Handle == i->first);
+        CHECK(effect->Tag == i->second.tag);
+        CHECK(effect->Self == &effect->Tag);
+    }
+    for (TEST_MAP::Iterator i = map->begin(); i != map->end(); ++i)
+    {
+        CHECK(visited.insert(i->Handle).second);
+        CHECK(expected.count(i->Handle) == 1);
+    }
+    CHECK(visited.size() == expected.size());
+}
+
+// Random inserts, erases and lookups, with handles that are live, destroyed
+// and made up, each checked against std::map as it happens
+static void TestFuzz(void)
+{
+    TEST_MAP *map = new TEST_MAP;
+    std::map<uint32_t, EXPECTED_EFFECT> expected;
+    std::set<uint32_t> destroyed;
+    unsigned long inserts = 0, erases = 0, full = 0, clears = 0;
+    uint32_t seed = 1;
+
+    for (int step = 0; step < FUZZ_STEPS; step++)
+    {
+        const uint32_t op = NextRandom(&seed) % 100;
+
+        if (op < 45)
+        {
+            TEST_EFFECT *effect = map->Insert();
+
+            if (effect == NULL)
+            {
+                CHECK(expected.size() == MAP_CAPACITY);
+                full++;
+                continue;
+            }
+            CHECK(expected.size() < MAP_CAPACITY);
+            CHECK(effect->Handle != 0);
+            CHECK(TEST_MAP::Slot(effect->Handle) < MAP_CAPACITY);
+            CHECK(expected.count(effect->Handle) == 0);
+            effect->Tag = NextRandom(&seed);
+            expected[effect->Handle].address = effect;
+            expected[effect->Handle].tag = effect->Tag;
+            destroyed.erase(effect->Handle);
+            inserts++;
+        }
+        else if ((op < 85) && !expected.empty())
+        {
+            std::map<uint32_t, EXPECTED_EFFECT>::iterator victim = expected.begin();
+
+            std::advance(victim, NextRandom(&seed) % expected.size());
+            CHECK(map->Erase(victim->first));
+            CHECK(map->Find(victim->first) == NULL);
+            CHECK(!map->Erase(victim->first));
+            destroyed.insert(victim->first);
+            expected.erase(victim);
+            erases++;
+        }
+        else if ((op < 95) && !destroyed.empty())
+        {
+            // A destroyed handle stays gone even once its slot is in use again
+            std::set<uint32_t>::iterator stale = destroyed.begin();
+
+            std::advance(stale, NextRandom(&seed) % destroyed.size());
+            CHECK(map->Find(*stale) == NULL);
+            CHECK(!map->Erase(*stale));
+        }
+        else if (op < 99)
+        {
+            // Made up handles, including 0 and slots past the end
+            const uint32_t handle = (op == 95) ? 0 : NextRandom(&seed);
+
+            if (expected.count(handle) == 0)
+            {
+                CHECK(map->Find(handle) == NULL);
+                CHECK(!map->Erase(handle));
+            }
+        }
+        else if ((NextRandom(&seed) % 1000) == 0)
+        {
+            for (std::map<uint32_t, EXPECTED_EFFECT>::iterator i = expected.begin(); i != expected.end(); ++i)
+                destroyed.insert(i->first);
+            map->Clear();
+            expected.clear();
+            clears++;
+        }
+        if ((step % FULL_CHECK) == 0)
+            CheckAll(map, expected);
+        // Keep the stale handles to a set that is quick to pick from
+        if (destroyed.size() > 4096)
+            destroyed.clear();
+    }
+    CheckAll(map, expected);
+    delete map;
+    CHECK(liveEffects == 0);
+    printf("EffectSlotMapTest: %lu inserts, %lu erases, %lu turned away when full, %lu clears\n",
+           inserts, erases, full, clears);
+}
+
+// A slot used over and over moves its generation on each time, wraps without
+// ever making handle 0, and the handle from just before is never found
+static void TestGenerations(void)
+{
+    TEST_MAP *map = new TEST_MAP;
+    uint32_t previous = 0;
+
+    for (unsigned i = 0; i < 0x10000 + 8; i++)
+    {
+        TEST_EFFECT *effect = map->Insert();
+
+        CHECK(effect != NULL);
+        if (effect == NULL)
+            break;
+        CHECK(effect->Handle != 0);
+        CHECK(TEST_MAP::Slot(effect->Handle) == 0);
+        CHECK(effect->Handle != previous);
+        CHECK(map->Find(previous) == NULL);
+        previous = effect->Handle;
+        CHECK(map->Erase(previous));
+    }
+    delete map;
+    CHECK(liveEffects == 0);
+}
+
+int main(void)
+{
+    TestFuzz();
+    TestGenerations();
+    printf("EffectSlotMapTest: %lu failures\n", failures);
+    return (failures == 0) ? 0 : 1;
+}
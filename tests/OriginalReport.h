@@ -0,0 +1,170 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    OriginalReport.h - the report processing from before the tables and transforms
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __ORIGINALREPORT_H__
+#define __ORIGINALREPORT_H__
+
+#include "360Controller/ReportTransform.h"
+
+// The code below is Xbox360Peripheral::fiddleReport and normalizeAxis and
+// Xbox360ControllerClass::handleReport, remapButtons and remapAxes as they
+// were, with the driver's fields moved into this structure. The tests and
+// benchmarks check and measure the drivers' code against it.
+typedef struct ORIGINAL_SETTINGS {
+    bool invertLeftX, invertLeftY;
+    bool invertRightX, invertRightY;
+    short deadzoneLeft, deadzoneRight;
+    bool relativeLeft, relativeRight;
+    bool deadOffLeft, deadOffRight;
+    bool swapSticks;
+    UInt8 mapping[15];
+    bool noMapping;
+} ORIGINAL_SETTINGS;
+
+// Returns the axis rather than updating it, as packed fields can't be
+// passed by reference here
+static inline SInt16 Original_NormalizeAxis(SInt16 axis, short deadzone)
+{
+    static const UInt16 max16=32767;
+    const float current=Xbox360_GetAbsolute(axis);
+    const float maxVal=max16-deadzone;
+
+    if (current>deadzone) {
+        if (axis<0) {
+            axis=max16*(current-deadzone)/maxVal;
+            axis=~axis;
+        } else {
+            axis=max16*(current-deadzone)/maxVal;
+        }
+    } else {
+        axis=0;
+    }
+    return axis;
+}
+
+static inline void Original_FiddleReport(const ORIGINAL_SETTINGS *s, XBOX360_HAT& left, XBOX360_HAT& right)
+{
+    // deadOff - Normalize checkbox is checked if true
+    // relative - Linked checkbox is checked if true
+
+    if(s->invertLeftX) left.x=~left.x;
+    if(!s->invertLeftY) left.y=~left.y;
+    if(s->invertRightX) right.x=~right.x;
+    if(!s->invertRightY) right.y=~right.y;
+
+    if(s->deadzoneLeft!=0) {
+        if(s->relativeLeft) {
+            if((Xbox360_GetAbsolute(left.x)<s->deadzoneLeft)&&(Xbox360_GetAbsolute(left.y)<s->deadzoneLeft)) {
+                left.x=0;
+                left.y=0;
+            }
+            else if(s->deadOffLeft) {
+                left.x=Original_NormalizeAxis(left.x, s->deadzoneLeft);
+                left.y=Original_NormalizeAxis(left.y, s->deadzoneLeft);
+            }
+        } else { // Linked checkbox has no check
+            if(Xbox360_GetAbsolute(left.x)<s->deadzoneLeft)
+                left.x=0;
+            else if (s->deadOffLeft)
+                left.x=Original_NormalizeAxis(left.x, s->deadzoneLeft);
+
+            if(Xbox360_GetAbsolute(left.y)<s->deadzoneLeft)
+                left.y=0;
+            else if (s->deadOffLeft)
+                left.y=Original_NormalizeAxis(left.y, s->deadzoneLeft);
+        }
+    }
+    if(s->deadzoneRight!=0) {
+        if(s->relativeRight) {
+            if((Xbox360_GetAbsolute(right.x)<s->deadzoneRight)&&(Xbox360_GetAbsolute(right.y)<s->deadzoneRight)) {
+                right.x=0;
+                right.y=0;
+            }
+            else if(s->deadOffRight) {
+                // The original normalised the left stick here by mistake
+                left.x=Original_NormalizeAxis(left.x, s->deadzoneRight);
+                left.y=Original_NormalizeAxis(left.y, s->deadzoneRight);
+            }
+        } else {
+            if(Xbox360_GetAbsolute(right.x)<s->deadzoneRight)
+                right.x=0;
+            else if (s->deadOffRight)
+                right.x=Original_NormalizeAxis(right.x, s->deadzoneRight);
+            if(Xbox360_GetAbsolute(right.y)<s->deadzoneRight)
+                right.y=0;
+            else if (s->deadOffRight)
+                right.y=Original_NormalizeAxis(right.y, s->deadzoneRight);
+        }
+    }
+}
+
+static inline void Original_RemapButtons(const ORIGINAL_SETTINGS *s, XBOX360_IN_REPORT *report360)
+{
+    UInt16 new_buttons = 0;
+
+    new_buttons |= ((report360->buttons & 1) == 1) << s->mapping[0];
+    new_buttons |= ((report360->buttons & 2) == 2) << s->mapping[1];
+    new_buttons |= ((report360->buttons & 4) == 4) << s->mapping[2];
+    new_buttons |= ((report360->buttons & 8) == 8) << s->mapping[3];
+    new_buttons |= ((report360->buttons & 16) == 16) << s->mapping[4];
+    new_buttons |= ((report360->buttons & 32) == 32) << s->mapping[5];
+    new_buttons |= ((report360->buttons & 64) == 64) << s->mapping[6];
+    new_buttons |= ((report360->buttons & 128) == 128) << s->mapping[7];
+    new_buttons |= ((report360->buttons & 256) == 256) << s->mapping[8];
+    new_buttons |= ((report360->buttons & 512) == 512) << s->mapping[9];
+    new_buttons |= ((report360->buttons & 1024) == 1024) << s->mapping[10];
+    new_buttons |= ((report360->buttons & 4096) == 4096) << s->mapping[11];
+    new_buttons |= ((report360->buttons & 8192) == 8192) << s->mapping[12];
+    new_buttons |= ((report360->buttons & 16384) == 16384) << s->mapping[13];
+    new_buttons |= ((report360->buttons & 32768) == 32768) << s->mapping[14];
+
+    report360->buttons = new_buttons;
+}
+
+static inline void Original_RemapAxes(XBOX360_IN_REPORT *report360)
+{
+    XBOX360_HAT temp = report360->left;
+    report360->left = report360->right;
+    report360->right = temp;
+}
+
+// The processing part of handleReport
+static inline void Original_HandleReport(const ORIGINAL_SETTINGS *s, XBOX360_IN_REPORT *report)
+{
+    Original_FiddleReport(s, report->left, report->right);
+    if (!s->noMapping)
+        Original_RemapButtons(s, report);
+    if (s->swapSticks)
+        Original_RemapAxes(report);
+}
+
+// The default bindings, which leave every button where it is
+static inline void Original_DefaultMapping(ORIGINAL_SETTINGS *s)
+{
+    for (int i = 0; i < 11; i++)
+        s->mapping[i] = i;
+    for (int i = 12; i < 16; i++)
+        s->mapping[i - 1] = i;
+    s->noMapping = true;
+}
+
+#endif // __ORIGINALREPORT_H__
@@ -0,0 +1,150 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    PacketRingTest.cpp - checks the read ring with a producer and a consumer thread
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <stdio.h>
+#include <thread>
+#include "360Controller/PacketRing.h"
+
+// Packets sent through the ring by the threaded test
+#define PACKET_COUNT    1000000
+
+static XBOX360_PACKET_RING ring;
+static unsigned long failures;
+
+#define CHECK(condition) \
+    do { if (!(condition)) { printf("  %s:%d: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+// Fills a packet with its sequence number followed by a pattern from it,
+// with the length varying from packet to packet
+static UInt32 MakePacket(UInt8 *data, UInt32 sequence)
+{
+    const UInt32 length = 4 + (sequence % (XBOX360_RING_SLOT_SIZE - 3));
+
+    memcpy(data, &sequence, sizeof(sequence));
+    for (UInt32 i = 4; i < length; i++)
+        data[i] = (UInt8)(sequence + i);
+    return length;
+}
+
+// True if a slot holds exactly the packet with that sequence number
+static bool CheckPacket(const XBOX360_RING_SLOT *slot, UInt32 sequence)
+{
+    UInt8 expected[XBOX360_RING_SLOT_SIZE];
+    const UInt32 length = MakePacket(expected, sequence);
+
+    return (slot->length == length) && (memcmp(slot->data, expected, length) == 0);
+}
+
+// One thread: fills the ring, overflows it, and drains it in order
+static void TestSingleThread(void)
+{
+    UInt8 data[XBOX360_RING_SLOT_SIZE * 2];
+    const XBOX360_RING_SLOT *slot;
+
+    Xbox360_RingReset(&ring);
+    CHECK(Xbox360_RingPeek(&ring) == NULL);
+    for (UInt32 i = 0; i < XBOX360_RING_SLOTS; i++)
+        CHECK(Xbox360_RingPut(&ring, data, MakePacket(data, i)));
+    CHECK(!Xbox360_RingPut(&ring, data, MakePacket(data, 99)));
+    CHECK(ring.dropped == 1);
+    for (UInt32 i = 0; i < XBOX360_RING_SLOTS; i++)
+    {
+        slot = Xbox360_RingPeek(&ring);
+        CHECK((slot != NULL) && CheckPacket(slot, i));
+        Xbox360_RingPop(&ring);
+    }
+    CHECK(Xbox360_RingPeek(&ring) == NULL);
+
+    // Oversized packets are cut to the slot size
+    memset(data, 0xAA, sizeof(data));
+    CHECK(Xbox360_RingPut(&ring, data, sizeof(data)));
+    slot = Xbox360_RingPeek(&ring);
+    CHECK((slot != NULL) && (slot->length == XBOX360_RING_SLOT_SIZE));
+    Xbox360_RingPop(&ring);
+
+    // The counts wrap without losing track of how full the ring is
+    ring.head = ring.tail = 0xFFFFFFF8;
+    for (UInt32 i = 0; i < XBOX360_RING_SLOTS; i++)
+        CHECK(Xbox360_RingPut(&ring, data, MakePacket(data, i)));
+    CHECK(!Xbox360_RingPut(&ring, data, MakePacket(data, 99)));
+    for (UInt32 i = 0; i < XBOX360_RING_SLOTS; i++)
+    {
+        slot = Xbox360_RingPeek(&ring);
+        CHECK((slot != NULL) && CheckPacket(slot, i));
+        Xbox360_RingPop(&ring);
+    }
+    CHECK(Xbox360_RingPeek(&ring) == NULL);
+}
+
+// A producer thread retries each packet until the ring takes it, while the
+// consumer checks that every packet arrives once, in order and intact
+static void TestThreads(void)
+{
+    UInt32 rejected = 0, received = 0, corrupt = 0;
+
+    Xbox360_RingReset(&ring);
+    std::thread producer([&rejected] {
+        UInt8 data[XBOX360_RING_SLOT_SIZE];
+
+        for (UInt32 i = 0; i < PACKET_COUNT; i++)
+        {
+            const UInt32 length = MakePacket(data, i);
+
+            while (!Xbox360_RingPut(&ring, data, length))
+            {
+                rejected++;
+                std::this_thread::yield();
+            }
+        }
+    });
+    std::thread consumer([&received, &corrupt] {
+        while (received < PACKET_COUNT)
+        {
+            const XBOX360_RING_SLOT *slot = Xbox360_RingPeek(&ring);
+
+            if (slot == NULL)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            if (!CheckPacket(slot, received))
+                corrupt++;
+            received++;
+            Xbox360_RingPop(&ring);
+        }
+    });
+    producer.join();
+    consumer.join();
+    CHECK(received == PACKET_COUNT);
+    CHECK(corrupt == 0);
+    CHECK(ring.dropped == rejected);
+    CHECK(Xbox360_RingPeek(&ring) == NULL);
+    printf("PacketRingTest: %u packets passed between threads, %u retried when full\n", received, rejected);
+}
+
+int main(void)
+{
+    TestSingleThread();
+    TestThreads();
+    printf("PacketRingTest: %lu failures\n", failures);
+    return (failures == 0) ? 0 : 1;
+}
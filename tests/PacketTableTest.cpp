@@ -0,0 +1,213 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    PacketTableTest.cpp - replays receiver traffic through the packet tables
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "WirelessGamingReceiver/PacketTable.h"
+
+// Largest message read from the receiver
+#define PACKET_MAX      64
+
+// Times the capture is replayed for the throughput figure
+#define REPLAY_PASSES   200000
+
+// One message as read from the receiver, with what the parser should make of it
+typedef struct CAPTURED_PACKET {
+    const char *what;
+    const char *bytes;          // Hex, spaces ignored
+    UInt8 kind;
+    UInt8 value;
+    int payloadOffset;          // -1 for no payload
+    UInt32 payloadLength;
+} CAPTURED_PACKET;
+
+// A controller connecting, sending its info, some input and battery levels,
+// the receiver's idle chatter, and disconnecting
+static const CAPTURED_PACKET capture[] = {
+    { "link up", "08 80",
+      kPacketLink, 0x80, -1, 0 },
+    { "info", "00 0f 00 f0 f0 cc fd 95 52 2a 7e 1c 2a 9c 8a 00 13 a2 00 00 00 00 00 00 00 00 00 00 00",
+      kPacketInfo, 0x13, 17, 12 },
+    { "presence", "00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00",
+      kPacketUpdate, 0x00, 4, 25 },
+    { "input, idle", "00 01 00 f0 00 13 00 00 00 00 10 01 f3 fe 88 00 c2 ff 00 00 00 00 00 00 00 00 00 00 00",
+      kPacketHIDUpdate, 0, 4, 0x13 },
+    { "input, A held", "00 01 00 f0 00 13 00 10 00 00 10 01 f3 fe 88 00 c2 ff 00 00 00 00 00 00 00 00 00 00 00",
+      kPacketHIDUpdate, 0, 4, 0x13 },
+    { "input, sticks", "00 01 00 f0 00 13 00 00 ff 40 ff 7f 00 80 01 00 ff ff 00 00 00 00 00 00 00 00 00 00 00",
+      kPacketHIDUpdate, 0, 4, 0x13 },
+    { "battery", "00 00 00 13 a2 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00",
+      kPacketUpdate, 0x13, 4, 25 },
+    { "status", "00 f8 02 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00",
+      kPacketUnknown, 0, -1, 0 },
+    { "input, bad check", "00 01 00 00 00 13 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00",
+      kPacketUnknown, 0, -1, 0 },
+    { "link down", "08 00",
+      kPacketLink, 0x00, -1, 0 },
+};
+
+#define CAPTURE_COUNT   (sizeof(capture) / sizeof(capture[0]))
+
+static UInt8 packets[CAPTURE_COUNT][PACKET_MAX];
+static UInt32 lengths[CAPTURE_COUNT];
+static unsigned long failures;
+
+#define CHECK(condition, what) \
+    do { if (!(condition)) { printf("  %s:%d: %s: %s\n", __FILE__, __LINE__, what, #condition); failures++; } } while (0)
+
+static UInt32 ParseHex(const char *hex, UInt8 *data)
+{
+    UInt32 length = 0;
+
+    while (*hex != '\0')
+    {
+        if (*hex == ' ')
+        {
+            hex++;
+            continue;
+        }
+        const char digits[3] = { hex[0], hex[1], '\0' };
+
+        data[length++] = (UInt8)strtoul(digits, NULL, 16);
+        hex += 2;
+    }
+    return length;
+}
+
+// Parses a message the way the receiver does: its own link messages first,
+// then the controller's
+static UInt8 Parse(UInt8 *data, UInt32 length, WIRELESS_PACKET *packet)
+{
+    if (Wireless_ParsePacket(Wireless_ReceiverPackets, WIRELESS_PACKET_TYPES(Wireless_ReceiverPackets),
+                             data, length, packet) == kPacketLink)
+        return kPacketLink;
+    return Wireless_ParsePacket(Wireless_ControllerPackets, WIRELESS_PACKET_TYPES(Wireless_ControllerPackets),
+                                data, length, packet);
+}
+
+// The payload has to stay inside the message whatever it claims
+static bool InBounds(const WIRELESS_PACKET *packet, const UInt8 *data, UInt32 length)
+{
+    if (packet->payload == NULL)
+        return packet->payloadLength == 0;
+    return (packet->payload >= data) && ((packet->payload + packet->payloadLength) <= (data + length));
+}
+
+// Every captured message decodes to the kind, value and payload expected
+static void TestReplay(void)
+{
+    for (UInt32 i = 0; i < CAPTURE_COUNT; i++)
+    {
+        const CAPTURED_PACKET *c = &capture[i];
+        WIRELESS_PACKET packet;
+        UInt8 kind = Parse(packets[i], lengths[i], &packet);
+
+        CHECK(kind == c->kind, c->what);
+        CHECK(packet.kind == c->kind, c->what);
+        CHECK(packet.value == c->value, c->what);
+        if (c->payloadOffset < 0)
+            CHECK(packet.payload == NULL, c->what);
+        else
+            CHECK(packet.payload == packets[i] + c->payloadOffset, c->what);
+        CHECK(packet.payloadLength == c->payloadLength, c->what);
+        CHECK(InBounds(&packet, packets[i], lengths[i]), c->what);
+    }
+    CHECK(Wireless_PacketSerial(packets[1]) == 0x7e1c2a9c, "serial");
+}
+
+// Each message cut short at every length, and padded out with zeros to every
+// length up to the largest read, is never taken for what it was and never
+// reads or points past its end. A padded link message is the size of a
+// controller message, so it may pass for one of those instead.
+static void TestSizes(void)
+{
+    for (UInt32 i = 0; i < CAPTURE_COUNT; i++)
+    {
+        for (UInt32 length = 0; length <= PACKET_MAX; length++)
+        {
+            UInt8 *data = (UInt8*)malloc(length + 1);
+            WIRELESS_PACKET packet;
+            UInt8 kind;
+
+            memset(data, 0, length + 1);
+            memcpy(data, packets[i], (length < lengths[i]) ? length : lengths[i]);
+            kind = Parse(data, length, &packet);
+            if (length != lengths[i])
+                CHECK((kind != capture[i].kind) || (kind == kPacketUnknown), capture[i].what);
+            CHECK(InBounds(&packet, data, length), capture[i].what);
+            free(data);
+        }
+    }
+}
+
+// A size byte claiming more than the message holds is cut to the end of the message
+static void TestSizeByte(void)
+{
+    UInt8 data[PACKET_MAX];
+
+    memcpy(data, packets[3], lengths[3]);
+    for (UInt32 size = 0; size < 256; size++)
+    {
+        WIRELESS_PACKET packet;
+
+        data[5] = (UInt8)size;
+        CHECK(Parse(data, lengths[3], &packet) == kPacketHIDUpdate, "size byte");
+        CHECK(packet.payloadLength == ((size < lengths[3] - 4) ? size : lengths[3] - 4), "size byte");
+    }
+}
+
+// Replays the capture over and over, with the input changing, for a throughput figure
+static void TimeReplay(void)
+{
+    unsigned long kinds[kPacketUpdate + 1] = {0};
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    double seconds;
+
+    for (UInt32 pass = 0; pass < REPLAY_PASSES; pass++)
+    {
+        for (UInt32 i = 0; i < CAPTURE_COUNT; i++)
+        {
+            WIRELESS_PACKET packet;
+
+            packets[5][10] = (UInt8)pass;
+            kinds[Parse(packets[i], lengths[i], &packet)]++;
+        }
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    CHECK(kinds[kPacketHIDUpdate] == 3UL * REPLAY_PASSES, "replay");
+    printf("PacketTableTest: %.1f million messages per second\n",
+           ((double)CAPTURE_COUNT * REPLAY_PASSES) / seconds / 1000000.0);
+}
+
+int main(void)
+{
+    for (UInt32 i = 0; i < CAPTURE_COUNT; i++)
+        lengths[i] = ParseHex(capture[i].bytes, packets[i]);
+    TestReplay();
+    TestSizes();
+    TestSizeByte();
+    TimeReplay();
+    printf("PacketTableTest: %lu failures\n", failures);
+    return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,179 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    RadialBench.cpp - checks and times the radial sticks against a float reference
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <stdio.h>
+#include <math.h>
+#include <chrono>
+#include "360Controller/ReportTransform.h"
+
+// Sticks in the working set, and how many times each timing goes over them
+#define STICK_COUNT     4096
+#define STICK_PASSES    2000
+#define TIMING_RUNS     10
+
+// Largest error allowed against the reference, in percent of full scale
+#define ERROR_LIMIT     0.1
+
+typedef struct RADIAL_CASE {
+    short deadzone;
+    bool normalize;
+    short antiDeadzone;
+    short curve;
+} RADIAL_CASE;
+
+static XBOX360_STICK_TABLE table;
+static XBOX360_HAT input[STICK_COUNT];
+static XBOX360_HAT output[STICK_COUNT];
+
+// The radial settings worked out in floating point, for a stick at (x, y)
+static void ReferenceStick(const RADIAL_CASE *c, int x, int y, double *outX, double *outY)
+{
+    const double magnitude = sqrt(((double)x * x) + ((double)y * y));
+    const double clipped = (magnitude > XBOX360_AXIS_MAX) ? XBOX360_AXIS_MAX : magnitude;
+    const double exponent = c->curve / 100.0;
+    double position, lower, upper, shaped;
+
+    if ((magnitude == 0) || (magnitude < c->deadzone))
+    {
+        *outX = *outY = 0;
+        return;
+    }
+    if (c->normalize)
+        position = (clipped - c->deadzone) / (XBOX360_AXIS_MAX - c->deadzone);
+    else
+        position = clipped / XBOX360_AXIS_MAX;
+    // Fractional exponents blend the integer powers either side, as the driver does
+    lower = pow(position, floor(exponent));
+    upper = pow(position, floor(exponent) + 1);
+    shaped = lower + ((upper - lower) * (exponent - floor(exponent)));
+    shaped = c->antiDeadzone + (shaped * (XBOX360_AXIS_MAX - c->antiDeadzone));
+    *outX = x * shaped / magnitude;
+    *outY = y * shaped / magnitude;
+}
+
+// Largest difference from the reference over a grid covering the whole stick
+static double CheckCase(const RADIAL_CASE *c)
+{
+    double worst = 0;
+
+    Xbox360_BuildStickTable(&table, false, false, c->deadzone, false, c->normalize, true, c->antiDeadzone, c->curve);
+    for (int x = -32768; x < 32768; x += 37)
+    {
+        for (int y = -32768; y < 32768; y += 41)
+        {
+            XBOX360_HAT stick;
+            double expectedX, expectedY, error;
+
+            stick.x = (SInt16)x;
+            stick.y = (SInt16)y;
+            Xbox360_ApplyRadialTable(&table, stick);
+            ReferenceStick(c, x, y, &expectedX, &expectedY);
+            error = fmax(fabs(expectedX - stick.x), fabs(expectedY - stick.y));
+            if (error > worst)
+                worst = error;
+        }
+    }
+    return 100.0 * worst / XBOX360_AXIS_MAX;
+}
+
+// Nanoseconds per stick of the current table, as the mean and the slowest of several runs
+template <unsigned kMode>
+static void TimeSticks(double *mean, double *slowest)
+{
+    double total = 0;
+
+    *slowest = 0;
+    for (int run = 0; run < TIMING_RUNS; run++)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        double elapsed;
+
+        for (int pass = 0; pass < STICK_PASSES; pass++)
+        {
+            for (int i = 0; i < STICK_COUNT; i++)
+            {
+                output[i] = input[i];
+                Xbox360_ShapeStick<kMode>(&table, output[i]);
+            }
+        }
+        elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        elapsed /= (double)STICK_COUNT * STICK_PASSES;
+        total += elapsed;
+        if (elapsed > *slowest)
+            *slowest = elapsed;
+    }
+    *mean = total / TIMING_RUNS;
+}
+
+int main(void)
+{
+    static const RADIAL_CASE cases[] = {
+        { 8000, true, 0, 100 },
+        { 8000, true, 3000, 200 },
+        { 0, false, 0, 250 },
+        { 5000, false, 2000, 100 },
+        { 3000, true, 0, 400 },
+    };
+    int failures = 0;
+    double mean, slowest;
+
+    // The square root has to be exact, as the curve lookup depends on it
+    for (UInt64 value = 0; value <= 0xFFFFFFFFULL; value += 9973)
+    {
+        const UInt64 root = Xbox360_SquareRoot((UInt32)value);
+
+        if (((root * root) > value) || (((root + 1) * (root + 1)) <= value))
+        {
+            printf("square root of %llu: got %llu\n", (unsigned long long)value, (unsigned long long)root);
+            failures++;
+            break;
+        }
+    }
+
+    printf("%-10s %-10s %-10s %-8s %10s\n", "deadzone", "normalize", "anti", "curve", "error %");
+    for (unsigned i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        const double error = CheckCase(&cases[i]);
+
+        printf("%-10d %-10s %-10d %-8d %10.4f\n", cases[i].deadzone, cases[i].normalize ? "yes" : "no",
+               cases[i].antiDeadzone, cases[i].curve, error);
+        if (error > ERROR_LIMIT)
+            failures++;
+    }
+
+    for (int i = 0; i < STICK_COUNT; i++)
+    {
+        input[i].x = (SInt16)(i * 7919);
+        input[i].y = (SInt16)(i * 104729);
+    }
+    printf("%-20s %10s %10s\n", "stick", "mean ns", "slowest ns");
+    Xbox360_BuildStickTable(&table, false, true, 8000, false, true, false, 0, XBOX360_CURVE_LINEAR);
+    TimeSticks<stickAxial>(&mean, &slowest);
+    printf("%-20s %10.2f %10.2f\n", "axial", mean, slowest);
+    Xbox360_BuildStickTable(&table, false, true, 8000, true, true, false, 0, XBOX360_CURVE_LINEAR);
+    TimeSticks<stickLinked>(&mean, &slowest);
+    printf("%-20s %10.2f %10.2f\n", "linked", mean, slowest);
+    Xbox360_BuildStickTable(&table, false, true, 8000, false, true, true, 3000, 250);
+    TimeSticks<stickRadial>(&mean, &slowest);
+    printf("%-20s %10.2f %10.2f\n", "radial", mean, slowest);
+    return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,62 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    ReportProcessor.cpp - the drivers' report processing as a host library
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include "ReportProcessor.h"
+
+void Xbox360_DefaultSettings(XBOX360_PROCESSOR_SETTINGS *settings)
+{
+    memset(settings, 0, sizeof(*settings));
+    settings->curveLeft = settings->curveRight = XBOX360_CURVE_LINEAR;
+    settings->noMapping = true;
+    for (int i = 0; i < 11; i++)
+        settings->mapping[i] = i;
+    for (int i = 12; i < 16; i++)
+        settings->mapping[i - 1] = i;
+}
+
+void Xbox360_SetupProcessor(XBOX360_PROCESSOR *processor, const XBOX360_PROCESSOR_SETTINGS *settings)
+{
+    // The Y axes are flipped unless the user asked for them to be inverted
+    Xbox360_BuildStickTable(&processor->left, settings->invertLeftX, !settings->invertLeftY,
+                            settings->deadzoneLeft, settings->relativeLeft, settings->deadOffLeft,
+                            settings->radialLeft, settings->antiDeadzoneLeft, settings->curveLeft);
+    Xbox360_BuildStickTable(&processor->right, settings->invertRightX, !settings->invertRightY,
+                            settings->deadzoneRight, settings->relativeRight, settings->deadOffRight,
+                            settings->radialRight, settings->antiDeadzoneRight, settings->curveRight);
+    Xbox360_BuildButtonTable(&processor->buttons, settings->mapping);
+    processor->state.left = &processor->left;
+    processor->state.right = &processor->right;
+    processor->state.buttons = &processor->buttons;
+    processor->transform = Xbox360_SelectTransform(Xbox360_TransformFlags(&processor->left, &processor->right,
+                                                                          !settings->noMapping, settings->swapSticks));
+}
+
+void Xbox360_ProcessReport(const XBOX360_PROCESSOR *processor, XBOX360_IN_REPORT *report)
+{
+    processor->transform(report, &processor->state);
+}
+
+void Xbox360_ProcessReports(const XBOX360_PROCESSOR *processor, XBOX360_IN_REPORT *reports, int count)
+{
+    Xbox360_TransformReports(processor->transform, reports, count, &processor->state);
+}
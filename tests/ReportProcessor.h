@@ -0,0 +1,61 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    ReportProcessor.h - the drivers' report processing as a host library
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __REPORTPROCESSOR_H__
+#define __REPORTPROCESSOR_H__
+
+#include "360Controller/ReportTransform.h"
+
+// The settings the drivers read from their properties, as they name them
+typedef struct XBOX360_PROCESSOR_SETTINGS {
+    bool invertLeftX, invertLeftY;
+    bool invertRightX, invertRightY;
+    short deadzoneLeft, deadzoneRight;
+    bool relativeLeft, relativeRight;
+    bool deadOffLeft, deadOffRight;
+    bool radialLeft, radialRight;
+    short antiDeadzoneLeft, antiDeadzoneRight;
+    short curveLeft, curveRight;
+    bool swapSticks;
+    UInt8 mapping[15];
+    bool noMapping;
+} XBOX360_PROCESSOR_SETTINGS;
+
+// Tables and transform for one set of settings, as a driver holds them
+typedef struct XBOX360_PROCESSOR {
+    XBOX360_STICK_TABLE left, right;
+    XBOX360_BUTTON_TABLE buttons;
+    XBOX360_TRANSFORM_STATE state;
+    XBOX360_REPORT_TRANSFORM transform;
+} XBOX360_PROCESSOR;
+
+// Fills in the settings a driver starts with
+void Xbox360_DefaultSettings(XBOX360_PROCESSOR_SETTINGS *settings);
+
+// Builds the tables and picks the transform, as the drivers do when the settings change
+void Xbox360_SetupProcessor(XBOX360_PROCESSOR *processor, const XBOX360_PROCESSOR_SETTINGS *settings);
+
+// Transforms reports in place
+void Xbox360_ProcessReport(const XBOX360_PROCESSOR *processor, XBOX360_IN_REPORT *report);
+void Xbox360_ProcessReports(const XBOX360_PROCESSOR *processor, XBOX360_IN_REPORT *reports, int count);
+
+#endif // __REPORTPROCESSOR_H__
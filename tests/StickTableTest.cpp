@@ -0,0 +1,123 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    StickTableTest.cpp - checks the stick tables against the original float code
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <stdio.h>
+#include <string.h>
+#include "OriginalReport.h"
+
+// The deadzone sliders go from 0 to 32768, which the driver reads as a short
+#define DEADZONE_SETTINGS   32769
+
+// Pairs every x with a different y, so each raw value is seen on both axes
+#define PAIR_Y(x, deadzone) ((UInt16)(((x) * 40503) + (deadzone)))
+
+// Settings of one stick, as the driver had them before the tables
+typedef struct STICK_SETTINGS {
+    bool invertX, invertY;
+    short deadzone;
+    bool relative;
+    bool deadOff;
+} STICK_SETTINGS;
+
+static XBOX360_STICK_TABLE table;
+static unsigned long checked, failures;
+
+// Puts one stick's settings on the original code's left stick, as the right
+// stick only differed by normalising the left stick by mistake
+static void OriginalSettings(ORIGINAL_SETTINGS *original, const STICK_SETTINGS& settings)
+{
+    memset(original, 0, sizeof(*original));
+    original->invertLeftX = settings.invertX;
+    original->invertLeftY = settings.invertY;
+    original->deadzoneLeft = settings.deadzone;
+    original->relativeLeft = settings.relative;
+    original->deadOffLeft = settings.deadOff;
+}
+
+// Runs every raw value through the table for one set of settings, both as x and as y
+static void CheckSettings(const STICK_SETTINGS& settings)
+{
+    ORIGINAL_SETTINGS original;
+
+    OriginalSettings(&original, settings);
+    // The drivers flip the Y axis unless it is inverted, as fiddleReport did
+    Xbox360_BuildStickTable(&table, settings.invertX, !settings.invertY, settings.deadzone,
+                            settings.relative, settings.deadOff, false, 0, XBOX360_CURVE_LINEAR);
+    for (UInt32 i = 0; i < XBOX360_AXIS_VALUES; i++)
+    {
+        XBOX360_HAT expected, actual, right = {0, 0};
+
+        expected.x = (SInt16)i;
+        expected.y = (SInt16)PAIR_Y(i, settings.deadzone);
+        actual = expected;
+        Original_FiddleReport(&original, expected, right);
+        if (Xbox360_StickMode(&table) == stickLinked)
+            Xbox360_ApplyStickTable<true>(&table, actual);
+        else
+            Xbox360_ApplyStickTable<false>(&table, actual);
+        checked++;
+        if ((expected.x != actual.x) || (expected.y != actual.y))
+        {
+            if (failures++ < 10)
+                printf("  deadzone %d%s%s%s%s, in (%d, %d): expected (%d, %d), got (%d, %d)\n",
+                       settings.deadzone, settings.invertX ? " invertX" : "", settings.invertY ? " invertY" : "",
+                       settings.relative ? " linked" : "", settings.deadOff ? " normalized" : "",
+                       (SInt16)i, (SInt16)PAIR_Y(i, settings.deadzone), expected.x, expected.y, actual.x, actual.y);
+        }
+    }
+}
+
+int main(void)
+{
+    STICK_SETTINGS settings;
+
+    // Every deadzone with each combination of linked and normalised. The inversion
+    // only changes which entry is read, so the four combinations take turns.
+    for (int deadzone = 0; deadzone < DEADZONE_SETTINGS; deadzone++)
+    {
+        for (int flags = 0; flags < 4; flags++)
+        {
+            settings.invertX = (deadzone & 1) != 0;
+            settings.invertY = (deadzone & 2) != 0;
+            settings.deadzone = (short)deadzone;
+            settings.relative = (flags & 1) != 0;
+            settings.deadOff = (flags & 2) != 0;
+            CheckSettings(settings);
+        }
+    }
+    // And every combination of all the options at a spread of deadzones
+    for (int deadzone = 0; deadzone < DEADZONE_SETTINGS; deadzone += 1021)
+    {
+        for (int flags = 0; flags < 16; flags++)
+        {
+            settings.invertX = (flags & 1) != 0;
+            settings.invertY = (flags & 2) != 0;
+            settings.deadzone = (short)deadzone;
+            settings.relative = (flags & 4) != 0;
+            settings.deadOff = (flags & 8) != 0;
+            CheckSettings(settings);
+        }
+    }
+
+    printf("StickTableTest: %lu sticks checked, %lu differ\n", checked, failures);
+    return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,169 @@
+/*
+    MICE Xbox 360 Controller driver for Mac OS X
+    Copyright (C) 2006-2013 Colin Munro
+
+    TransformBench.cpp - times the report processing library against the original code
+
+    This file is part of Xbox360Controller.
+
+    Xbox360Controller is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Xbox360Controller is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include "OriginalReport.h"
+#include "ReportProcessor.h"
+
+// Reports in the working set, and how many times each run goes over them
+#define REPORT_COUNT    4096
+#define REPORT_PASSES   2000
+
+typedef struct BENCH_CASE {
+    const char *name;
+    ORIGINAL_SETTINGS settings;
+} BENCH_CASE;
+
+static XBOX360_IN_REPORT input[REPORT_COUNT];
+static XBOX360_IN_REPORT expected[REPORT_COUNT];
+static XBOX360_IN_REPORT actual[REPORT_COUNT];
+static XBOX360_PROCESSOR processor;
+
+// Small generator so every run sees the same reports
+static UInt32 NextRandom(UInt32 *seed)
+{
+    *seed = (*seed * 1103515245) + 12345;
+    return *seed >> 8;
+}
+
+static void MakeReports(void)
+{
+    UInt32 seed = 1;
+
+    for (int i = 0; i < REPORT_COUNT; i++)
+    {
+        memset(&input[i], 0, sizeof(input[i]));
+        input[i].header.command = 0x00;
+        input[i].header.size = sizeof(XBOX360_IN_REPORT);
+        input[i].buttons = (UInt16)NextRandom(&seed);
+        input[i].trigL = (UInt8)NextRandom(&seed);
+        input[i].trigR = (UInt8)NextRandom(&seed);
+        input[i].left.x = (SInt16)NextRandom(&seed);
+        input[i].left.y = (SInt16)NextRandom(&seed);
+        input[i].right.x = (SInt16)NextRandom(&seed);
+        input[i].right.y = (SInt16)NextRandom(&seed);
+    }
+}
+
+// Nanoseconds per report of running a function over the working set
+template <typename Function>
+static double TimeReports(XBOX360_IN_REPORT *reports, Function process)
+{
+    std::chrono::steady_clock::time_point start;
+    double elapsed;
+
+    start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < REPORT_PASSES; pass++)
+    {
+        memcpy(reports, input, sizeof(input));
+        process(reports);
+    }
+    elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    return elapsed / ((double)REPORT_COUNT * REPORT_PASSES);
+}
+
+// Copies the original settings into the library's, which start as the drivers' defaults
+static void ProcessorSettings(XBOX360_PROCESSOR_SETTINGS *settings, const ORIGINAL_SETTINGS *s)
+{
+    Xbox360_DefaultSettings(settings);
+    settings->invertLeftX = s->invertLeftX;
+    settings->invertLeftY = s->invertLeftY;
+    settings->invertRightX = s->invertRightX;
+    settings->invertRightY = s->invertRightY;
+    settings->deadzoneLeft = s->deadzoneLeft;
+    settings->deadzoneRight = s->deadzoneRight;
+    settings->relativeLeft = s->relativeLeft;
+    settings->relativeRight = s->relativeRight;
+    settings->deadOffLeft = s->deadOffLeft;
+    settings->deadOffRight = s->deadOffRight;
+    settings->swapSticks = s->swapSticks;
+    memcpy(settings->mapping, s->mapping, sizeof(settings->mapping));
+    settings->noMapping = s->noMapping;
+}
+
+int main(void)
+{
+    BENCH_CASE cases[5];
+    int failures = 0;
+
+    MakeReports();
+    for (int i = 0; i < 5; i++)
+    {
+        memset(&cases[i].settings, 0, sizeof(cases[i].settings));
+        Original_DefaultMapping(&cases[i].settings);
+    }
+    cases[0].name = "defaults";
+    cases[1].name = "deadzones";
+    cases[1].settings.deadzoneLeft = 4000;
+    cases[1].settings.deadzoneRight = 6000;
+    cases[1].settings.deadOffLeft = true;
+    cases[1].settings.deadOffRight = true;
+    cases[2].name = "linked deadzones";
+    cases[2].settings.deadzoneLeft = 4000;
+    cases[2].settings.deadzoneRight = 6000;
+    cases[2].settings.relativeLeft = true;
+    cases[2].settings.relativeRight = true;
+    cases[2].settings.deadOffLeft = true;
+    cases[3].name = "remap and swap";
+    cases[3].settings.noMapping = false;
+    cases[3].settings.mapping[0] = 1;
+    cases[3].settings.mapping[1] = 0;
+    cases[3].settings.swapSticks = true;
+    cases[4].name = "everything";
+    cases[4].settings = cases[2].settings;
+    cases[4].settings.invertLeftX = true;
+    cases[4].settings.invertRightY = true;
+    cases[4].settings.noMapping = false;
+    cases[4].settings.mapping[2] = 3;
+    cases[4].settings.mapping[3] = 2;
+    cases[4].settings.swapSticks = true;
+
+    printf("%-20s %12s %12s %8s\n", "settings", "original ns", "transform ns", "speedup");
+    for (int i = 0; i < 5; i++)
+    {
+        const ORIGINAL_SETTINGS *s = &cases[i].settings;
+        XBOX360_PROCESSOR_SETTINGS settings;
+        double original, current;
+
+        ProcessorSettings(&settings, s);
+        Xbox360_SetupProcessor(&processor, &settings);
+
+        // A linked, normalised right stick hit the original's bug, so none of
+        // the cases use it and every output can be compared
+        original = TimeReports(expected, [s](XBOX360_IN_REPORT *reports) {
+            for (int j = 0; j < REPORT_COUNT; j++)
+                Original_HandleReport(s, &reports[j]);
+        });
+        current = TimeReports(actual, [](XBOX360_IN_REPORT *reports) {
+            Xbox360_ProcessReports(&processor, reports, REPORT_COUNT);
+        });
+        if (memcmp(expected, actual, sizeof(actual)) != 0)
+        {
+            printf("%s: transformed reports differ from the original\n", cases[i].name);
+            failures++;
+        }
+        printf("%-20s %12.2f %12.2f %7.1fx\n", cases[i].name, original, current, original / current);
+    }
+    return (failures == 0) ? 0 : 1;
+}